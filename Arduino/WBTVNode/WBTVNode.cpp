@@ -1,11 +1,20 @@
 #include "WBTVNode.h"
 
+#ifdef WBTV_STATS
+#define WBTV_COUNT(counter) WBTV_stat_inc(&statCounters.counter)
+#define WBTV_COUNT_N(counter, n) WBTV_stat_add(&statCounters.counter, n)
+#else
+#define WBTV_COUNT(counter)
+#define WBTV_COUNT_N(counter, n)
+#endif
+
 /*
  *Instantiate a wired-OR WBTV node with CSMA, collision avoidance,
  *and collision detection. bus_sense_pin must be the RX pin, and
- *port must be a Serial or other stream object
+ *port must be a Serial or other stream object.
+ *buffer is the recieve buffer, which WBTVSizedNode owns.
  */
- WBTVNode::WBTVNode(Stream *port,int bus_sense_pin)
+ WBTVNodeBase::WBTVNodeBase(Stream *port,int bus_sense_pin, unsigned char * buffer, unsigned char capacity) : WBTVReceiver<WBTVNodeBase>(buffer, capacity)
 {
   BUS_PORT=port;
   sensepin = bus_sense_pin;
@@ -13,30 +22,120 @@
   
     MIN_BACKOFF = 1100;
     MAX_BACKOFF = 1200;
-    recievePointer = 0;
-    sumSlow=sumFast =0;
-    escape = 0;
-    garbage = 0;
+    PRIORITY_WINDOW = 0;
+    ECHO_WINDOW = 1;
+    #ifdef WBTV_ADV_MODE
+    PASS_TIME = 0;
+    #endif
+    txCount = 0;
+    memset(channelRules, 0, sizeof(channelRules));
+    txNextHandle = 0;
+    txState = WBTV_TX_IDLE;
+    bulkRemaining = 0;
+    callback = 0;
+    stringCallback = 0;
+    memset(subscriptions, 0, sizeof(subscriptions));
+    dispatchLookup = 0;
+    #ifdef WBTV_PATTERNS
+    trie = 0;
+    trieHandlers = 0;
+    rxActiveCount = 0;
+    rxMatched = 0;
+    #endif
+    segmentCallback = 0;
+    rxRing = 0;
+    rxStamped = 0;
+    #ifdef WBTV_RECORD_TIME
+    lastServiced = 0;
+    #endif
+    #ifdef WBTV_STATS
+    rxIsStat = 0;
+    STAT_INTERVAL = 0;
+    statSent = 0;
+    txWaitBegan = 0;
+    clearStats();
+    #endif
+    #ifdef WBTV_TRACE
+    rxIsTrace = 0;
+    #endif
+    #ifdef WBTV_CHANNEL_ALIASES
+    rxIsAlias = 0;
+    memset(aliases, 0, sizeof(aliases));
+    aliasNext = 0;
+    ALIAS_INTERVAL = 0;
+    aliasSent = 0;
+    aliasResume = WBTV_CHANNEL_RULES;
+    #endif
+    #ifdef WBTV_ADAPTIVE_BACKOFF
+    txBackoffExp = 0;
+    rxLoad = 0;
+    rxFrameStart = rxFrameEnd = 0;
+    #endif
     }
 
 /*
  *This lets you use WBTV over full duplex connections like usb to serial.
  */
-WBTVNode::WBTVNode(Stream *port)
+WBTVNodeBase::WBTVNodeBase(Stream *port, unsigned char * buffer, unsigned char capacity) : WBTVReceiver<WBTVNodeBase>(buffer, capacity)
 {
 BUS_PORT=port;
 wiredor =0;
 
 MIN_BACKOFF = 1100;
 MAX_BACKOFF = 1200;
-recievePointer = 0;
-sumSlow=sumFast =0;
-escape = 0;
-garbage = 0;
+PRIORITY_WINDOW = 0;
+ECHO_WINDOW = 1;
+#ifdef WBTV_ADV_MODE
+PASS_TIME = 0;
+#endif
+txCount = 0;
+memset(channelRules, 0, sizeof(channelRules));
+txNextHandle = 0;
+txState = WBTV_TX_IDLE;
+bulkRemaining = 0;
+callback = 0;
+stringCallback = 0;
+memset(subscriptions, 0, sizeof(subscriptions));
+dispatchLookup = 0;
+#ifdef WBTV_PATTERNS
+trie = 0;
+trieHandlers = 0;
+rxActiveCount = 0;
+rxMatched = 0;
+#endif
+segmentCallback = 0;
+rxRing = 0;
+rxStamped = 0;
+#ifdef WBTV_RECORD_TIME
+lastServiced = 0;
+#endif
+#ifdef WBTV_STATS
+rxIsStat = 0;
+STAT_INTERVAL = 0;
+statSent = 0;
+txWaitBegan = 0;
+clearStats();
+#endif
+#ifdef WBTV_TRACE
+rxIsTrace = 0;
+#endif
+#ifdef WBTV_CHANNEL_ALIASES
+rxIsAlias = 0;
+memset(aliases, 0, sizeof(aliases));
+aliasNext = 0;
+ALIAS_INTERVAL = 0;
+aliasSent = 0;
+aliasResume = WBTV_CHANNEL_RULES;
+#endif
+#ifdef WBTV_ADAPTIVE_BACKOFF
+txBackoffExp = 0;
+rxLoad = 0;
+rxFrameStart = rxFrameEnd = 0;
+#endif
     
 }
 
-void WBTVNode::dummyCallback(
+void WBTVNodeBase::dummyCallback(
 unsigned char * header, 
 unsigned char headerlen, 
 unsigned char * data, 
@@ -46,7 +145,7 @@ unsigned char datalen)
 }
 
 
-void WBTVNode::setBinaryCallback(
+void WBTVNodeBase::setBinaryCallback(
 void (*thecallback)(
 unsigned char *, 
 unsigned char , 
@@ -58,424 +157,1511 @@ unsigned char ))
 
 
 /*Set a function taking two strings as input to be called when a packet arrives*/
-void WBTVNode::setStringCallback( void (*thecallback)( char *,  char *))
+void WBTVNodeBase::setStringCallback( void (*thecallback)( char *,  char *))
 {
   stringCallback = thecallback;
   callback = 0;
 }
 
-void WBTVNode::stringSendMessage(const char *channel, const char *data)
+/*
+ *Set a function to get every message that isn't subscribed to, with its data split up into segments.
+ *Takes the place of the binary and string callbacks while it is set.
+ */
+void WBTVNodeBase::setSegmentCallback(WBTV_segment_callback thecallback)
 {
-sendMessage((const unsigned char *)channel,strlen(channel),(const unsigned char *) data,strlen(data));
+  segmentCallback = thecallback;
 }
 
+//Lets subscribers and dispatcher handlers get at the segments of the message they were called for.
+const struct WBTV_segments * WBTVNodeBase::segments()
+{
+  return &rxSegments;
+}
 
-/*Given a channel as pointer to unsigned char, channel length, data, and data length, send it out the serial port.*/
-void WBTVNode::sendMessage(const unsigned char * channel, const unsigned char channellen, const unsigned char * data, const unsigned char datalen)
+/*
+ *Call handler for every message on channel, passing userdata along with it.
+ *Subscribing to a channel that already has a handler replaces it.
+ *Messages on channels nobody subscribed to go to the binary or string callback if there is one,
+ *and if there isn't they are dropped as soon as the ~ arrives, without buffering the data.
+ *The channel is not copied, it needs to stay around. String literals are fine.
+ *Returns 0 if all WBTV_SUBSCRIPTIONS entries are used.
+ */
+unsigned char WBTVNodeBase::subscribe(const unsigned char * channel, unsigned char channellen, WBTV_handler handler, void * userdata)
 {
-  unsigned char i;
-  //If at any time an error is found, go back here to retry
-waiting:
+  unsigned char i, slow, fast;
+  struct WBTV_subscription *sub = 0;
 
-  //Wait till the bus is free
-  if(wiredor)
+  //The same fletcher sum the decoder will have for the header when the ~ arrives.
+  slow = fast = 0;
+  for (i = 0; i < channellen; i++)
   {
-    waitTillICanSend();
+    slow += channel[i];
+    fast += slow;
   }
-  //Reset the checksum engine
-  sumSlow = sumFast =0;
 
-  //Basically, send bytes, if we get interfered with, go back to waiting
-
-
-#ifdef DUMMY_WBTV_STH
-  //Sent dummy start code for reliabilty in case there was noise that looked like an WBTV_ESC.
-  //This is really just there for paranoia reasons but it's a nice addition and it's only one more byte.
-  if (!writeWrapper(WBTV_STH))
+  for (i = 0; i < WBTV_SUBSCRIPTIONS; i++)
   {
-    goto waiting;
+    if (subscriptions[i].handler &&
+        (subscriptions[i].channellen == channellen) &&
+        (memcmp(subscriptions[i].channel, channel, channellen) == 0))
+    {
+      sub = &subscriptions[i];
+      break;
+    }
+    if (!subscriptions[i].handler && !sub)
+    {
+      sub = &subscriptions[i];
+    }
   }
-#endif
-
-  if (!writeWrapper(WBTV_STH))//Sent start code
+  if (!sub)
   {
-    goto waiting;
+    return 0;
   }
-  //Send header(escaped)
-  for (i = 0; i<channellen;i++)
+
+  sub->channel = channel;
+  sub->channellen = channellen;
+  sub->sumSlow = slow;
+  sub->sumFast = fast;
+  sub->userdata = userdata;
+  sub->handler = handler;
+  return 1;
+}
+
+unsigned char WBTVNodeBase::stringSubscribe(const char * channel, WBTV_handler handler, void * userdata)
+{
+  return subscribe((const unsigned char *)channel, strlen(channel), handler, userdata);
+}
+
+void WBTVNodeBase::unsubscribe(const unsigned char * channel, unsigned char channellen)
+{
+  unsigned char i;
+  for (i = 0; i < WBTV_SUBSCRIPTIONS; i++)
   {
-    updateHash(channel[i]); ///Update the hash with every header byte we send
-    if (!escapedWrite(channel[i]))
+    if (subscriptions[i].handler &&
+        (subscriptions[i].channellen == channellen) &&
+        (memcmp(subscriptions[i].channel, channel, channellen) == 0))
     {
-      goto waiting;
+      subscriptions[i].handler = 0;
+    }
+  }
+}
 
+/*
+ *Called when the ~ arrives with the header in message[] and its checksum in rxSumSlow/rxSumFast.
+ *Comparing the sums first means memcmp only runs on what is almost certainly a match.
+ */
+unsigned char WBTVNodeBase::findSubscription()
+{
+  unsigned char i;
+  for (i = 0; i < WBTV_SUBSCRIPTIONS; i++)
+  {
+    if (subscriptions[i].handler &&
+        (subscriptions[i].sumSlow == rxSumSlow) &&
+        (subscriptions[i].sumFast == rxSumFast) &&
+        (subscriptions[i].channellen == headerTerminatorPosition) &&
+        (memcmp(subscriptions[i].channel, message, headerTerminatorPosition) == 0))
+    {
+      return i;
     }
   }
+  return WBTV_NO_SUBSCRIPTION;
+}
+
+WBTV_tx_handle WBTVNodeBase::stringSendMessage(const char *channel, const char *data)
+{
+return sendMessage((const unsigned char *)channel,strlen(channel),(const unsigned char *) data,strlen(data));
+}
 
-  //Send the start-of-message(end of header)
-  if (!writeWrapper(WBTV_STX))
+
+/*
+ *Given a channel as pointer to unsigned char, channel length, data, and data length, queue it to be sent out the serial port.
+ *The channel and data are copied so the caller can reuse them right away.
+ *Returns a handle for isSending(), or 0 if the queue is full or the frame is too big to ever be recieved,
+ *which is when channellen+datalen+3 is more than WBTV_MAX_MESSAGE. See WBTV_RX_SIZE.
+ */
+WBTV_tx_handle WBTVNodeBase::sendMessage(const unsigned char * channel, const unsigned char channellen, const unsigned char * data, const unsigned char datalen)
+{
+  struct WBTV_tx_slot *slot;
+
+  slot = allocateSlot(channel, channellen, datalen);
+  if (!slot)
   {
-    goto waiting;
+    return 0;
   }
+  memcpy(slot->buf + slot->channellen, data, datalen);
 
-#ifdef WBTV_HASH_STX
-  updateHash(WBTV_STX);
-#endif
+  //On a full duplex link this sends the whole thing right now, on a bus it starts the backoff clock.
+  serviceTransmit();
+  WBTV_TRACE_POINT(WBTV_EV_QUEUED);
+  return slot->handle;
+}
 
-  //Send the message(escaped)
-  for (i = 0; i<datalen;i++)
+/*
+ *Send a frame with several data segments, which go out separated by ~ like the channel is.
+ *segments[i] is lengths[i] bytes long. Everything is copied, so it doesn't need to stay around.
+ *Cheaper than sending each one as its own message since there is one start, checksum and backoff for all of them.
+ *Returns 0 if the queue is full, the frame is too big, or there are more than WBTV_MAX_SEGMENTS segments.
+ */
+WBTV_tx_handle WBTVNodeBase::sendMessage(const unsigned char * channel, unsigned char channellen, const unsigned char * const * segments, const unsigned char * lengths, unsigned char count)
+{
+  struct WBTV_tx_slot *slot;
+  unsigned int datalen = 0;
+  unsigned char i, pos;
+
+  if (!count || (count > WBTV_MAX_SEGMENTS))
   {
-    updateHash(data[i]); //Hash the message
-    if (!escapedWrite(data[i]))
-    {
-      goto waiting;
+    return 0;
+  }
+  for (i = 0; i < count; i++)
+  {
+    datalen += lengths[i];
+  }
+  //Each ~ between segments takes a byte in the reciever too
+  if (WBTV_RX_SIZE(channellen, datalen, count - 1) > WBTV_MAX_MESSAGE)
+  {
+    return 0;
+  }
 
+  slot = allocateSlot(channel, channellen, datalen, WBTV_PRIORITY_DEFAULT, count - 1);
+  if (!slot)
+  {
+    return 0;
+  }
+  pos = slot->channellen;
+  for (i = 0; i < count; i++)
+  {
+    if (i)
+    {
+      slot->separatorAt[i - 1] = pos;
     }
+    memcpy(slot->buf + pos, segments[i], lengths[i]);
+    pos += lengths[i];
   }
+  slot->separators = count - 1;
+
+  serviceTransmit();
+  WBTV_TRACE_POINT(WBTV_EV_QUEUED);
+  return slot->handle;
+}
 
-  if (!escapedWrite(sumSlow))
+WBTV_tx_handle WBTVNodeBase::stringSendMessage(const char *channel, const char * const * segments, unsigned char count)
+{
+  unsigned char lengths[WBTV_MAX_SEGMENTS];
+  unsigned char i;
 
+  if (count > WBTV_MAX_SEGMENTS)
+  {
+    return 0;
+  }
+  for (i = 0; i < count; i++)
   {
-    goto waiting;
+    lengths[i] = strlen(segments[i]);
   }
+  return sendMessage((const unsigned char *)channel, strlen(channel), (const unsigned char * const *)segments, lengths, count);
+}
+
+/*
+ *Send a message whose data is in several pieces, wherever they are, without putting it together in a buffer first.
+ *Each piece is copied straight into the queue right after the one before, and they all go out as one segment.
+ *Returns 0 if the queue is full or the pieces add up to more than a node can recieve.
+ */
+WBTV_tx_handle WBTVNodeBase::sendMessage(const unsigned char * channel, unsigned char channellen, const struct WBTV_piece * pieces, unsigned char count)
+{
+  struct WBTV_tx_slot *slot;
+  unsigned int datalen = 0;
+  unsigned char i;
+  unsigned char *p;
 
-  if (!escapedWrite(sumFast))
+  for (i = 0; i < count; i++)
+  {
+    datalen += pieces[i].len;
+  }
+  //Checked here as well as in allocateSlot() because datalen has to fit in its unsigned char
+  if (WBTV_RX_SIZE(channellen, datalen, 0) > WBTV_MAX_MESSAGE)
   {
-    goto waiting;
+    return 0;
   }
 
-  if (!writeWrapper(WBTV_EOT))
+  slot = allocateSlot(channel, channellen, datalen);
+  if (!slot)
   {
-    goto waiting;
+    return 0;
   }
+  p = slot->buf + slot->channellen;
+  for (i = 0; i < count; i++)
+  {
+    memcpy(p, pieces[i].data, pieces[i].len);
+    p += pieces[i].len;
+  }
+  return queued(slot);
 }
 
-//Note that one hash engine gets used for sending and recieving. This works for now because we calc the hash all at once after we are
-//done recieving
-//i.e. hashing a recieved packet is atomic
-void WBTVNode::updateHash(unsigned char chr)
+//Start sending a slot that has just been filled in, for publish() and friends.
+WBTV_tx_handle WBTVNodeBase::queued(struct WBTV_tx_slot * slot)
 {
-  //This is a fletcher-256 hash. Not quite as good as a CRC, but pretty good.
-  sumSlow += chr;
-  sumFast += sumSlow; 
+  serviceTransmit();
+  WBTV_TRACE_POINT(WBTV_EV_QUEUED);
+  return slot->handle;
 }
 
-void WBTVNode::service()
+/*
+ *Same as sendMessage, but with a priority for just this message instead of the channel's.
+ *See setChannelPriority() and PRIORITY_WINDOW for what priority does.
+ */
+WBTV_tx_handle WBTVNodeBase::sendMessage(const unsigned char * channel, unsigned char channellen, const unsigned char * data, unsigned char datalen, unsigned char priority)
 {
-    if (BUS_PORT->available())
-    {
-      decodeChar(BUS_PORT->read());
-    }
-    
-lastServiced = millis();
+  struct WBTV_tx_slot *slot;
+
+  slot = allocateSlot(channel, channellen, datalen, priority);
+  if (!slot)
+  {
+    return 0;
+  }
+  memcpy(slot->buf + slot->channellen, data, datalen);
 
+  serviceTransmit();
+  WBTV_TRACE_POINT(WBTV_EV_QUEUED);
+  return slot->handle;
 }
 
-//Process one incoming char
-void WBTVNode::decodeChar(unsigned char chr)
+//Returns true while the frame is still queued or going out.
+unsigned char WBTVNodeBase::isSending(WBTV_tx_handle handle)
 {
-  //Set the garbage flag if we get a message that is too long
-  if (recievePointer > WBTV_MAX_MESSAGE)
-  {        
-    garbage = 1;
-    recievePointer = 0;
-  }
-
-  //Handle the special chars
-  if (!escape)
+  unsigned char i;
+  for (i = 0; i < txCount; i++)
   {
-    if (chr == WBTV_STH)
+    if (txSlots[txOrder[i]].handle == handle)
     {
-      #ifdef WBTV_RECORD_TIME
-        //Keep track of when the msg started, or else time sync won't work.
-        message_start_time = millis();
-        
-        //If the new byte is the only byte, then it must have arrived
-        //At some point between the last time it was polled and now.
-        //For best average performance, we assume it arrived at the halfway point.
-        //If it is not the only byte it cannon be trusted, so message time
-        //accurate must be set to 0
-        
-        message_start_time -= ((message_start_time-lastServiced)>>1);
-        
-        message_time_error = message_start_time-lastServiced;
-        //If there is another byte in the stream, then consider the arrival time invalid. 
-        if (BUS_PORT->available())
-        {
-            message_time_accurate = 0;
-        }
-        else
-        {
-             message_time_accurate = 1;
-        }
-      #endif
-      
-      
-      //an unescaped start of header byte resets everything. 
-      recievePointer = 0;
-      headerTerminatorPosition = 0; //We need to set this to zero to recoginze missing data sections, they will look like 0 len headers because this wont move.
-      garbage = 0;
-      
-      #ifdef WBTV_SEED_ARDUINO_RNG
-      randomSeed(micros()+random(100000);
-      #endif
-      
-      #ifdef WBTV_ENABLE_RNG
-      //doRand Automatically uses the current micros() value.
-      WBTV_doRand();
-      #endif
-
-      return;
+      return 1;
     }
+  }
+  return 0;
+}
 
-    //Handle the division between header and text
-    if (chr == WBTV_STX)
-    {
-      //If this isn't 0, the default, then that would indicate a message with multiple segments,
-      //which simply can't be handled by this library as it, so they are ignored.
-      //CHANGE THIS IF YOU WANT TO ADD SUPPORT FOR MULTI-SEGMENT MESSAGES
-      if (headerTerminatorPosition)
-      {
-        garbage =  1;
-      }
-
-      headerTerminatorPosition = recievePointer;
-      message[recievePointer] = 0; //Null terminator between header and data makes string callbacks work
-      recievePointer ++;
+/*
+ *How many more messages can be queued before sendMessage() starts returning 0, or pushing out
+ *less important ones. Check it before taking on something you can't just drop.
+ */
+unsigned char WBTVNodeBase::queueSpace()
+{
+  return WBTV_TX_QUEUE - txCount;
+}
 
-      return;
+/*
+ *Keep servicing until everything queued has gone out. Like Serial.flush() this blocks,
+ *and it decodes incoming bytes meanwhile, so don't call it from inside this node's callback.
+ */
+void WBTVNodeBase::flush()
+{
+  while (txCount)
+  {
+    service();
+  }
+}
 
-    }
+/*
+ *Set how messages on a channel are queued. Higher priority messages go out before lower ones
+ *no matter what order they were sent in, and may push the lowest priority message out of a full queue.
+ *With WBTV_COALESCE set, sending on the channel replaces any message on it that hasn't started going out yet,
+ *so only the newest value waits in the queue.
+ *The channel is not copied, it needs to stay around. String literals are fine.
+ *Returns 0 if all WBTV_CHANNEL_RULES entries are used.
+ */
+unsigned char WBTVNodeBase::setChannelPriority(const unsigned char * channel, unsigned char channellen, unsigned char priority, unsigned char flags)
+{
+  unsigned char i;
 
-    //Handle end of packet
-    if (chr == WBTV_EOT)
-    {
-        handle_end_of_message();
-        return;
-    }
-    
-    //Handle an unescaped escape
-    if ( chr == WBTV_ESC)
+  for (i = 0; i < WBTV_CHANNEL_RULES; i++)
+  {
+    //Either update the existing rule for the channel or take the first empty one
+    if ((!channelRules[i].channel) ||
+        ((channelRules[i].channellen == channellen) && (memcmp(channelRules[i].channel, channel, channellen) == 0)))
     {
-        escape = 1;
-        return; 
+      channelRules[i].channel = channel;
+      channelRules[i].channellen = channellen;
+      channelRules[i].priority = priority;
+      channelRules[i].flags = flags;
+      return 1;
     }
   }
-//If we got this far, it means that we are either escaped or that the character was not a control char.
-escape = 0;
-message[recievePointer] = chr;
-recievePointer ++;
+  return 0;
+}
 
+unsigned char WBTVNodeBase::stringSetChannelPriority(const char * channel, unsigned char priority, unsigned char flags)
+{
+  return setChannelPriority((const unsigned char *)channel, strlen(channel), priority, flags);
 }
 
+//The front of the queue can't be touched once bytes of it have gone out.
+unsigned char WBTVNodeBase::txFrontLocked()
+{
+  return (txState == WBTV_TX_SEND) || (txState == WBTV_TX_ECHO);
+}
 
-void inline WBTVNode::handle_end_of_message()
+/*
+ *Find a slot for a new frame and fill in everything but the data.
+ *The queue is kept sorted by priority, oldest first within a priority.
+ */
+struct WBTV_tx_slot * WBTVNodeBase::allocateSlot(const unsigned char * channel, unsigned char channellen, unsigned char datalen, unsigned char priority, unsigned char separators)
 {
-    unsigned char i;
-      if (garbage)//If this packet was garbage, throw it away
-      {
-        return;
-      }
+  struct WBTV_tx_slot *slot;
+  unsigned char rulePriority = WBTV_PRIORITY_NORMAL;
+  unsigned char flags = 0;
+  unsigned char first, i, pos, index;
+  #ifdef WBTV_CHANNEL_ALIASES
+  unsigned char aliased[2];
+  #endif
 
-      if (!headerTerminatorPosition)
-        //If the headerTerminatorPosition is 0, then we either have a zero length header, or we never recieved a end-of header char.
-        //I never specifically wrote that 0-len headers are illegal in the spec. but maybe I should. Otherwise this is a bug [ ]
-      {
-        return;
-      }
+  WBTV_TRACE_POINT(WBTV_EV_SEND);
+  //Don't send what nobody could recieve
+  if (WBTV_RX_SIZE(channellen, datalen, separators) > WBTV_MAX_MESSAGE)
+  {
+    return 0;
+  }
 
-      //not possible to be a valid message becuse len(checksum) = 2
-      if(recievePointer <2)
+  for (i = 0; i < WBTV_CHANNEL_RULES; i++)
+  {
+    if ((channelRules[i].channellen == channellen) && channelRules[i].channel &&
+        (memcmp(channelRules[i].channel, channel, channellen) == 0))
+    {
+      rulePriority = channelRules[i].priority;
+      flags = channelRules[i].flags;
+      #ifdef WBTV_CHANNEL_ALIASES
+      //From here on the header is the alias, a NUL then the number. The size was checked with the name,
+      //since that's what the other end puts back in its buffer.
+      if (channelRules[i].alias)
       {
-        return;
+        aliased[0] = 0;
+        aliased[1] = channelRules[i].alias;
+        channel = aliased;
+        channellen = 2;
       }
-      
-      //Reset the hash state to calculate a new hash
-      sumFast=sumSlow=0;
+      #endif
+      break;
+    }
+  }
+  if (priority == WBTV_PRIORITY_DEFAULT)
+  {
+    priority = rulePriority;
+  }
 
-      //Hash the packet
-      for (i=0; i< recievePointer-2;i++)
+  first = txFrontLocked() ? 1 : 0;
+  index = WBTV_TX_QUEUE;
 
+  //Reuse a waiting frame on the same channel if it coalesces. It's a new frame now, so it comes
+  //out of the order and goes back in below wherever its priority puts it, with nothing left of the old one.
+  if (flags & WBTV_COALESCE)
+  {
+    for (i = first; i < txCount; i++)
+    {
+      slot = &txSlots[txOrder[i]];
+      if ((slot->channellen == channellen) && !(slot->flags & WBTV_SLOT_TIME) &&
+          (memcmp(slot->buf, channel, channellen) == 0))
       {
-        //Ugly slow hack to deal with the empty space we put in
-        if(! (i==headerTerminatorPosition))
-        {
-          updateHash((message[i]));
-        }
-
-#ifdef WBTV_HASH_STX
-        else
+        index = txOrder[i];
+        txCount--;
+        for (; i < txCount; i++)
         {
-          updateHash('~');
+          txOrder[i] = txOrder[i + 1];
         }
-#endif
+        break;
       }
+    }
+  }
 
-      //Check the hash
-      if ((message[recievePointer-1]== sumFast) && (message[recievePointer-2]== sumSlow))
+  if (index < WBTV_TX_QUEUE)
+  {
+    //Coalesced, the slot is already ours
+  }
+  else if (txCount >= WBTV_TX_QUEUE)
+  {
+    //Full. Kick out the last one if it matters less than this does.
+    if ((txCount <= first) || (txSlots[txOrder[txCount - 1]].priority >= priority))
+    {
+      return 0;
+    }
+    txCount--;
+    index = txOrder[txCount];
+  }
+  else
+  {
+    //Any slot not in the order list is free
+    for (index = 0; index < WBTV_TX_QUEUE; index++)
+    {
+      for (i = 0; i < txCount; i++)
       {
-        #ifdef WBTV_ADV_MODE
-        //Check if this is a time() message.
-        //This function is part of wbtvclock
-        if (internalProcessMessage())
-        {
-        return;
-        }
-        #endif
-        message[recievePointer-2] = 0; //Null terminator for people using the string callbacks.
-        
-        //If there is a callback set up, use it.
-        if(callback)
-        {
-          callback((unsigned char*)message ,
-          headerTerminatorPosition,
-          (unsigned char *)message+headerTerminatorPosition+1, //The plus one accounts for the null terminator we put in
-          recievePointer-(headerTerminatorPosition+1)); //Would be plus 2 for the checksum but we have the null byte inserted so it's plus 1
-        }
-        else
+        if (txOrder[i] == index)
         {
-            //If there are any NUL bytes in the header, just return.
-            //Presumably nobody would register a string callback
-            //that listens on a channel with 0s in its data
-            //but the channel needs to be checked to prevent against
-            //channels that start with the name of the string channel
-            //and then a null.
-            for(i=0;i<headerTerminatorPosition;i++)
-            {
-                if (message[i] ==0)
-                    {
-                        return;
-                    }
-            }
-            //Veriied that the channel name is safe. now we hand it off to the callback
-            if (stringCallback)
-            {
-              stringCallback((char*)message ,
-              (char *)message+headerTerminatorPosition);
-            }
+          break;
         }
       }
-      #ifdef WBTV_SEED_ARDUINO_RNG
-      randomSeed(sumSlow+random(100000);
-      #endif
-      
-      #ifdef WBTV_ENABLE_RNG
-      WBTV_doRand(sumSlow);
-      #endif
-}
-
-unsigned char WBTVNode::writeWrapper(unsigned char chr)
-{
-  unsigned long start;
-  BUS_PORT->read();
-  BUS_PORT->write(chr);
-
-  if (wiredor)
-  {
-    start = micros();
-    while (!BUS_PORT->available())
-    {
-      if ((micros()-start)>WBTV_MAX_WAIT)
+      if (i == txCount)
       {
-        return 0;
+        break;
       }
     }
+  }
 
-
-    if (! (BUS_PORT->read()==chr))
-    {
-      return 0;
-    }
-    else
+  //Goes after everything of equal or higher priority
+  for (pos = first; pos < txCount; pos++)
+  {
+    if (txSlots[txOrder[pos]].priority < priority)
     {
-      return 1;
+      break;
     }
   }
-  //Not wiredor, always return 1 because there is no way for this to be interfered with
-  else 
+  for (i = txCount; i > pos; i--)
   {
-    return 1;
+    txOrder[i] = txOrder[i - 1];
   }
+  txOrder[pos] = index;
+  txCount++;
+
+  slot = &txSlots[index];
+  slot->handle = nextHandle();
+  slot->channellen = channellen;
+  slot->datalen = datalen;
+  slot->flags = (flags & WBTV_XOR_FRAMED) ? WBTV_SLOT_XOR : 0;
+  slot->priority = priority;
+  slot->separators = 0;
+  #ifdef WBTV_STATS
+  slot->queued = micros();
+  #endif
+  memcpy(slot->buf, channel, channellen);
+  return slot;
 }
 
-unsigned char WBTVNode::escapedWrite(unsigned char chr)
+WBTV_tx_handle WBTVNodeBase::nextHandle()
 {
-  unsigned char x;
-
-  x = 1;
-
-  //If chr is a special character, escape it first
-  if (chr == WBTV_STH)
-  {
-    x = writeWrapper(WBTV_ESC); 
-  }
-  if (chr == WBTV_STX)
+  //0 means failure so skip it.
+  txNextHandle++;
+  if (!txNextHandle)
   {
-    x= writeWrapper(WBTV_ESC); 
+    txNextHandle++;
   }
-  if (chr == WBTV_EOT)
+  return txNextHandle;
+}
+
+//This is the sending hash. Recieving has its own, updateRxHash(), because it runs across many calls to service().
+void WBTVNodeBase::updateHash(unsigned char chr)
+{
+  //This is a fletcher-256 hash. Not quite as good as a CRC, but pretty good.
+  txSumSlow += chr;
+  txSumFast += txSumSlow; 
+}
+
+void WBTVNodeBase::service()
+{
+    //Move the transmission along first. While waiting on an echo the next byte
+    //is ours, and while backing off it needs to see that bytes arrived.
+    serviceTransmit();
+
+    if (txState != WBTV_TX_ECHO && rxAvailable())
+    {
+      decodeChar(rxRead());
+      rxStamped = 0;
+    }
+    
+#ifdef WBTV_RECORD_TIME
+lastServiced = millis();
+#endif
+
+}
+
+/*
+ *Like service(), but keep going until the port is empty, pulling bytes out in blocks
+ *with readBytes() rather than one read() at a time. Use this when one loop services
+ *several ports and a fast one could otherwise overflow its FIFO.
+ */
+void WBTVNodeBase::serviceAll()
+{
+  unsigned char buffer[WBTV_SERVICE_CHUNK];
+  int n;
+
+  serviceTransmit();
+
+  if (rxRing)
   {
-    x = writeWrapper(WBTV_ESC); 
+    //One at a time so every byte keeps its own arrival time
+    while (txState != WBTV_TX_ECHO && rxAvailable())
+    {
+      decodeChar(rxRead());
+      rxStamped = 0;
+    }
+    #ifdef WBTV_RECORD_TIME
+    lastServiced = millis();
+    #endif
+    return;
   }
-  if (chr == WBTV_ESC)
+
+  while (txState != WBTV_TX_ECHO && (n = BUS_PORT->available()) > 0)
   {
-    x =writeWrapper(WBTV_ESC); 
+    if (n > WBTV_SERVICE_CHUNK)
+    {
+      n = WBTV_SERVICE_CHUNK;
+    }
+    //We never ask for more than is available so this can't hit the stream timeout.
+    n = BUS_PORT->readBytes((char *)buffer, n);
+    decodeBuffer(buffer, n);
   }
 
-  //If the escape succeded(or there was no escape), then send the char, and return it's sucess value
-  if (x)
+#ifdef WBTV_RECORD_TIME
+lastServiced = millis();
+#endif
+}
+
+//Process a block of incoming chars, dispatching every complete frame in it.
+void WBTVNodeBase::decodeBuffer(const unsigned char * data, unsigned int len)
+{
+  while (len)
   {
-    return writeWrapper(chr);
+    len--;
+    bulkRemaining = len;
+    decodeChar(*data++);
   }
-  //Else return a failure
-  return 0;
-
+  bulkRemaining = 0;
 }
 
-//Block until the bus is free.
-//It does this by waiting a random time and making sure there are no transitions in that period
-//the collision detection and immediate retry means that
-//even a relatively high rate of collisions should not cause problems.
+//Process one incoming char. The framing is done by WBTVReceiver, what happens to the frame is up to the rx hooks below.
+void WBTVNodeBase::decodeChar(unsigned char chr)
+{
+  WBTV_COUNT(rxBytes);
+  receive(chr);
+}
 
-//A cool side effect of this is that in many cases nodes will be able to "wait out" noise on the bus
-void WBTVNode::waitTillICanSend()
+//An unescaped start of header byte. The frame has already been reset.
+void WBTVNodeBase::rxStart()
 {
-unsigned long start,time;
-wait:
-  start = micros();
-  #ifdef WBTV_ENABLE_RNG
-  time = WBTV_rand(MIN_BACKOFF,MAX_BACKOFF);
-  #else
-  time = random(MIN_BACKOFF , MAX_BACKOFF);
+  WBTV_TRACE_POINT(WBTV_EV_RX_START);
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  noteFrameStart();
   #endif
-  
-
-  //While it has been less than the required time, just loop. Should the bus get un-idled in that time, totally restart.
-  // The performance of the loop is really pooptastic, because  digital reads take 1us of so and there is a divide operation in the 
-  //micros() 
-  //implementation. Still, this should arbitrate well enough.
-  while( (micros()-start) < time)
+  #ifdef WBTV_RECORD_TIME
+  if (rxStamped)
   {
-    //UNROLL LOOP X4 TO INCREASE CHACE OF CATCHING FAST PULSES
-    //We directly read from the pin to determine if it is idle, that lets us catch the 
-    if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+    //The interrupt wrote down when it came in, so we know to within a millisecond,
+    //however long it sat in the ring.
+    message_start_micros = rxStamp;
+    message_start_time = millis() - ((micros() - rxStamp) / 1000);
+    message_time_error = 1;
+    message_time_accurate = 1;
+  }
+  else
+  {
+    //Keep track of when the msg started, or else time sync won't work.
+    message_start_time = millis();
+    message_start_micros = micros();
+    
+    //If the new byte is the only byte, then it must have arrived
+    //At some point between the last time it was polled and now.
+    //For best average performance, we assume it arrived at the halfway point.
+    //If it is not the only byte it cannon be trusted, so message time
+    //accurate must be set to 0
+    
+    message_start_time -= ((message_start_time-lastServiced)>>1);
+    
+    message_time_error = message_start_time-lastServiced;
+    message_start_micros -= (millis() - message_start_time) * 1000;
+    
+    //If there is another byte in the stream, then consider the arrival time invalid. 
+    //Bytes after this one in a decodeBuffer() block count as being in the stream.
+    if (bulkRemaining || rxAvailable())
     {
-      goto wait;
+        message_time_accurate = 0;
     }
-    //We directly read from the pin to determine if it is idle, that lets us catch the 
-    if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+    else
     {
-      goto wait;
+         message_time_accurate = 1;
     }
-    //We directly read from the pin to determine if it is idle, that lets us catch the 
-    if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
-    {
-      goto wait;
+  }
+  #endif
+
+  headerHasNul = 0;
+  #ifdef WBTV_PATTERNS
+  trieStart();
+  #endif
+  
+  #ifdef WBTV_SEED_ARDUINO_RNG
+  randomSeed(micros()+random(100000));
+  #endif
+  
+  #ifdef WBTV_ENABLE_RNG
+  //doRand Automatically uses the current micros() value.
+  WBTV_doRand();
+  #endif
+}
+
+void WBTVNodeBase::rxHeaderByte(unsigned char chr)
+{
+  #ifdef WBTV_PATTERNS
+  if (rxActiveCount)
+  {
+    trieStep(chr);
+  }
+  #endif
+  //Channels with NULs in them can't go to a string callback
+  if (!chr)
+  {
+    headerHasNul = 1;
+  }
+}
+
+//The header is all here. Returns 0 if it's no good.
+unsigned char WBTVNodeBase::rxChannel()
+{
+  #ifdef WBTV_CHANNEL_ALIASES
+  //Swap an alias for its name before anything looks at the header.
+  if ((recievePointer == 2) && !message[0])
+  {
+    if (!expandAlias())
+    {
+      return 0;
+    }
+    #ifdef WBTV_PATTERNS
+    //The trie followed the alias, run the name through it instead.
+    trieRun(message, recievePointer);
+    #endif
+  }
+  #endif
+  return 1;
+}
+
+//Returns 0 if nobody wants this frame.
+unsigned char WBTVNodeBase::rxHeader()
+{
+  //Work out who wants this now, while rxSumSlow and rxSumFast are the checksum of just the header.
+  #ifdef WBTV_ADV_MODE
+  rxIsTime = WBTV_TIME_CHANNEL::matches(message, headerTerminatorPosition, rxSumSlow, rxSumFast);
+  #endif
+  #ifdef WBTV_STATS
+  rxIsStat = WBTV_STAT_CHANNEL::matches(message, headerTerminatorPosition, rxSumSlow, rxSumFast);
+  #endif
+  rxEntry = dispatchLookup ? dispatchLookup(message, headerTerminatorPosition, rxSumSlow, rxSumFast) : 0;
+  rxSubscription = findSubscription();
+  #ifdef WBTV_PATTERNS
+  trieEnd();
+  #endif
+  #ifdef WBTV_TRACE
+  rxIsTrace = WBTV_TRACE_CHANNEL::matches(message, headerTerminatorPosition, rxSumSlow, rxSumFast);
+  #endif
+  #ifdef WBTV_CHANNEL_ALIASES
+  rxIsAlias = WBTV_ALIAS_CHANNEL::matches(message, headerTerminatorPosition, rxSumSlow, rxSumFast);
+  #endif
+  WBTV_TRACE_POINT(WBTV_EV_RX_HEADER);
+
+  //If nobody is going to want this, WBTVReceiver stops here and doesn't bother buffering the rest.
+  if (!rxEntry && (rxSubscription == WBTV_NO_SUBSCRIPTION) && !callback && !stringCallback && !segmentCallback)
+  {
+    #ifdef WBTV_ADV_MODE
+    //Except TIME, we always want that.
+    if (!rxIsTime)
+    #endif
+    #ifdef WBTV_STATS
+    //And STAT, it might be asking for ours.
+    if (!rxIsStat)
+    #endif
+    #ifdef WBTV_TRACE
+    //Same for TRACE.
+    if (!rxIsTrace)
+    #endif
+    #ifdef WBTV_CHANNEL_ALIASES
+    //And ALIAS, which we need to understand everything else.
+    if (!rxIsAlias)
+    #endif
+    #ifdef WBTV_PATTERNS
+    //And anything a pattern matched.
+    if (!rxMatched)
+    #endif
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void WBTVNodeBase::rxEnd()
+{
+  WBTV_TRACE_POINT(WBTV_EV_RX_END);
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  rxFrameEnd = rxNow();
+  #endif
+}
+
+void WBTVNodeBase::rxDiscard()
+{
+  WBTV_COUNT(rxGarbage);
+}
+
+void WBTVNodeBase::rxFrame(unsigned char good)
+{
+  if (!good)
+  {
+    WBTV_TRACE_POINT(WBTV_EV_RX_BAD);
+    WBTV_COUNT(rxChecksum);
+  }
+  else
+  {
+    WBTV_COUNT(rxFrames);
+    #ifdef WBTV_STATS
+    //An empty STAT message is asking everyone for their counters.
+    if (rxIsStat && (recievePointer == headerTerminatorPosition + 3))
+    {
+      sendStats();
+      return;
+    }
+    #endif
+    #ifdef WBTV_TRACE
+    //And an empty TRACE message for our trace ring.
+    if (rxIsTrace && (recievePointer == headerTerminatorPosition + 3))
+    {
+      sendTrace();
+      return;
+    }
+    #endif
+    WBTV_TRACE_POINT(WBTV_EV_DISPATCH);
+    #ifdef WBTV_ADV_MODE
+    //Check if this is a time() message.
+    //This function is part of wbtvclock
+    if (internalProcessMessage() && !PASS_TIME)
+    {
+    return;
+    }
+    #endif
+    message[recievePointer-2] = 0; //Null terminator for people using the string callbacks.
+    rxSegments.start[rxSegments.count] = recievePointer-1;
+    #ifdef WBTV_CHANNEL_ALIASES
+    if (rxIsAlias)
+    {
+      //An empty one is asking for ours. Either way it's passed on like anything else.
+      if (recievePointer == headerTerminatorPosition + 3)
+      {
+        announceAliases();
+      }
+      else
+      {
+        learnAliases();
+      }
+    }
+    #endif
+    
+    //Channels in the dispatcher first, then subscribers, and anything left goes to the catch all callback.
+    if (rxEntry)
+    {
+      rxEntry((unsigned char*)message ,
+      headerTerminatorPosition,
+      (unsigned char *)message+headerTerminatorPosition+1,
+      recievePointer-(headerTerminatorPosition+3),
+      1);
+    }
+    else if ((rxSubscription != WBTV_NO_SUBSCRIPTION) && subscriptions[rxSubscription].handler)
+    {
+      subscriptions[rxSubscription].handler((unsigned char*)message ,
+      headerTerminatorPosition,
+      (unsigned char *)message+headerTerminatorPosition+1,
+      recievePointer-(headerTerminatorPosition+3),
+      subscriptions[rxSubscription].userdata);
+    }
+    #ifdef WBTV_PATTERNS
+    else if (rxMatched)
+    {
+      //The patterns get it below, so the catch all callbacks don't.
+    }
+    #endif
+    else if (segmentCallback)
+    {
+      segmentCallback((unsigned char*)message, headerTerminatorPosition, &rxSegments);
+    }
+    //If there is a callback set up, use it.
+    else if(callback)
+    {
+      callback((unsigned char*)message ,
+      headerTerminatorPosition,
+      (unsigned char *)message+headerTerminatorPosition+1, //The plus one accounts for the null terminator we put in
+      recievePointer-(headerTerminatorPosition+3)); //One for the null terminator, two for the checksum
+    }
+    else
+    {
+        //If there are any NUL bytes in the header, just return.
+        //Presumably nobody would register a string callback
+        //that listens on a channel with 0s in its data
+        //but the channel needs to be checked to prevent against
+        //channels that start with the name of the string channel
+        //and then a null.
+        //We noted any NULs on the way in so there's no need to look again.
+        //Veriied that the channel name is safe. now we hand it off to the callback
+        if (stringCallback && !headerHasNul)
+        {
+          stringCallback((char*)message ,
+          (char *)message+headerTerminatorPosition+1);
+        }
+    }
+    #ifdef WBTV_PATTERNS
+    //Every pattern that matched gets it, as well as an exact match.
+    if (rxMatched)
+    {
+      trieCall();
+    }
+    #endif
+    WBTV_TRACE_POINT(WBTV_EV_HANDLED);
+  }
+  #ifdef WBTV_SEED_ARDUINO_RNG
+  randomSeed(rxSumSlow+random(100000));
+  #endif
+  
+  #ifdef WBTV_ENABLE_RNG
+  WBTV_doRand(rxSumSlow);
+  #endif
+}
+
+/*
+ *The transmit engine. Every call does whatever can be done right now without waiting,
+ *then returns. It is called from service(), and from sendMessage() so that full duplex
+ *links send immediately.
+ *
+ *On a full duplex link a frame goes IDLE -> SEND -> IDLE all in one call.
+ *On a wired-OR bus a frame goes IDLE -> BACKOFF -> (ECHO for every ECHO_WINDOW bytes) -> IDLE.
+ *Should the bus get busy while backing off the wait starts over, and should any byte come
+ *back different than we sent it, or not come back at all, we lost and go back to backing off.
+ */
+void WBTVNodeBase::serviceTransmit()
+{
+  int chr;
+
+  #ifdef WBTV_STATS
+  //statSent moves first, sendStats() comes back through here.
+  if (STAT_INTERVAL && ((millis() - statSent) >= STAT_INTERVAL))
+  {
+    statSent = millis();
+    sendStats();
+  }
+  #endif
+  #ifdef WBTV_CHANNEL_ALIASES
+  if (ALIAS_INTERVAL && ((millis() - aliasSent) >= ALIAS_INTERVAL))
+  {
+    aliasSent = millis();
+    announceAliases();
+  }
+  //Whatever didn't fit in the queue last time goes as soon as there's room
+  else if ((aliasResume < WBTV_CHANNEL_RULES) && (txCount < WBTV_TX_QUEUE))
+  {
+    queueAliases(aliasResume);
+  }
+  #endif
+
+  switch (txState)
+  {
+  case WBTV_TX_IDLE:
+    if (!txCount)
+    {
+      return;
+    }
+    if (wiredor)
+    {
+      #ifdef WBTV_STATS
+      txWaitBegan = micros();
+      #endif
+      WBTV_TRACE_POINT(WBTV_EV_BACKOFF);
+      startBackoff();
+      return;
+    }
+    //Full duplex, nothing can interfere with us so the whole thing goes now.
+    WBTV_TRACE_POINT(WBTV_EV_TX_START);
+    startFrame();
+#ifdef WBTV_BULK_WRITE
+    txBulk();
+#else
+    while (txState != WBTV_TX_IDLE)
+    {
+      BUS_PORT->write(txWireByte());
+      WBTV_COUNT(txBytes);
+      txAdvance();
+    }
+#endif
+    return;
+
+  case WBTV_TX_BACKOFF:
+    if (busActive())
+    {
+      startBackoff();
+      return;
+    }
+    if ((micros() - txTimer) < txWait + classOffset())
+    {
+      return;
+    }
+    #ifdef WBTV_STATS
+    WBTV_stat_inc(&statCounters.backoff[WBTV_stat_bucket(micros() - txWaitBegan, 8)]);
+    #endif
+    //Whatever is at the front of the queue now is what goes.
+    WBTV_TRACE_POINT(WBTV_EV_TX_START);
+    startFrame();
+    txSendBytes();
+    return;
+
+  case WBTV_TX_ECHO:
+    if (!rxAvailable())
+    {
+      if ((micros() - txTimer) > WBTV_MAX_WAIT)
+      {
+        //Nothing came back at all. Most likely someone is holding the bus.
+        WBTV_COUNT(timeouts);
+        collided();
+      }
+      return;
+    }
+    //Check off everything that has come back so far, oldest first.
+    while (txShadowCount && rxAvailable())
+    {
+      chr = rxRead();
+      rxStamped = 0;
+      if (chr != txShadow[txShadowHead])
+      {
+        //Collision. Start the whole frame over. Whatever else is still in flight
+        //goes out anyway, and comes back as garbage that the receiver throws away.
+        WBTV_COUNT(collisions);
+        collided();
+        return;
+      }
+      txShadowHead = (txShadowHead + 1) % WBTV_MAX_ECHO_WINDOW;
+      txShadowCount--;
+    }
+    txTimer = micros();
+    if (!txShadowCount && txSentAll)
+    {
+      //That was the \n, we made it.
+      txAdvance();
+      return;
+    }
+    txSendBytes();
+    return;
+  }
+}
+
+//Reset the transmit cursor and checksum to the beginning of the frame at the front of the queue.
+void WBTVNodeBase::startFrame()
+{
+  struct WBTV_tx_slot *slot = &txSlots[txOrder[0]];
+
+  if (slot->flags & WBTV_SLOT_TRIED)
+  {
+    WBTV_COUNT(retries);
+  }
+  slot->flags |= WBTV_SLOT_TRIED;
+  txState = WBTV_TX_SEND;
+  txPhase = WBTV_PHASE_STH;
+#ifdef DUMMY_WBTV_STH
+  //Sent dummy start code for reliabilty in case there was noise that looked like an WBTV_ESC.
+  //This is really just there for paranoia reasons but it's a nice addition and it's only one more byte.
+  txPhase = WBTV_PHASE_DUMMY_STH;
+#endif
+  txIndex = 0;
+  txEscaped = 0;
+  txSegment = 0;
+  txSumSlow = txSumFast = 0;
+  txShadowHead = 0;
+  txShadowCount = 0;
+  txSentAll = 0;
+  #ifdef WBTV_XOR_FRAMING
+  txXor = 0;
+  #endif
+}
+
+/*
+ *Pick a random time the bus must stay idle for before we can start.
+ *
+ *With WBTV_ADAPTIVE_BACKOFF the random part of the wait, MAX_BACKOFF-MIN_BACKOFF, gets doubled for every
+ *collision in a row, as the spec suggests, and widened further in proportion to how busy the bus has been.
+ *More nodes fighting over the bus means more of them waiting at once, and a wider window spreads them out.
+ *On a quiet bus it is the plain MIN_BACKOFF to MAX_BACKOFF window, so nothing gets slower when idle.
+ */
+void WBTVNodeBase::startBackoff()
+{
+  unsigned long spread;
+
+  txState = WBTV_TX_BACKOFF;
+  txTimer = micros();
+  spread = MAX_BACKOFF - MIN_BACKOFF;
+
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  //Nothing heard for a good while, whatever was going on is over.
+  if ((txTimer - rxFrameEnd) > (unsigned long)MAX_BACKOFF * 32 + classOffset())
+  {
+    txBackoffExp = 0;
+    rxLoad = 0;
+  }
+  //rxLoad/8 is the load out of 256, so this adds up to 4 more spreads on a saturated bus.
+  spread = (spread << txBackoffExp) + ((spread * rxLoad) >> 9);
+  #endif
+
+  //HIGH and URGENT stay inside their own window, leaving a quarter of it clear so that the class below
+  //never starts before they'd have been heard. NORMAL and LOW share the open ended window after them.
+  if (PRIORITY_WINDOW && (txSlots[txOrder[0]].priority > WBTV_PRIORITY_NORMAL) &&
+      (spread > ((unsigned long)PRIORITY_WINDOW * 3) / 4))
+  {
+    spread = ((unsigned long)PRIORITY_WINDOW * 3) / 4;
+  }
+
+  #ifdef WBTV_ENABLE_RNG
+  txWait = MIN_BACKOFF + WBTV_rand(0UL, spread);
+  #else
+  txWait = MIN_BACKOFF + random(spread);
+  #endif
+}
+
+/*
+ *With PRIORITY_WINDOW set, URGENT frames get the first PRIORITY_WINDOW of idle time to start in, HIGH the next,
+ *and everything else starts after that. So a more important frame always wins against a less important one
+ *that began waiting at the same time. NORMAL and LOW share a window so that ordinary traffic keeps the full
+ *adaptive backoff, the queue still sends NORMAL before LOW.
+ *It's worked out from whatever is at the front of the queue now, which may have changed since the backoff started.
+ */
+unsigned long WBTVNodeBase::classOffset()
+{
+  unsigned char priority = txSlots[txOrder[0]].priority;
+  if (priority > WBTV_PRIORITY_URGENT)
+  {
+    priority = WBTV_PRIORITY_URGENT;
+  }
+  if (priority < WBTV_PRIORITY_NORMAL)
+  {
+    priority = WBTV_PRIORITY_NORMAL;
+  }
+  return (unsigned long)(WBTV_PRIORITY_URGENT - priority) * PRIORITY_WINDOW;
+}
+
+//Somebody else was sending at the same time. Back off, for longer than last time.
+void WBTVNodeBase::collided()
+{
+  unsigned char i, index;
+
+  //The frame at the front isn't locked any more, so anything more important that got queued
+  //behind it while it was going out gets to go first now.
+  for (i = 0; (i + 1 < txCount) && (txSlots[txOrder[i + 1]].priority > txSlots[txOrder[i]].priority); i++)
+  {
+    index = txOrder[i];
+    txOrder[i] = txOrder[i + 1];
+    txOrder[i + 1] = index;
+  }
+
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  if (txBackoffExp < WBTV_BACKOFF_MAX_EXP)
+  {
+    txBackoffExp++;
+  }
+  #endif
+  #ifdef WBTV_STATS
+  txWaitBegan = micros();
+  #endif
+  WBTV_TRACE_POINT(WBTV_EV_COLLIDE);
+  WBTV_TRACE_POINT(WBTV_EV_BACKOFF);
+  startBackoff();
+}
+
+#ifdef WBTV_ADAPTIVE_BACKOFF
+unsigned char WBTVNodeBase::busLoad()
+{
+  return rxLoad >> 3;
+}
+
+unsigned char WBTVNodeBase::backoffExponent()
+{
+  return txBackoffExp;
+}
+
+/*
+ *A frame is starting. The last one was busy from rxFrameStart to rxFrameEnd and idle since,
+ *so fold that into the average load.
+ *With PRIORITY_WINDOW set everybody sits out the windows of the classes above theirs before they can start,
+ *and that isn't a quiet bus, it's just the rules. Counting it would make a busy bus look idle and shrink the
+ *spread right when it needs to be wide, so the whole windows in the gap are taken back out first.
+ */
+void WBTVNodeBase::noteFrameStart()
+{
+  unsigned long now = rxNow();
+  unsigned long busy = rxFrameEnd - rxFrameStart;
+  unsigned long total = now - rxFrameStart;
+  unsigned long gap = now - rxFrameEnd;
+
+  if (PRIORITY_WINDOW && (gap > MIN_BACKOFF))
+  {
+    gap = (gap - MIN_BACKOFF) / PRIORITY_WINDOW;
+    if (gap > (WBTV_PRIORITY_URGENT - WBTV_PRIORITY_NORMAL))
+    {
+      gap = WBTV_PRIORITY_URGENT - WBTV_PRIORITY_NORMAL;
+    }
+    total -= gap * PRIORITY_WINDOW;
+  }
+
+  if ((rxFrameEnd - rxFrameStart) < total && total)
+  {
+    //Scale down first so busy*255 can't overflow on long gaps
+    while (total > 0xffff)
+    {
+      total >>= 1;
+      busy >>= 1;
+    }
+    rxLoad = rxLoad - (rxLoad >> 3) + (unsigned int)((busy * 255) / total);
+  }
+  rxFrameStart = now;
+  rxFrameEnd = now;
+}
+#endif
+
+/*
+ *Check the bus for activity. A byte waiting in the port means somebody talked,
+ *otherwise sample the pin a few times to try and catch a start bit in progress.
+ */
+unsigned char WBTVNodeBase::busActive()
+{
+  if (rxAvailable())
+  {
+    return 1;
+  }
+  //UNROLL LOOP X4 TO INCREASE CHACE OF CATCHING FAST PULSES
+  //We directly read from the pin to determine if it is idle, that lets us catch the 
+  if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+  {
+    return 1;
+  }
+  if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+  {
+    return 1;
+  }
+  if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+  {
+    return 1;
+  }
+  if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+void WBTVNodeBase::setRxRing(WBTVRxRing * ring)
+{
+  rxRing = ring;
+}
+
+int WBTVNodeBase::rxAvailable()
+{
+  if (rxRing)
+  {
+    return rxRing->available();
+  }
+  return BUS_PORT->available();
+}
+
+//Read the next byte from wherever they come from. Bytes from the ring also set rxStamp.
+int WBTVNodeBase::rxRead()
+{
+  unsigned char chr;
+  if (rxRing)
+  {
+    if (!rxRing->pop(&chr, &rxStamp))
+    {
+      return -1;
+    }
+    rxStamped = 1;
+    return chr;
+  }
+  return BUS_PORT->read();
+}
+
+//When the byte being decoded arrived, as near as we know.
+unsigned long WBTVNodeBase::rxNow()
+{
+  return rxStamped ? rxStamp : micros();
+}
+
+/*
+ *Put bytes on the bus until ECHO_WINDOW of them are waiting to come back, then wait for them.
+ *The cursor moves on as each one is written, the copy in txShadow is what its echo gets checked against.
+ *The \n is the exception, the cursor stays on it until it has been heard back, since moving on frees the slot.
+ */
+void WBTVNodeBase::txSendBytes()
+{
+  unsigned char chr;
+  unsigned char window = ECHO_WINDOW;
+
+  if (window > WBTV_MAX_ECHO_WINDOW)
+  {
+    window = WBTV_MAX_ECHO_WINDOW;
+  }
+  if (!window)
+  {
+    window = 1;
+  }
+  if (!txShadowCount)
+  {
+    txTimer = micros();
+  }
+  while (!txSentAll && (txShadowCount < window))
+  {
+    chr = txWireByte();
+    BUS_PORT->write(chr);
+    WBTV_COUNT(txBytes);
+    txShadow[(txShadowHead + txShadowCount) % WBTV_MAX_ECHO_WINDOW] = chr;
+    txShadowCount++;
+    if (txPhase == WBTV_PHASE_EOT)
+    {
+      txSentAll = 1;
+    }
+    else
+    {
+      txAdvance();
+    }
+  }
+  txState = WBTV_TX_ECHO;
+}
+
+//The raw, unescaped byte under the cursor.
+unsigned char WBTVNodeBase::txRawByte()
+{
+  if (txPhase == WBTV_PHASE_SUM_SLOW)
+  {
+    return txSumSlow;
+  }
+  if (txPhase == WBTV_PHASE_SUM_FAST)
+  {
+    return txSumFast;
+  }
+  return txSlots[txOrder[0]].buf[txIndex];
+}
+
+//Work out the next byte to go on the wire, without moving on from it.
+unsigned char WBTVNodeBase::txWireByte()
+{
+  unsigned char chr;
+
+  switch (txPhase)
+  {
+  case WBTV_PHASE_DUMMY_STH:
+  case WBTV_PHASE_STH:
+    return WBTV_STH;
+  case WBTV_PHASE_STX:
+    return WBTV_STX;
+  case WBTV_PHASE_EOT:
+    return WBTV_EOT;
+  #ifdef WBTV_XOR_FRAMING
+  case WBTV_PHASE_MARK:
+  case WBTV_PHASE_MARK2:
+    return WBTV_STX;
+  case WBTV_PHASE_KEY:
+    return txKey;
+  #endif
+  }
+
+  chr = txRawByte();
+  #ifdef WBTV_XOR_FRAMING
+  if (txXor)
+  {
+    return chr ^ txKey;
+  }
+  #endif
+  //If chr is a special character, escape it first
+  if (!txEscaped && WBTV_byte_class(chr))
+  {
+    return WBTV_ESC;
+  }
+  return chr;
+}
+
+//The byte from txWireByte() made it out, so move the cursor on to the next one.
+void WBTVNodeBase::txAdvance()
+{
+  struct WBTV_tx_slot *slot = &txSlots[txOrder[0]];
+  unsigned char chr;
+  #ifdef WBTV_XOR_FRAMING
+  int key;
+  #endif
+
+  switch (txPhase)
+  {
+  case WBTV_PHASE_DUMMY_STH:
+    txPhase = WBTV_PHASE_STH;
+    return;
+
+  case WBTV_PHASE_STH:
+    #ifdef WBTV_ADV_MODE
+    //The time in a TIME message is as of the start byte, so it's filled in now and not when queued.
+    if (slot->flags & WBTV_SLOT_TIME)
+    {
+      fillTime(slot->buf + slot->channellen);
     }
-    //We directly read from the pin to determine if it is idle, that lets us catch the 
-    if (!(digitalRead(sensepin)== WBTV_BUS_IDLE_STATE))
+    #endif
+    #ifdef WBTV_XOR_FRAMING
+    //Only now is the data final, so this is when to pick a key.
+    if (slot->flags & WBTV_SLOT_XOR)
+    {
+      key = txChooseKey(slot);
+      if (key >= 0)
+      {
+        txXor = 1;
+        txKey = key;
+        txPhase = WBTV_PHASE_MARK;
+        return;
+      }
+    }
+    #endif
+    txPhase = slot->channellen ? WBTV_PHASE_HEADER : WBTV_PHASE_STX;
+    return;
+
+  #ifdef WBTV_XOR_FRAMING
+  case WBTV_PHASE_MARK:
+    txPhase = WBTV_PHASE_MARK2;
+    return;
+
+  case WBTV_PHASE_MARK2:
+    txPhase = WBTV_PHASE_KEY;
+    return;
+
+  case WBTV_PHASE_KEY:
+    txPhase = slot->channellen ? WBTV_PHASE_HEADER : WBTV_PHASE_STX;
+    return;
+  #endif
+
+  case WBTV_PHASE_STX:
+#ifdef WBTV_HASH_STX
+    updateHash(WBTV_STX);
+#endif
+    txPhase = txDataPhase(slot);
+    return;
+
+  case WBTV_PHASE_EOT:
+    txFinish();
+    return;
+  }
+
+  //Escaped bytes take two trips through here, the first one only sends the escape.
+  chr = txRawByte();
+  #ifdef WBTV_XOR_FRAMING
+  if (!txXor)
+  #endif
+  if (!txEscaped && WBTV_byte_class(chr))
+  {
+    txEscaped = 1;
+    return;
+  }
+  txEscaped = 0;
+
+  switch (txPhase)
+  {
+  case WBTV_PHASE_HEADER:
+    updateHash(chr);
+    txIndex++;
+    if (txIndex == slot->channellen)
     {
-      goto wait;
+      txPhase = WBTV_PHASE_STX;
     }
+    return;
+
+  case WBTV_PHASE_DATA:
+    updateHash(chr);
+    txIndex++;
+    txPhase = txDataPhase(slot);
+    return;
+
+  case WBTV_PHASE_SUM_SLOW:
+    txPhase = WBTV_PHASE_SUM_FAST;
+    return;
+
+  case WBTV_PHASE_SUM_FAST:
+    txPhase = WBTV_PHASE_EOT;
+    return;
+  }
+}
+
+//The frame at the front of the queue is all out, free its slot.
+void WBTVNodeBase::txFinish()
+{
+  unsigned char i;
+
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  //Made it through, so ease off one step.
+  if (txBackoffExp)
+  {
+    txBackoffExp--;
+  }
+  #endif
+  WBTV_TRACE_POINT(WBTV_EV_TX_DONE);
+  #ifdef WBTV_STATS
+  WBTV_stat_inc(&statCounters.txFrames);
+  WBTV_stat_inc(&statCounters.latency[WBTV_stat_bucket(micros() - txSlots[txOrder[0]].queued, 10)]);
+  #endif
+  txCount--;
+  for (i = 0; i < txCount; i++)
+  {
+    txOrder[i] = txOrder[i + 1];
+  }
+  txState = WBTV_TX_IDLE;
+}
+
+#ifdef WBTV_BULK_WRITE
+//Full duplex only. Build the whole frame on the stack and hand it over in one write(),
+//so a port that can take a block at once doesn't get called for every byte.
+void WBTVNodeBase::txBulk()
+{
+  struct WBTV_tx_slot *slot = &txSlots[txOrder[0]];
+  unsigned char wire[WBTV_ENCODED_MAX(WBTV_MAX_MESSAGE, WBTV_MAX_SEGMENTS)];
+  unsigned char separators[WBTV_MAX_SEGMENTS - 1];
+  unsigned int len;
+  int key = -1;
+
+  #ifdef WBTV_ADV_MODE
+  if (slot->flags & WBTV_SLOT_TIME)
+  {
+    fillTime(slot->buf + slot->channellen);
+  }
+  #endif
+  txSeparators(slot, separators);
+  #ifdef WBTV_XOR_FRAMING
+  if (slot->flags & WBTV_SLOT_XOR)
+  {
+    key = txChooseKey(slot);
+  }
+  #endif
+  len = WBTV_encode(wire, slot->buf, slot->channellen, slot->buf + slot->channellen, slot->datalen, separators, slot->separators, key);
+  BUS_PORT->write(wire, len);
+  WBTV_COUNT_N(txBytes, len);
+  txFinish();
+}
+#endif
+
+//The slot keeps separators as places in buf, the encoder wants them as places in the data
+void WBTVNodeBase::txSeparators(struct WBTV_tx_slot * slot, unsigned char * separators)
+{
+  unsigned char i;
+
+  for (i = 0; i < slot->separators; i++)
+  {
+    separators[i] = slot->separatorAt[i] - slot->channellen;
+  }
+}
+
+#ifdef WBTV_XOR_FRAMING
+//The key to send the slot with, or -1 to escape it as usual
+int WBTVNodeBase::txChooseKey(struct WBTV_tx_slot * slot)
+{
+  unsigned char separators[WBTV_MAX_SEGMENTS - 1];
+
+  txSeparators(slot, separators);
+  return WBTV_xor_key(slot->buf, slot->channellen, slot->buf + slot->channellen, slot->datalen, separators, slot->separators);
+}
+#endif
+
+//After a ~ or a data byte, work out whether the next thing is data, another ~, or the checksum.
+unsigned char WBTVNodeBase::txDataPhase(struct WBTV_tx_slot * slot)
+{
+  if ((txSegment < slot->separators) && (txIndex == slot->separatorAt[txSegment]))
+  {
+    txSegment++;
+    return WBTV_PHASE_STX;
+  }
+  if (txIndex == slot->channellen + slot->datalen)
+  {
+    return WBTV_PHASE_SUM_SLOW;
   }
+  return WBTV_PHASE_DATA;
 }
@@ -4,7 +4,18 @@
 #include "utility/protocol_definitions.h"
 #include "HardwareSerial.h"
 #include "utility/WBTVRand.h"
+#include "utility/WBTVFields.h"
 #include "utility/WBTVClock.h"
+#include "utility/WBTVByteClass.h"
+#include "utility/WBTVReceiver.h"
+#include "utility/WBTVDispatch.h"
+#include "utility/WBTVPatterns.h"
+#include "utility/WBTVFragment.h"
+#include "utility/WBTVRxRing.h"
+#include "utility/WBTVStats.h"
+#include "utility/WBTVTrace.h"
+#include "utility/WBTVEncode.h"
+#include "utility/WBTVAlias.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -15,15 +26,175 @@
 #include <Arduino.h>
 #endif
 
-class WBTVNode
+//How much of a reciever's buffer a frame takes: the header, the NUL that replaces the ~ after it,
+//the data with a NUL for each extra ~, and the two checksum bytes. Anything over WBTV_MAX_MESSAGE won't fit in a WBTVNode.
+#define WBTV_RX_SIZE(channellen, datalen, separators) ((unsigned int)(channellen) + 1 + (datalen) + (separators) + 2)
+
+#ifdef WBTV_ADV_MODE
+//Channels the library handles itself
+typedef WBTVName<'T','I','M','E'> WBTV_TIME_CHANNEL;
+#endif
+#ifdef WBTV_STATS
+typedef WBTVName<'S','T','A','T'> WBTV_STAT_CHANNEL;
+static_assert(WBTV_RX_SIZE(4, WBTV_STAT_PAYLOAD, 2) <= WBTV_MAX_MESSAGE, "A STAT message must fit in WBTV_MAX_MESSAGE, use fewer WBTV_STAT_BUCKETS");
+#endif
+#ifdef WBTV_TRACE
+typedef WBTVName<'T','R','A','C','E'> WBTV_TRACE_CHANNEL;
+#endif
+#ifdef WBTV_CHANNEL_ALIASES
+typedef WBTVName<'A','L','I','A','S'> WBTV_ALIAS_CHANNEL;
+static_assert(WBTV_RX_SIZE(5, 1 + WBTV_ALIAS_NAME, 0) <= WBTV_MAX_MESSAGE, "An ALIAS message with one name must fit in WBTV_MAX_MESSAGE, use a shorter WBTV_ALIAS_NAME");
+#endif
+
+//Identifies a queued frame. 0 is never a valid handle, sendMessage() returns it on failure.
+typedef unsigned char WBTV_tx_handle;
+
+//One outgoing frame, channel and data stored back to back in buf.
+struct WBTV_tx_slot
+{
+  WBTV_tx_handle handle;
+  unsigned char channellen;
+  unsigned char datalen;
+  unsigned char flags;
+  unsigned char priority;
+  //Extra ~ to send after the first one, and where in buf each one goes
+  unsigned char separators;
+  unsigned char separatorAt[WBTV_MAX_SEGMENTS - 1];
+  #ifdef WBTV_STATS
+  //micros() when it was queued
+  unsigned long queued;
+  #endif
+  unsigned char buf[WBTV_MAX_MESSAGE];
+};
+
+//One piece of the data for the gather sendMessage(), len bytes at data.
+struct WBTV_piece
 {
+  const void * data;
+  unsigned char len;
+};
+
+//Callback that gets each data segment separately, see setSegmentCallback()
+typedef void (*WBTV_segment_callback)(unsigned char * channel, unsigned char channellen, const struct WBTV_segments * segments);
+
+//How a channel's outgoing messages are queued, see setChannelPriority()
+struct WBTV_channel_rule
+{
+  const unsigned char *channel;
+  unsigned char channellen;
+  unsigned char priority;
+  unsigned char flags;
+  //Sent as this alias if it isn't 0, see setChannelAlias()
+  unsigned char alias;
+};
+
+//Handler for subscribe(). Gets the channel and data just like a binary callback, plus whatever userdata was subscribed with.
+typedef void (*WBTV_handler)(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned char datalen, void * userdata);
+
+//One entry in the subscription table. sumSlow and sumFast are the fletcher sum of the channel
+//so that most non-matching headers are rejected without a memcmp.
+struct WBTV_subscription
+{
+  const unsigned char *channel;
+  WBTV_handler handler;
+  void *userdata;
+  unsigned char channellen;
+  unsigned char sumSlow;
+  unsigned char sumFast;
+};
+
+#define WBTV_NO_SUBSCRIPTION 255
+
+//Message priorities. Higher goes first.
+#define WBTV_PRIORITY_LOW 0
+#define WBTV_PRIORITY_NORMAL 1
+#define WBTV_PRIORITY_HIGH 2
+#define WBTV_PRIORITY_URGENT 3
+//Use whatever setChannelPriority() said for the channel
+#define WBTV_PRIORITY_DEFAULT 255
+
+//Channel rule flag: keep only the newest waiting message on the channel.
+#define WBTV_COALESCE 1
+//Channel rule flag: send XOR framed when that's shorter, for binary data. Every node listening needs WBTV_XOR_FRAMING.
+#define WBTV_XOR_FRAMED 2
+
+//The data of this slot is a TIME payload, to be filled in as the start byte goes out.
+#define WBTV_SLOT_TIME 1
+//This slot has been started at least once, so starting it again is a retry.
+#define WBTV_SLOT_TRIED 2
+//Send XOR framed if it's shorter
+#define WBTV_SLOT_XOR 4
+
+//States of the transmit engine
+#define WBTV_TX_IDLE 0
+#define WBTV_TX_BACKOFF 1
+#define WBTV_TX_ECHO 2
+#define WBTV_TX_SEND 3
+
+//Where the transmit engine is within the frame
+#define WBTV_PHASE_DUMMY_STH 0
+#define WBTV_PHASE_STH 1
+#define WBTV_PHASE_HEADER 2
+#define WBTV_PHASE_STX 3
+#define WBTV_PHASE_DATA 4
+#define WBTV_PHASE_SUM_SLOW 5
+#define WBTV_PHASE_SUM_FAST 6
+#define WBTV_PHASE_EOT 7
+//The two ~ and key that start an XOR framed frame
+#define WBTV_PHASE_MARK 8
+#define WBTV_PHASE_MARK2 9
+#define WBTV_PHASE_KEY 10
+
+/*
+ *Everything a node does lives here. Don't make one of these directly, make a WBTVNode,
+ *or a WBTVSizedNode if you need a recieve buffer other than WBTV_MAX_MESSAGE bytes.
+ */
+class WBTVNodeBase : public WBTVReceiver<WBTVNodeBase>
+{
+  friend class WBTVReceiver<WBTVNodeBase>;
 public:
-  void sendMessage(const unsigned char * channel, const unsigned char channellen, const unsigned char * data, const unsigned char datalen);
-  void stringSendMessage(const char *channel, const char *data);
+  WBTV_tx_handle sendMessage(const unsigned char * channel, const unsigned char channellen, const unsigned char * data, const unsigned char datalen);
+  WBTV_tx_handle sendMessage(const unsigned char * channel, unsigned char channellen, const unsigned char * data, unsigned char datalen, unsigned char priority);
+  WBTV_tx_handle stringSendMessage(const char *channel, const char *data);
+  WBTV_tx_handle sendMessage(const unsigned char * channel, unsigned char channellen, const unsigned char * const * segments, const unsigned char * lengths, unsigned char count);
+  WBTV_tx_handle stringSendMessage(const char *channel, const char * const * segments, unsigned char count);
+  WBTV_tx_handle sendMessage(const unsigned char * channel, unsigned char channellen, const struct WBTV_piece * pieces, unsigned char count);
+
+  //Send values as the fields of a WBTVLayout, written little endian straight into the queue. See utility/WBTVFields.h
+  template <class Layout, typename... V>
+  WBTV_tx_handle publish(const unsigned char * channel, unsigned char channellen, V... values)
+  {
+    struct WBTV_tx_slot *slot;
+
+    //Even a one letter channel has to fit with it. The real channel is checked when it's queued.
+    static_assert(WBTV_RX_SIZE(1, Layout::size, 0) <= WBTV_MAX_MESSAGE, "The layout doesn't fit in WBTV_MAX_MESSAGE");
+    slot = allocateSlot(channel, channellen, Layout::size);
+    if (!slot)
+    {
+      return 0;
+    }
+    Layout::put(slot->buf + slot->channellen, values...);
+    return queued(slot);
+  }
+
+  template <class Layout, typename... V>
+  WBTV_tx_handle stringPublish(const char * channel, V... values)
+  {
+    return publish<Layout>((const unsigned char *)channel, strlen(channel), values...);
+  }
+  unsigned char isSending(WBTV_tx_handle handle);
+  //How many more messages fit in the queue right now
+  unsigned char queueSpace();
+  unsigned char setChannelPriority(const unsigned char * channel, unsigned char channellen, unsigned char priority, unsigned char flags);
+  unsigned char stringSetChannelPriority(const char * channel, unsigned char priority, unsigned char flags);
+  void flush();
   void decodeChar(unsigned char chr);
+  void decodeBuffer(const unsigned char * data, unsigned int len);
   void service();
-  WBTVNode( Stream *, int bus_sense_pin);
-  WBTVNode( Stream *);
+  void serviceAll();
+  //Take bytes from a ring filled by the UART interrupt instead of the port, 0 to go back to the port.
+  //Writes still go to the port.
+  void setRxRing(WBTVRxRing * ring);
   
   void setBinaryCallback(
   void (*thecallback)(
@@ -36,36 +207,182 @@ public:
   void (*thecallback)(
    char *, 
    char *));
+
+  void setSegmentCallback(WBTV_segment_callback thecallback);
+  //The segments of the frame being handled. Only meaningful inside a callback or handler.
+  const struct WBTV_segments * segments();
+
+  unsigned char subscribe(const unsigned char * channel, unsigned char channellen, WBTV_handler handler, void * userdata);
+  unsigned char stringSubscribe(const char * channel, WBTV_handler handler, void * userdata);
+  void unsubscribe(const unsigned char * channel, unsigned char channellen);
+
+  //Install a WBTVDispatcher built at compile time, see utility/WBTVDispatch.h
+  template <class Dispatcher>
+  void setDispatcher()
+  {
+    dispatchLookup = &Dispatcher::lookup;
+  }
+  #ifdef WBTV_PATTERNS
+  //Install a set of WBTVPatterns, see utility/WBTVPatterns.h
+  template <class Patterns>
+  void setPatterns()
+  {
+    trie = Patterns::Table::nodes;
+    trieHandlers = Patterns::handlers;
+  }
+  #endif
   
   unsigned int MIN_BACKOFF;
   unsigned int MAX_BACKOFF;
+  //Width of each priority class's backoff window in microseconds, 0 to have every class share one window.
+  unsigned int PRIORITY_WINDOW;
+  //How many bytes may be on their way round the bus at once on a wired-OR bus, up to WBTV_MAX_ECHO_WINDOW.
+  //1 waits for each byte to come back before sending the next.
+  unsigned char ECHO_WINDOW;
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  //How busy the bus has been lately, 0 to 255
+  unsigned char busLoad();
+  //How many times the backoff window has been doubled
+  unsigned char backoffExponent();
+  #endif
   #ifdef WBTV_ADV_MODE
-  void sendTime();
+  WBTV_tx_handle sendTime();
+  //Set to also hand TIME messages to the callbacks after the clock has been set from them.
+  unsigned char PASS_TIME;
+  #endif
+  #ifdef WBTV_STATS
+  //The counters, brought up to date. Good until the next call to anything else.
+  const struct WBTV_stats * stats();
+  void clearStats();
+  //Queue the counters as a STAT message
+  WBTV_tx_handle sendStats();
+  //Send STAT by itself every this many milliseconds, 0 to only send when asked.
+  unsigned long STAT_INTERVAL;
+  #endif
+  #ifdef WBTV_TRACE
+  //Send the trace ring out on TRACE, see utility/WBTVTrace.h
+  unsigned char sendTrace();
+  #endif
+  #ifdef WBTV_CHANNEL_ALIASES
+  //Send a channel as a 2 byte alias instead of its name, see utility/WBTVAlias.h
+  unsigned char setChannelAlias(const unsigned char * channel, unsigned char channellen, unsigned char alias);
+  unsigned char stringSetChannelAlias(const char * channel, unsigned char alias);
+  //Tell everyone what this node's aliases mean, or ask everyone for theirs
+  unsigned char announceAliases();
+  WBTV_tx_handle requestAliases();
+  //Announce them by themselves every this many milliseconds, 0 to only announce when asked.
+  unsigned long ALIAS_INTERVAL;
   #endif
 #ifdef WBTV_RECORD_TIME
   unsigned long message_start_time;
+  //micros() when the frame started. Exact if there is a ring, otherwise as good as message_start_time.
+  unsigned long message_start_micros;
   unsigned long lastServiced;
   unsigned int message_time_error;
   unsigned char message_time_accurate;
 #endif
+protected:
+  WBTVNodeBase( Stream *, int bus_sense_pin, unsigned char * buffer, unsigned char capacity);
+  WBTVNodeBase( Stream *, unsigned char * buffer, unsigned char capacity);
 private:   
-  //Pointer to the place to put the new char
-  unsigned char recievePointer;
-  //Place to keep track of where the header stops and data begins
-  unsigned char headerTerminatorPosition;
-  //Used for the fletcher checksum
-  unsigned char sumSlow,sumFast;
-  //If the last char recieved was an unesaped escape, this is true
-  unsigned char escape;
+  //Used for the fletcher checksum when sending
+  unsigned char txSumSlow,txSumFast;
 
-  //If this frame is garbage, true(like if it is too long)
-  unsigned char garbage;
+  //True if the header of this frame has a NUL in it
+  unsigned char headerHasNul;
+
+  //Index into subscriptions for this frame's channel, found when the ~ arrived
+  unsigned char rxSubscription;
+  //Same for the compile time dispatcher, if there is one
+  WBTV_dispatch_entry (*dispatchLookup)(unsigned char *, unsigned char, unsigned char, unsigned char);
+  WBTV_dispatch_entry rxEntry;
+  #ifdef WBTV_PATTERNS
+  //The pattern trie and its handlers, both in flash
+  const struct WBTV_trie_node *trie;
+  const WBTV_channel_handler *trieHandlers;
+  //The trie nodes the header so far could be at, and the patterns that have matched already
+  unsigned char rxActive[WBTV_MAX_PATTERNS];
+  unsigned char rxActiveCount;
+  WBTV_pattern_mask rxMatched;
+  #endif
+  #ifdef WBTV_ADV_MODE
+  //True if this frame is a TIME message
+  unsigned char rxIsTime;
+  #endif
+  #ifdef WBTV_STATS
+  //True if this frame is on the STAT channel
+  unsigned char rxIsStat;
+  struct WBTV_stats statCounters;
+  //millis() of the last STAT_INTERVAL send, and micros() when the frame at the front began waiting for the bus
+  unsigned long statSent;
+  unsigned long txWaitBegan;
+  //Ring overruns at the last clearStats()
+  uint32_t statRingBase;
+  #endif
+  #ifdef WBTV_TRACE
+  //True if this frame is on the TRACE channel
+  unsigned char rxIsTrace;
+  #endif
+  #ifdef WBTV_CHANNEL_ALIASES
+  //True if this frame is on the ALIAS channel
+  unsigned char rxIsAlias;
+  //Aliases other nodes have announced, and which one to replace next when it's full
+  struct WBTV_alias aliases[WBTV_ALIAS_TABLE];
+  unsigned char aliasNext;
+  //millis() of the last ALIAS_INTERVAL announcement
+  unsigned long aliasSent;
+  //The rule an announcement that didn't fit in the queue carries on from, WBTV_CHANNEL_RULES if there isn't one
+  unsigned char aliasResume;
+  #endif
+  struct WBTV_subscription subscriptions[WBTV_SUBSCRIPTIONS];
 
-  //Buffer for the message
-  unsigned char message[WBTV_MAX_MESSAGE];
+  //Bytes of the current decodeBuffer() block not yet decoded. They arrived before
+  //we looked, same as bytes still waiting in the port.
+  unsigned int bulkRemaining;
 
   unsigned char sensepin;
   unsigned char wiredor;
+
+  //Outgoing frames. txOrder lists the slots in use in the order they will go,
+  //the one at txOrder[0] is the one being sent.
+  struct WBTV_tx_slot txSlots[WBTV_TX_QUEUE];
+  unsigned char txOrder[WBTV_TX_QUEUE];
+  unsigned char txCount;
+  struct WBTV_channel_rule channelRules[WBTV_CHANNEL_RULES];
+  WBTV_tx_handle txNextHandle;
+
+  //Transmit engine state, see serviceTransmit()
+  unsigned char txState;
+  unsigned char txPhase;
+  //Position in the slot buffer
+  unsigned char txIndex;
+  //True if the escape for the byte under the cursor already went out
+  unsigned char txEscaped;
+  //How many of the slot's extra ~ have gone out
+  unsigned char txSegment;
+  #ifdef WBTV_XOR_FRAMING
+  //True if this attempt is XOR framed, and with what
+  unsigned char txXor;
+  unsigned char txKey;
+  #endif
+  //The bytes on the wire that we are waiting to hear back, oldest at txShadowHead
+  unsigned char txShadow[WBTV_MAX_ECHO_WINDOW];
+  unsigned char txShadowHead;
+  unsigned char txShadowCount;
+  //The \n is out, what's left is hearing it and the bytes before it back
+  unsigned char txSentAll;
+  //When the current backoff or echo wait began, and how long the backoff is
+  unsigned long txTimer;
+  unsigned long txWait;
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  //Doubles on every collision, halves back down on every frame that makes it
+  unsigned char txBackoffExp;
+  //Average share of the time the bus is busy, times 8 so it can be averaged in integers
+  unsigned int rxLoad;
+  //When the last frame we heard started and ended
+  unsigned long rxFrameStart;
+  unsigned long rxFrameEnd;
+  #endif
   
   void (*callback)(
   unsigned char *, 
@@ -77,14 +394,70 @@ private:
    char *,  
    char *);
 
+  WBTV_segment_callback segmentCallback;
+
 
   Stream *BUS_PORT;
+  //Where bytes come from if not the port, and the time the byte being decoded arrived
+  WBTVRxRing *rxRing;
+  unsigned long rxStamp;
+  unsigned char rxStamped;
 
   void updateHash(unsigned char chr);
-  unsigned char writeWrapper(unsigned char chr);
-  unsigned char escapedWrite(unsigned char chr);
-  void waitTillICanSend();
-  void inline handle_end_of_message();
+  //What WBTVReceiver calls at each step of a frame
+  void rxStart();
+  void rxHeaderByte(unsigned char chr);
+  unsigned char rxChannel();
+  unsigned char rxHeader();
+  void rxEnd();
+  void rxDiscard();
+  void rxFrame(unsigned char good);
+  unsigned char findSubscription();
+
+  struct WBTV_tx_slot * allocateSlot(const unsigned char * channel, unsigned char channellen, unsigned char datalen, unsigned char priority = WBTV_PRIORITY_DEFAULT, unsigned char separators = 0);
+  WBTV_tx_handle nextHandle();
+  WBTV_tx_handle queued(struct WBTV_tx_slot * slot);
+  unsigned char txFrontLocked();
+  void serviceTransmit();
+  void startFrame();
+  void startBackoff();
+  void collided();
+  unsigned long classOffset();
+  #ifdef WBTV_ADAPTIVE_BACKOFF
+  void noteFrameStart();
+  #endif
+  unsigned char busActive();
+  int rxAvailable();
+  int rxRead();
+  unsigned long rxNow();
+  void txSendBytes();
+  unsigned char txRawByte();
+  unsigned char txWireByte();
+  void txAdvance();
+  void txFinish();
+  #ifdef WBTV_CHANNEL_ALIASES
+  unsigned char expandAlias();
+  void learnAliases();
+  unsigned char queueAliases(unsigned char first);
+  #endif
+  #ifdef WBTV_PATTERNS
+  void trieStart();
+  void trieStep(unsigned char chr);
+  void trieRun(const unsigned char * header, unsigned char len);
+  void trieEnd();
+  void trieCall();
+  #endif
+  void txSeparators(struct WBTV_tx_slot * slot, unsigned char * separators);
+  #ifdef WBTV_XOR_FRAMING
+  int txChooseKey(struct WBTV_tx_slot * slot);
+  #endif
+  #ifdef WBTV_BULK_WRITE
+  void txBulk();
+  #endif
+  unsigned char txDataPhase(struct WBTV_tx_slot * slot);
+  #ifdef WBTV_ADV_MODE
+  void fillTime(unsigned char * data);
+  #endif
 
   void dummyCallback(
   unsigned char * header, 
@@ -96,6 +469,31 @@ private:
 
 };
 
+/*
+ *A node that can recieve messages up to Capacity bytes, counting the channel, ~, data and checksum.
+ *Each instance can have its own, so a USB link can take big messages while a bus node stays small.
+ *Anything longer than the buffer is dropped.
+ */
+template <unsigned char Capacity>
+class WBTVSizedNode : public WBTVNodeBase
+{
+public:
+  WBTVSizedNode(Stream *port, int bus_sense_pin) : WBTVNodeBase(port, bus_sense_pin, buffer, Capacity) {}
+  WBTVSizedNode(Stream *port) : WBTVNodeBase(port, buffer, Capacity) {}
+
+private:
+  static_assert(Capacity >= 4, "A node needs room for at least a one byte channel, the ~ and the checksum");
+  unsigned char buffer[Capacity];
+};
+
+//The normal node, with a WBTV_MAX_MESSAGE byte recieve buffer.
+class WBTVNode : public WBTVSizedNode<WBTV_MAX_MESSAGE>
+{
+public:
+  WBTVNode(Stream *port, int bus_sense_pin) : WBTVSizedNode<WBTV_MAX_MESSAGE>(port, bus_sense_pin) {}
+  WBTVNode(Stream *port) : WBTVSizedNode<WBTV_MAX_MESSAGE>(port) {}
+};
+
 
 
 /**Read one of whatever data type from the pointer you give it, then increment
@@ -103,9 +501,10 @@ private:
  *Example:
  *read_increment(x,unsigned char)
  *will return the value under the pointer, then increment the pointer by one.
+ *The value is little endian and is put together a byte at a time, so the pointer doesn't need to be aligned.
  */
 
-#define read_interpret(ptr,type) (*(type*)((ptr=ptr+sizeof(type))-sizeof(type)))
+#define read_interpret(ptr,type) (WBTVField<type>::get((const unsigned char *)((ptr=ptr+sizeof(type))-sizeof(type))))
 #define get_byte_of_value(datum,index) (((unsinged char*)&datum)[index])
 #endif
 
@@ -18,6 +18,8 @@ void setup()
 
 void loop()
 {
+  //Messages are sent from service(), so it needs to be called even if we never listen.
+  node.service();
  
   //If it has been long enough since the last one, send another message with the analog value
   if ((millis()-timeLastSent) >1000)
@@ -5,12 +5,18 @@
 
 WBTVNode usb(&Serial);
 
+void onBrightness(unsigned char * channel, unsigned char  clength, unsigned char * data, unsigned char dlength);
+
+//The channels this sketch listens to, worked out at compile time.
+//Anything else is dropped as soon as its header has arrived.
+typedef WBTVDispatcher<
+  WBTVChannel<&onBrightness, 'b','r','i','g','h','t','n','e','s','s'> > Channels;
 
 void setup()
 {
   delay(500);
   Serial.begin(9600);
-  usb.setBinaryCallback(&onMessageFromComputer);
+  usb.setDispatcher<Channels>();
   pinMode(13,OUTPUT);
 }
 
@@ -21,12 +27,9 @@ void loop()
  }
 
 
-void onMessageFromComputer(unsigned char * channel, unsigned char  clength, unsigned char * data, unsigned char dlength)
+void onBrightness(unsigned char * channel, unsigned char  clength, unsigned char * data, unsigned char dlength)
 {
 unsigned char p;
-if (memcmp(channel,"brightness",clength)==0)
-{
 p = read_interpret(data,unsigned char);
 analogWrite(13,p);
 }
-}
\ No newline at end of file
@@ -36,7 +36,13 @@ void setup()
 
 void loop()
 {
-  usb.service();
+  //Only read from the computer when the bus side has room for another frame. service() decodes one byte,
+  //so at most one frame finishes per call. A burst waits in the USB buffer, and USB has flow control,
+  //so nothing gets dropped while the bus is busy.
+  if (uart.queueSpace())
+  {
+    usb.service();
+  }
   uart.service();
   
   
@@ -69,10 +75,18 @@ void loop()
 
 void onMessageFromComputer(unsigned char * channel, unsigned char  clength, unsigned char * data, unsigned char dlength)
 {
-  uart.sendMessage(channel,clength,data,dlength);
+  //loop() made sure there's room, so this only fails if the frame is too big to ever go
+  if (!uart.sendMessage(channel,clength,data,dlength))
+  {
+    usb.stringSendMessage("CONV","Error: Frame too big for the bus");
+  }
 }
 
 void onMessageFromUART(unsigned char * channel, unsigned char  clength, unsigned char * data, unsigned char dlength)
 {
-  usb.sendMessage(channel,clength,data,dlength);
+  //USB is full duplex, so this goes straight out and the queue never fills up
+  if (!usb.sendMessage(channel,clength,data,dlength))
+  {
+    usb.stringSendMessage("CONV","Error: Frame too big for USB");
+  }
 }
@@ -0,0 +1,169 @@
+#include "../WBTVNode.h"
+
+#ifdef WBTV_CHANNEL_ALIASES
+/*
+ *Send frames on a channel with a NUL and alias as the header instead of the name. alias 0 goes back to the name.
+ *This uses one of the WBTV_CHANNEL_RULES, the same as setChannelPriority() does, and doesn't announce anything,
+ *call announceAliases() once they are all set.
+ */
+unsigned char WBTVNodeBase::setChannelAlias(const unsigned char * channel, unsigned char channellen, unsigned char alias)
+{
+  unsigned char i;
+
+  for (i = 0; i < WBTV_CHANNEL_RULES; i++)
+  {
+    if ((channelRules[i].channellen == channellen) && channelRules[i].channel &&
+        (memcmp(channelRules[i].channel, channel, channellen) == 0))
+    {
+      channelRules[i].alias = alias;
+      return 1;
+    }
+  }
+  if (!setChannelPriority(channel, channellen, WBTV_PRIORITY_NORMAL, 0))
+  {
+    return 0;
+  }
+  return setChannelAlias(channel, channellen, alias);
+}
+
+unsigned char WBTVNodeBase::stringSetChannelAlias(const char * channel, unsigned char alias)
+{
+  return setChannelAlias((const unsigned char *)channel, strlen(channel), alias);
+}
+
+/*
+ *Queue every alias this node sends with on ALIAS, each as its own segment.
+ *Returns 0 if the queue filled up before they were all in, the rest go from service() as it empties.
+ */
+unsigned char WBTVNodeBase::announceAliases()
+{
+  return queueAliases(0);
+}
+
+/*
+ *Queue the aliases from channel rule first on, in as many frames as it takes. Each frame gets as many as a
+ *WBTVNode can recieve, so a node with a lot of aliases doesn't announce them in a frame nobody can take.
+ *Returns 0 if the queue filled up, and remembers where to carry on from.
+ */
+unsigned char WBTVNodeBase::queueAliases(unsigned char first)
+{
+  unsigned char entries[WBTV_MAX_SEGMENTS][1 + WBTV_ALIAS_NAME];
+  const unsigned char * segments[WBTV_MAX_SEGMENTS];
+  unsigned char lengths[WBTV_MAX_SEGMENTS];
+  unsigned char i, start, count, total, len;
+
+  i = first;
+  while (1)
+  {
+    start = i;
+    count = 0;
+    total = 0;
+    for (; i < WBTV_CHANNEL_RULES; i++)
+    {
+      //Names too long for anyone to store aren't worth announcing
+      if (!channelRules[i].channel || !channelRules[i].alias || (channelRules[i].channellen > WBTV_ALIAS_NAME))
+      {
+        continue;
+      }
+      len = 1 + channelRules[i].channellen;
+      //Every segment after the first costs a byte for its ~ as well
+      if ((count == WBTV_MAX_SEGMENTS) || (WBTV_RX_SIZE(5, total + len, count) > WBTV_MAX_MESSAGE))
+      {
+        break;
+      }
+      entries[count][0] = channelRules[i].alias;
+      memcpy(entries[count] + 1, channelRules[i].channel, channelRules[i].channellen);
+      segments[count] = entries[count];
+      lengths[count] = len;
+      count++;
+      total += len;
+    }
+    if (!count)
+    {
+      aliasResume = WBTV_CHANNEL_RULES;
+      return 1;
+    }
+    if (!sendMessage((const unsigned char *)"ALIAS", 5, segments, lengths, count))
+    {
+      aliasResume = start;
+      return 0;
+    }
+  }
+}
+
+//Ask everyone to announce their aliases, for a node that has just joined the bus.
+WBTV_tx_handle WBTVNodeBase::requestAliases()
+{
+  return sendMessage((const unsigned char *)"ALIAS", 5, (const unsigned char *)"", 0);
+}
+
+//The header is a NUL and an alias. Put the name in its place. Returns 0 if we don't know it or it doesn't fit.
+unsigned char WBTVNodeBase::expandAlias()
+{
+  unsigned char i;
+
+  for (i = 0; i < WBTV_ALIAS_TABLE; i++)
+  {
+    if (aliases[i].id && (aliases[i].id == message[1]))
+    {
+      //Room for the name and the NUL after it
+      if (aliases[i].namelen >= messageCapacity)
+      {
+        return 0;
+      }
+      memcpy(message, aliases[i].name, aliases[i].namelen);
+      recievePointer = aliases[i].namelen;
+      headerHasNul = memchr(message, 0, recievePointer) ? 1 : 0;
+      rxSumSlow = aliases[i].sumSlow;
+      rxSumFast = aliases[i].sumFast;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//Remember every alias in the ALIAS message just recieved.
+void WBTVNodeBase::learnAliases()
+{
+  unsigned char s, i, len, slot;
+  unsigned char * entry;
+
+  for (s = 0; s < rxSegments.count; s++)
+  {
+    entry = rxSegments.segment(s);
+    len = rxSegments.length(s);
+    if ((len < 2) || !entry[0] || (len - 1 > WBTV_ALIAS_NAME))
+    {
+      continue;
+    }
+    //Update it if we have it, otherwise take an empty entry, otherwise take turns replacing them
+    slot = WBTV_ALIAS_TABLE;
+    for (i = 0; i < WBTV_ALIAS_TABLE; i++)
+    {
+      if (aliases[i].id == entry[0])
+      {
+        slot = i;
+        break;
+      }
+      if (!aliases[i].id && (slot == WBTV_ALIAS_TABLE))
+      {
+        slot = i;
+      }
+    }
+    if (slot == WBTV_ALIAS_TABLE)
+    {
+      slot = aliasNext;
+      aliasNext = (aliasNext + 1) % WBTV_ALIAS_TABLE;
+    }
+    aliases[slot].id = entry[0];
+    aliases[slot].namelen = len - 1;
+    memcpy(aliases[slot].name, entry + 1, len - 1);
+    aliases[slot].sumSlow = aliases[slot].sumFast = 0;
+    for (i = 1; i < len; i++)
+    {
+      aliases[slot].sumSlow += entry[i];
+      aliases[slot].sumFast += aliases[slot].sumSlow;
+    }
+  }
+}
+#endif
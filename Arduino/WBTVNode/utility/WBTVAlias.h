@@ -0,0 +1,31 @@
+#ifndef __WBTV_ALIAS_HEADER__
+#define __WBTV_ALIAS_HEADER__
+
+#ifdef WBTV_CHANNEL_ALIASES
+/*
+ *Channel aliases, so a long channel name doesn't go out in full on every frame.
+ *
+ *A publisher gives a channel a number from 1 to 255 with setChannelAlias(), and from then on frames on it
+ *go out with a NUL and the number for a header instead of the name. What number means what is announced on
+ *the ALIAS channel, one data segment per alias, each the number followed by the name. An empty ALIAS message
+ *asks every node to announce theirs.
+ *
+ *Receivers keep what they hear in a table of these and put the name back as soon as the header is in,
+ *so subscriptions, dispatchers and callbacks only ever see the real name. A frame on an alias that
+ *hasn't been announced yet is thrown away.
+ *
+ *The numbers are shared by everyone on the bus, so it's up to you to give each channel its own.
+ */
+struct WBTV_alias
+{
+  //0 if this entry is empty
+  unsigned char id;
+  unsigned char namelen;
+  //Fletcher sum of the name, which is what subscriptions and dispatchers match on
+  unsigned char sumSlow;
+  unsigned char sumFast;
+  unsigned char name[WBTV_ALIAS_NAME];
+};
+#endif
+
+#endif
@@ -0,0 +1,12 @@
+#include "WBTVNode.h"
+
+//The table is generated at compile time from WBTV_classify() so it can never
+//disagree with the protocol constants.
+#define WBTV_CLASS4(n) WBTV_classify(n), WBTV_classify((n) + 1), WBTV_classify((n) + 2), WBTV_classify((n) + 3)
+#define WBTV_CLASS16(n) WBTV_CLASS4(n), WBTV_CLASS4((n) + 4), WBTV_CLASS4((n) + 8), WBTV_CLASS4((n) + 12)
+#define WBTV_CLASS64(n) WBTV_CLASS16(n), WBTV_CLASS16((n) + 16), WBTV_CLASS16((n) + 32), WBTV_CLASS16((n) + 48)
+
+const unsigned char WBTV_byte_class_table[256] WBTV_PROGMEM =
+{
+  WBTV_CLASS64(0), WBTV_CLASS64(64), WBTV_CLASS64(128), WBTV_CLASS64(192)
+};
@@ -0,0 +1,35 @@
+#ifndef __WBTV_BYTECLASS_HEADER__
+#define __WBTV_BYTECLASS_HEADER__
+/*
+ *Every received byte gets sorted into one of these classes with a single table lookup,
+ *instead of comparing it against each control character in turn.
+ *Plain data is class 0 so the common case is one test against zero.
+ */
+#define WBTV_CLASS_DATA 0
+#define WBTV_CLASS_STH 1
+#define WBTV_CLASS_STX 2
+#define WBTV_CLASS_EOT 3
+#define WBTV_CLASS_ESC 4
+
+static constexpr unsigned char WBTV_classify(unsigned int chr)
+{
+  return chr == (unsigned char)WBTV_STH ? WBTV_CLASS_STH :
+         chr == (unsigned char)WBTV_STX ? WBTV_CLASS_STX :
+         chr == (unsigned char)WBTV_EOT ? WBTV_CLASS_EOT :
+         chr == (unsigned char)WBTV_ESC ? WBTV_CLASS_ESC :
+         WBTV_CLASS_DATA;
+}
+
+//On AVR the table lives in flash, 256 bytes of RAM is far too much to spend on it.
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define WBTV_PROGMEM PROGMEM
+#define WBTV_byte_class(chr) pgm_read_byte(&WBTV_byte_class_table[(unsigned char)(chr)])
+#else
+#define WBTV_PROGMEM
+#define WBTV_byte_class(chr) (WBTV_byte_class_table[(unsigned char)(chr)])
+#endif
+
+extern const unsigned char WBTV_byte_class_table[256] WBTV_PROGMEM;
+
+#endif
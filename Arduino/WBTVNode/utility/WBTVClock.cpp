@@ -90,17 +90,22 @@ while(temp - WBTVClock_prevMillis >= 1000){
 #endif
 
 #ifdef WBTV_ADV_MODE
-unsigned char WBTVNode::internalProcessMessage()
+unsigned char WBTVNodeBase::internalProcessMessage()
 {
     unsigned long error_temp;
-    if(headerTerminatorPosition == 4)
+    //Whether this is TIME was already worked out from the header checksum when the ~ arrived.
+    if (rxIsTime)
     {
-    if (memcmp(message,"TIME",4)==0)
+        WBTVView<WBTV_time_layout> t((unsigned char *)message+headerTerminatorPosition+1, recievePointer-(headerTerminatorPosition+3));
+        //Too short to be a time, but it's still ours so don't pass it on.
+        if (!t.valid())
+        {
+            return (1);
+        }
 
-    {
         //If the exponent is bigger than 8 we can't store that big of number
         //So assume the error is too high to count and store the flag value.
-        if ((*((signed char*) (message+17) ) ) > 8)
+        if (t.get<WBTV_TIME_EXPONENT>() > 8)
         {
             error_temp = (4294967294ul);
         }
@@ -114,14 +119,14 @@ unsigned char WBTVNode::internalProcessMessage()
             //in the other direction. Instead of actually estimating that,
             //lets assume the error is the maximum you can represent with an exponent of -16
             //In the worst case this will make our estimate 4ms too high.
-            if ((*(signed char*) (message+17)) >-16)
+            if (t.get<WBTV_TIME_EXPONENT>() >-16)
             {
-                error_temp = *(unsigned char*) (message+18);
+                error_temp = t.get<WBTV_TIME_MANTISSA>();
                 
                 //The fixed point value we are going for is measured in 2**16ths of a second
                 //therefore, if a the exponent is -16, the multiplier and the output are
                 //one and the same.
-                error_temp = error_temp << ((*(signed char*) (message+17))+15);
+                error_temp = error_temp << (t.get<WBTV_TIME_EXPONENT>()+15);
             }
             else
             {
@@ -164,11 +169,9 @@ unsigned char WBTVNode::internalProcessMessage()
             
             WBTVClock_prevMillis=message_start_time;
             WBTVClock_error = error_temp;
-            //5 Accounts for the 5 bytes of
-            WBTVClock_Sys_Time.seconds = *(long long*) (message+5);
-            //Message+ten= 8 to skip over the seconds part, and 2 to get to the 2 most significant bytes
-            //of the fractional portion(Because the WBTV time spec uses 32 bit fractions but this
-            //Library only uses 16 bits for the fractional time.
+            WBTVClock_Sys_Time.seconds = t.get<WBTV_TIME_SECONDS>();
+            //Only the 2 most significant bytes of the fractional portion, because the WBTV time spec
+            //uses 32 bit fractions but this Library only uses 16 bits for the fractional time.
             
             //This is basically approximate division by 65.53 to map
             //The fractional seconds to milliseconds.
@@ -176,133 +179,54 @@ unsigned char WBTVNode::internalProcessMessage()
             //We subtract this milliseconds value from prevMillis to
             //Attempt to make it equal to the millis value
             //exactly when the second rolled over.
-            WBTVClock_prevMillis -= (*(unsigned int*) (message+15)) >>6;
+            WBTVClock_prevMillis -= t.get<WBTV_TIME_FRACTION>() >>6;
             //Now we add the fraction value divided by 2**12
             //To compensate for dividing by 64 being too much.
-            WBTVClock_prevMillis += (*(unsigned int*) (message+15)) >>12;
-            WBTVClock_prevMillis += (*(unsigned int*) (message+15)) >>13;
+            WBTVClock_prevMillis += t.get<WBTV_TIME_FRACTION>() >>12;
+            WBTVClock_prevMillis += t.get<WBTV_TIME_FRACTION>() >>13;
 
 
-            //15 not 13 because we only want the two most significant bytes because
-            //arduino doesnt have ghz resolution
-            
-
         }
         
 
     return (1);
 }
-}
 return(0);
 }
 
-//Send the current time as estimated in the internal clock
-void WBTVNode::sendTime()
+//Queue the current time as estimated in the internal clock.
+//The time is read when the start byte actually goes out, not now.
+WBTV_tx_handle WBTVNodeBase::sendTime()
+{
+    struct WBTV_tx_slot *slot;
+
+    //8 bytes of seconds, 4 of fraction, 2 of error
+    slot = allocateSlot((const unsigned char *)"TIME", 4, WBTV_time_layout::size);
+    if (!slot)
+    {
+        return 0;
+    }
+    slot->flags |= WBTV_SLOT_TIME;
+    serviceTransmit();
+    WBTV_TRACE_POINT(WBTV_EV_QUEUED);
+    return slot->handle;
+}
+
+//Write the 14 byte TIME payload for the current moment into data.
+void WBTVNodeBase::fillTime(unsigned char * data)
 {
-    unsigned char i;
     unsigned long temp;
     signed char count;
     struct WBTV_Time_t t;
-    start:
-    sumFast=sumSlow =0;
-    waitTillICanSend();
-    
-    //Send the start byte.
-    if (writeWrapper('!'))
-        {
-            //If we sent the initial start byte sucessful
-            //Get the current time at which the ! was sent
-            t = WBTVClock_get_time();
-        }
-    else
-    {
-        goto  start;
-    }
-    
-    //Send and hash each byte of the channel name.
-    //We use writewrapper and not escapedwrite TIME
-    if(!writeWrapper('T'))
-       {
-        goto start;
-       }
-     if(!writeWrapper('I'))
-       {
-        goto start;
-       }
-        if(!writeWrapper('M'))
-       {
-        goto start;
-       }
-        if(!writeWrapper('E'))
-       {
-        goto start;
-       }
-       updateHash('T');updateHash('I');updateHash('M');updateHash('E');
-    
-    //Send the divider
-    if(!writeWrapper('~'))
-       {
-        goto start;
-       }
-    
-    //If the protocol definition says to include the ~ in the hash, update it.
-    #ifdef WBTV_HASH_STX
-    updateHash('~');
-    #endif
-    
-    
-    //Sent the 64 byte seconds count.
-    for (i=0;i<8;i++)
-    {
-        if(!escapedWrite(((const unsigned char *)(& t.seconds))[i]))
-        {
-            //Go back and retry if we get interfered with.
-            goto start;
-        }
-        updateHash(((const unsigned char *)(& t.seconds))[i]);
-    }
-    
-    //We don't know what the two least significant bytes of the 32 bit fraction are, because we only use 16 bits
-    //internally
-    //So we just send 0.5 times the possible range.
-    if(!escapedWrite(0))
-        {
-            goto start;
-        }
-        updateHash(0);
-        
-    if(!escapedWrite(127))
-        {
-            goto start;
-        }
-        updateHash(127);
-        
-    //Send the two most significant bytes of the fraction part of the time.
-    for (i=0;i<2;i++)
-    {
-        if(!escapedWrite(((unsigned char *)(& t.fraction))[i]))
-        {
-            goto start;
-        }
-        updateHash(((unsigned char *)(& t.fraction))[i]);
-    }
-    
+
+    t = WBTVClock_get_time();
+
     //If the error is too high to count, assume that it could be any crazy insane number.
     //Like perhaps older than the earth....
     if(WBTVClock_error >= 4294967294ul)
     {
-      
-        if(!escapedWrite(127))
-        {
-            goto start;
-        }
-        updateHash(127);
-        
-        if(!escapedWrite(255))
-        {
-            goto start;
-        }
-        updateHash(255);
+        count = 127;
+        temp = 255;
     }
     
     else
@@ -326,37 +250,12 @@ void WBTVNode::sendTime()
             temp = temp>>1;
             
         }
-    
-    //We send the count of divides
-    if(!escapedWrite(count))
-        {
-            goto start;
-        }
-        updateHash(count);
-        
-    //Now we send the actual value
-    if(!escapedWrite(temp&0xff))
-        {
-            goto start;
-        }
-        updateHash(temp&0xff);
     }
-    
-    //and now the hash
-        
-        if(!escapedWrite(sumSlow))
-        {
-            goto start;
-        }
-        if(!escapedWrite(sumFast))
-        {
-            goto start;
-        }
-        
-        if(!writeWrapper('\n'))
-        {
-            goto start;
-        }
+
+    //We don't know what the two least significant bytes of the 32 bit fraction are, because we only use 16 bits
+    //internally
+    //So we just send 0.5 times the possible range, which is 0 then 127.
+    WBTV_time_layout::put(data, t.seconds, 0x7f00, t.fraction, count, temp);
 }
 
 #endif
@@ -1,11 +1,20 @@
 #ifndef __WBTV_CLOCK_HEADER
 #define __WBTV_CLOCK_HEADER
+#include "WBTVFields.h"
 struct WBTV_Time_t
 {
     long long seconds;
     unsigned int fraction;
 };
 
+//The 14 bytes of a TIME message: 64 bit seconds, the 32 bit fraction as two halves, least significant first,
+//and the error as a power of two exponent and a mantissa.
+typedef WBTVLayout<int64_t, uint16_t, uint16_t, int8_t, uint8_t> WBTV_time_layout;
+#define WBTV_TIME_SECONDS 0
+#define WBTV_TIME_FRACTION 2
+#define WBTV_TIME_EXPONENT 3
+#define WBTV_TIME_MANTISSA 4
+
 #ifdef WBTV_ADV_MODE
 struct WBTV_Time_t WBTVClock_get_time();
 extern unsigned long WBTVClock_error;
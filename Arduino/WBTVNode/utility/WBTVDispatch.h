@@ -0,0 +1,244 @@
+#ifndef __WBTV_DISPATCH_HEADER__
+#define __WBTV_DISPATCH_HEADER__
+#include <stdint.h>
+/*
+ *Compile time channel dispatch, for firmware that knows all of its channels when it is built.
+ *
+ *    void onLED(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen);
+ *    void onMode(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen);
+ *
+ *    typedef WBTVDispatcher<
+ *      WBTVChannel<&onLED, 'L','E','D'>,
+ *      WBTVChannel<&onMode, 'M','O','D','E'> > MyChannels;
+ *
+ *    node.setDispatcher<MyChannels>();
+ *
+ *Channel names are spelled out as characters because C++11, which is what the AVR toolchain
+ *speaks, doesn't allow string literals as template arguments.
+ *
+ *The receiver already has the fletcher sum of the header by the time the ~ arrives, because it
+ *hashes as it goes. The dispatcher picks, at compile time, a multiplier that maps the sums of
+ *all of its channels to different buckets, so finding the handler is one multiply, one table read
+ *from flash, and a compare against the name. The names are compared as immediate values in code,
+ *and the bucket table is in flash on AVR, so none of this uses any RAM.
+ */
+
+//Checks a header against a channel name and calls its handler.
+//With call set to 0 it only checks. Returns 1 if the name matched.
+typedef unsigned char (*WBTV_dispatch_entry)(unsigned char * header, unsigned char headerlen, unsigned char * data, unsigned char datalen, unsigned char call);
+
+typedef void (*WBTV_channel_handler)(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned char datalen);
+
+#if defined(__AVR__)
+#define WBTV_read_entry(addr) ((WBTV_dispatch_entry)pgm_read_word(addr))
+#else
+#define WBTV_read_entry(addr) (*(addr))
+#endif
+
+//Fletcher sum of a name, computed by the compiler one character at a time.
+template <unsigned char Slow, unsigned char Fast, char... C>
+struct WBTVFletcher
+{
+  static const unsigned char slow = Slow;
+  static const unsigned char fast = Fast;
+};
+
+template <unsigned char Slow, unsigned char Fast, char H, char... C>
+struct WBTVFletcher<Slow, Fast, H, C...> :
+  WBTVFletcher<(unsigned char)(Slow + (unsigned char)H), (unsigned char)(Fast + Slow + (unsigned char)H), C...>
+{
+};
+
+//Compare a buffer against a name. This unrolls into one compare against a constant per character.
+template <char... C>
+struct WBTVNameMatch
+{
+  static inline unsigned char at(const unsigned char * p)
+  {
+    return 1;
+  }
+};
+
+template <char H, char... C>
+struct WBTVNameMatch<H, C...>
+{
+  static inline unsigned char at(const unsigned char * p)
+  {
+    return (*p == (unsigned char)H) && WBTVNameMatch<C...>::at(p + 1);
+  }
+};
+
+//16 bit key for a header from its length and fletcher sum. Also used on the recieve side at runtime.
+static constexpr uint16_t WBTV_channel_key(unsigned char len, unsigned char slow, unsigned char fast)
+{
+  return (uint16_t)(((uint16_t)slow | ((uint16_t)fast << 8)) ^ (uint16_t)((uint32_t)len * 40503u));
+}
+
+static constexpr unsigned char WBTV_bucket(uint16_t key, uint16_t seed, unsigned char bits)
+{
+  return (unsigned char)((uint16_t)((uint32_t)key * seed) >> (16 - bits));
+}
+
+//A channel name, without a handler. Useful on its own for checking a header against a fixed name.
+template <char... C>
+struct WBTVName
+{
+  static const unsigned char length = sizeof...(C);
+  static const unsigned char sumSlow = WBTVFletcher<0, 0, C...>::slow;
+  static const unsigned char sumFast = WBTVFletcher<0, 0, C...>::fast;
+  static const uint16_t key = WBTV_channel_key(sizeof...(C), WBTVFletcher<0, 0, C...>::slow, WBTVFletcher<0, 0, C...>::fast);
+
+  //slow and fast are the fletcher sum of the header, which lets almost every mismatch out after two compares.
+  static inline unsigned char matches(const unsigned char * header, unsigned char headerlen, unsigned char slow, unsigned char fast)
+  {
+    return (headerlen == length) && (slow == sumSlow) && (fast == sumFast) && WBTVNameMatch<C...>::at(header);
+  }
+};
+
+//A channel name plus the function that handles it.
+template <WBTV_channel_handler Handler, char... C>
+struct WBTVChannel : WBTVName<C...>
+{
+  static unsigned char entry(unsigned char * header, unsigned char headerlen, unsigned char * data, unsigned char datalen, unsigned char call)
+  {
+    if ((headerlen != sizeof...(C)) || !WBTVNameMatch<C...>::at(header))
+    {
+      return 0;
+    }
+    if (call)
+    {
+      Handler(header, headerlen, data, datalen);
+    }
+    return 1;
+  }
+};
+
+/*
+ *Everything below here is the compile time search for a multiplier that gives every channel its own bucket.
+ */
+
+//True if no key in Keys lands in bucket B
+template <unsigned char B, uint16_t Seed, unsigned char Bits, uint16_t... Keys>
+struct WBTVBucketFree
+{
+  static const bool value = true;
+};
+
+template <unsigned char B, uint16_t Seed, unsigned char Bits, uint16_t K, uint16_t... Keys>
+struct WBTVBucketFree<B, Seed, Bits, K, Keys...>
+{
+  static const bool value = (WBTV_bucket(K, Seed, Bits) != B) && WBTVBucketFree<B, Seed, Bits, Keys...>::value;
+};
+
+//True if every key lands in a different bucket
+template <uint16_t Seed, unsigned char Bits, uint16_t... Keys>
+struct WBTVBucketsDistinct
+{
+  static const bool value = true;
+};
+
+template <uint16_t Seed, unsigned char Bits, uint16_t K, uint16_t... Keys>
+struct WBTVBucketsDistinct<Seed, Bits, K, Keys...>
+{
+  static const bool value = WBTVBucketFree<WBTV_bucket(K, Seed, Bits), Seed, Bits, Keys...>::value &&
+                            WBTVBucketsDistinct<Seed, Bits, Keys...>::value;
+};
+
+//Odd multipliers only. Gives up after WBTV_DISPATCH_MAX_SEED and lets the static_assert in WBTVDispatcher explain.
+#define WBTV_DISPATCH_MAX_SEED 601
+
+template <uint16_t Seed, unsigned char Bits, bool Done, uint16_t... Keys>
+struct WBTVSeedSearch :
+  WBTVSeedSearch<Seed + 2, Bits, WBTVBucketsDistinct<Seed + 2, Bits, Keys...>::value || (Seed + 2 >= WBTV_DISPATCH_MAX_SEED), Keys...>
+{
+};
+
+template <uint16_t Seed, unsigned char Bits, uint16_t... Keys>
+struct WBTVSeedSearch<Seed, Bits, true, Keys...>
+{
+  static const uint16_t seed = Seed;
+};
+
+//Bucket count is at least 4x the channel count, which keeps the search short.
+static constexpr unsigned char WBTV_dispatch_bits(unsigned int n, unsigned char bits = 1)
+{
+  return ((1u << bits) >= n * 4) ? bits : WBTV_dispatch_bits(n, bits + 1);
+}
+
+//The entry for whichever channel lands in bucket B, or 0.
+template <unsigned char B, uint16_t Seed, unsigned char Bits, class... Ch>
+struct WBTVBucketEntry
+{
+  static constexpr WBTV_dispatch_entry value()
+  {
+    return 0;
+  }
+};
+
+template <unsigned char B, uint16_t Seed, unsigned char Bits, class Ch, class... Rest>
+struct WBTVBucketEntry<B, Seed, Bits, Ch, Rest...>
+{
+  static constexpr WBTV_dispatch_entry value()
+  {
+    return (WBTV_bucket(Ch::key, Seed, Bits) == B) ? &Ch::entry : WBTVBucketEntry<B, Seed, Bits, Rest...>::value();
+  }
+};
+
+template <unsigned int... I>
+struct WBTVIndices
+{
+};
+
+template <unsigned int N, unsigned int... I>
+struct WBTVMakeIndices : WBTVMakeIndices<N - 1, N - 1, I...>
+{
+};
+
+template <unsigned int... I>
+struct WBTVMakeIndices<0, I...>
+{
+  typedef WBTVIndices<I...> type;
+};
+
+template <uint16_t Seed, unsigned char Bits, class Indices, class... Ch>
+struct WBTVDispatchTable;
+
+template <uint16_t Seed, unsigned char Bits, unsigned int... I, class... Ch>
+struct WBTVDispatchTable<Seed, Bits, WBTVIndices<I...>, Ch...>
+{
+  static const WBTV_dispatch_entry table[sizeof...(I)];
+};
+
+template <uint16_t Seed, unsigned char Bits, unsigned int... I, class... Ch>
+const WBTV_dispatch_entry WBTVDispatchTable<Seed, Bits, WBTVIndices<I...>, Ch...>::table[sizeof...(I)] WBTV_PROGMEM =
+{
+  WBTVBucketEntry<I, Seed, Bits, Ch...>::value()...
+};
+
+template <class... Ch>
+struct WBTVDispatcher
+{
+  static const unsigned char bits = WBTV_dispatch_bits(sizeof...(Ch));
+  static const uint16_t seed = WBTVSeedSearch<1, bits, WBTVBucketsDistinct<1, bits, Ch::key...>::value, Ch::key...>::seed;
+
+  static_assert(sizeof...(Ch) > 0, "A dispatcher needs at least one channel");
+  static_assert(sizeof...(Ch) <= 32, "Too many channels for one dispatcher");
+  static_assert(WBTVBucketsDistinct<seed, bits, Ch::key...>::value,
+                "Two channels have the same length and checksum and can't be told apart. Rename one of them.");
+
+  typedef WBTVDispatchTable<seed, bits, typename WBTVMakeIndices<(1 << bits)>::type, Ch...> Table;
+
+  //Find the entry for a header, given its length and fletcher sum. 0 if it isn't one of ours.
+  static WBTV_dispatch_entry lookup(unsigned char * header, unsigned char headerlen, unsigned char slow, unsigned char fast)
+  {
+    WBTV_dispatch_entry entry;
+    entry = WBTV_read_entry(&Table::table[WBTV_bucket(WBTV_channel_key(headerlen, slow, fast), seed, bits)]);
+    if (entry && entry(header, headerlen, 0, 0, 0))
+    {
+      return entry;
+    }
+    return 0;
+  }
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include "WBTVNode.h"
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+unsigned int WBTV_find_special(const unsigned char * data, unsigned int len)
+{
+  unsigned int i = 0;
+
+#if defined(__AVX2__)
+  {
+    const __m256i sth = _mm256_set1_epi8(WBTV_STH);
+    const __m256i stx = _mm256_set1_epi8(WBTV_STX);
+    const __m256i eot = _mm256_set1_epi8(WBTV_EOT);
+    const __m256i esc = _mm256_set1_epi8(WBTV_ESC);
+    for (; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+      __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sth), _mm256_cmpeq_epi8(v, stx)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, eot), _mm256_cmpeq_epi8(v, esc)));
+      unsigned int mask = _mm256_movemask_epi8(hit);
+      if (mask)
+      {
+        return i + __builtin_ctz(mask);
+      }
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  {
+    //Also picks up what's left after the AVX2 loop
+    const __m128i sth = _mm_set1_epi8(WBTV_STH);
+    const __m128i stx = _mm_set1_epi8(WBTV_STX);
+    const __m128i eot = _mm_set1_epi8(WBTV_EOT);
+    const __m128i esc = _mm_set1_epi8(WBTV_ESC);
+    for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+      __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sth), _mm_cmpeq_epi8(v, stx)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, eot), _mm_cmpeq_epi8(v, esc)));
+      unsigned int mask = _mm_movemask_epi8(hit);
+      if (mask)
+      {
+        return i + __builtin_ctz(mask);
+      }
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  {
+    const uint8x16_t sth = vdupq_n_u8(WBTV_STH);
+    const uint8x16_t stx = vdupq_n_u8(WBTV_STX);
+    const uint8x16_t eot = vdupq_n_u8(WBTV_EOT);
+    const uint8x16_t esc = vdupq_n_u8(WBTV_ESC);
+    for (; i + 16 <= len; i += 16)
+    {
+      uint8x16_t v = vld1q_u8(data + i);
+      uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, sth), vceqq_u8(v, stx)), vorrq_u8(vceqq_u8(v, eot), vceqq_u8(v, esc)));
+      //NEON has no movemask, so just find out if there is one and let the loop below say where.
+      if (vmaxvq_u8(hit))
+      {
+        break;
+      }
+    }
+  }
+#endif
+
+  for (; i < len; i++)
+  {
+    if (WBTV_byte_class(data[i]))
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+//Copy len bytes escaped, adding them to the checksum.
+static unsigned char * WBTV_encode_run(unsigned char * out, const unsigned char * data, unsigned int len,
+                                       unsigned char * sumSlow, unsigned char * sumFast)
+{
+  unsigned char slow = *sumSlow, fast = *sumFast;
+  unsigned int n, i;
+
+  while (len)
+  {
+    //Plain bytes go across in one go, then the special one after them gets its escape.
+    n = WBTV_find_special(data, len);
+    memcpy(out, data, n);
+    out += n;
+    for (i = 0; i < n; i++)
+    {
+      slow += data[i];
+      fast += slow;
+    }
+    data += n;
+    len -= n;
+    if (len)
+    {
+      *out++ = WBTV_ESC;
+      *out++ = *data;
+      slow += *data;
+      fast += slow;
+      data++;
+      len--;
+    }
+  }
+  *sumSlow = slow;
+  *sumFast = fast;
+  return out;
+}
+
+//Copy len bytes XORed with key. Nothing needs escaping, WBTV_xor_key() made sure.
+static unsigned char * WBTV_encode_xor_run(unsigned char * out, const unsigned char * data, unsigned int len, unsigned char key,
+                                           unsigned char * sumSlow, unsigned char * sumFast)
+{
+  unsigned char slow = *sumSlow, fast = *sumFast;
+
+  while (len--)
+  {
+    slow += *data;
+    fast += slow;
+    *out++ = *data++ ^ key;
+  }
+  *sumSlow = slow;
+  *sumFast = fast;
+  return out;
+}
+
+unsigned int WBTV_encode(unsigned char * out, const unsigned char * channel, unsigned char channellen,
+                         const unsigned char * data, unsigned char datalen,
+                         const unsigned char * separatorAt, unsigned char separators, int key)
+{
+  unsigned char * start = out;
+  unsigned char slow = 0, fast = 0, sums[2];
+  unsigned char at = 0, segment = 0, upto;
+
+#ifdef DUMMY_WBTV_STH
+  *out++ = WBTV_STH;
+#endif
+  *out++ = WBTV_STH;
+  if (key >= 0)
+  {
+    //The marker isn't part of the checksum
+    *out++ = WBTV_STX;
+    *out++ = WBTV_STX;
+    *out++ = key;
+    out = WBTV_encode_xor_run(out, channel, channellen, key, &slow, &fast);
+  }
+  else
+  {
+    out = WBTV_encode_run(out, channel, channellen, &slow, &fast);
+  }
+
+  //The ~ after the header, then each segment with its ~ in front of it. The same order txAdvance() sends them in.
+  for (;;)
+  {
+    *out++ = WBTV_STX;
+#ifdef WBTV_HASH_STX
+    slow += WBTV_STX;
+    fast += slow;
+#endif
+    upto = (segment < separators) ? separatorAt[segment] : datalen;
+    if (key >= 0)
+    {
+      out = WBTV_encode_xor_run(out, data + at, upto - at, key, &slow, &fast);
+    }
+    else
+    {
+      out = WBTV_encode_run(out, data + at, upto - at, &slow, &fast);
+    }
+    at = upto;
+    if (segment >= separators)
+    {
+      break;
+    }
+    segment++;
+  }
+
+  sums[0] = slow;
+  sums[1] = fast;
+  if (key >= 0)
+  {
+    out = WBTV_encode_xor_run(out, sums, 2, key, &slow, &fast);
+  }
+  else
+  {
+    out = WBTV_encode_run(out, sums, 2, &slow, &fast);
+  }
+  *out++ = WBTV_EOT;
+  return out - start;
+}
+
+//Mark every key that would turn chr into a control character as no good.
+static unsigned char WBTV_xor_exclude(unsigned char * bad, unsigned char chr)
+{
+  bad[(chr ^ WBTV_STH) >> 3] |= 1 << ((chr ^ WBTV_STH) & 7);
+  bad[(chr ^ WBTV_STX) >> 3] |= 1 << ((chr ^ WBTV_STX) & 7);
+  bad[(chr ^ WBTV_EOT) >> 3] |= 1 << ((chr ^ WBTV_EOT) & 7);
+  bad[(chr ^ WBTV_ESC) >> 3] |= 1 << ((chr ^ WBTV_ESC) & 7);
+  //And say if it would have needed an escape
+  return WBTV_byte_class(chr) ? 1 : 0;
+}
+
+int WBTV_xor_key(const unsigned char * channel, unsigned char channellen,
+                 const unsigned char * data, unsigned char datalen,
+                 const unsigned char * separatorAt, unsigned char separators)
+{
+  unsigned char bad[32];
+  unsigned char slow = 0, fast = 0, segment = 0;
+  unsigned int escapes = 0, i;
+
+  memset(bad, 0, sizeof(bad));
+  //The key goes out as it is, so it can't be a control character itself. XOR with 0 leaves them alone.
+  WBTV_xor_exclude(bad, 0);
+
+  for (i = 0; i < channellen; i++)
+  {
+    escapes += WBTV_xor_exclude(bad, channel[i]);
+    slow += channel[i];
+    fast += slow;
+  }
+#ifdef WBTV_HASH_STX
+  slow += WBTV_STX;
+  fast += slow;
+#endif
+  for (i = 0; i < datalen; i++)
+  {
+    //Hash the ~ in front of a new segment where it goes
+    while ((segment < separators) && (separatorAt[segment] == i))
+    {
+#ifdef WBTV_HASH_STX
+      slow += WBTV_STX;
+      fast += slow;
+#endif
+      segment++;
+    }
+    escapes += WBTV_xor_exclude(bad, data[i]);
+    slow += data[i];
+    fast += slow;
+  }
+#ifdef WBTV_HASH_STX
+  for (; segment < separators; segment++)
+  {
+    slow += WBTV_STX;
+    fast += slow;
+  }
+#endif
+  escapes += WBTV_xor_exclude(bad, slow);
+  escapes += WBTV_xor_exclude(bad, fast);
+
+  //The marker and the key cost three bytes, so it has to save more than that.
+  if (escapes <= 3)
+  {
+    return -1;
+  }
+  for (i = 0; i < 256; i++)
+  {
+    if (!(bad[i >> 3] & (1 << (i & 7))))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef __WBTV_ENCODE_HEADER__
+#define __WBTV_ENCODE_HEADER__
+
+/*
+ *Builds a whole frame in a buffer in one pass, escaping and checksumming as it copies,
+ *so it can go to the port in one write(). Full duplex nodes send this way with WBTV_BULK_WRITE,
+ *and anything that wants frames without a node, like a gateway, can call it directly.
+ */
+
+//The most bytes a frame with len bytes of channel and data and segments data segments can take on the wire:
+//two start codes, everything escaped, a ~ per segment, two escaped checksum bytes and the \n.
+#define WBTV_ENCODED_MAX(len, segments) (2 * (len) + (segments) + 7)
+
+//Where the first byte in data that needs an escape is, or len if none do.
+//Uses SSE2, AVX2 or NEON when the compiler is targeting them.
+unsigned int WBTV_find_special(const unsigned char * data, unsigned int len);
+
+/*
+ *Write a frame to out, which needs WBTV_ENCODED_MAX(channellen + datalen, separators + 1) bytes, and return its length.
+ *separatorAt lists where in data each extra ~ goes, in order, for frames with more than one segment.
+ *With a key from WBTV_xor_key() the frame is sent XOR framed instead of escaped.
+ */
+unsigned int WBTV_encode(unsigned char * out, const unsigned char * channel, unsigned char channellen,
+                         const unsigned char * data, unsigned char datalen,
+                         const unsigned char * separatorAt = 0, unsigned char separators = 0, int key = -1);
+
+/*
+ *XOR framing, for binary channels that would otherwise be full of escapes.
+ *
+ *The frame is !~~ then a key byte, then the channel, ~ separators, data and checksum as usual but with every byte
+ *XORed with the key and nothing escaped. The key is picked so that none of them come out as a control character,
+ *which with 4 control characters is always possible for up to 62 bytes, and nearly always for more.
+ *The checksum is of the bytes before XORing, so it's the same as the escaped frame's.
+ *
+ *A node that doesn't know about it takes the first ~ as ending an empty channel and the second as the start of the data,
+ *so the ~ after the real channel is one too many and it throws the frame away without checking the checksum.
+ *Nothing after the ! can look like a start code, so it is never confused by one.
+ *
+ *Returns the key to use, or -1 if there isn't one or escaping comes out just as short.
+ */
+int WBTV_xor_key(const unsigned char * channel, unsigned char channellen,
+                 const unsigned char * data, unsigned char datalen,
+                 const unsigned char * separatorAt = 0, unsigned char separators = 0);
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef __WBTV_FIELDS_HEADER__
+#define __WBTV_FIELDS_HEADER__
+#include <stdint.h>
+#include <string.h>
+/*
+ *Little endian fields in messages, read and written a byte at a time so it doesn't matter where in
+ *the buffer they are or what CPU this is. A message made of fixed size fields is described by a layout:
+ *
+ *    //Seconds, then a reading, then a status byte
+ *    typedef WBTVLayout<int64_t, float, uint8_t> Reading;
+ *
+ *    node.stringPublish<Reading>("TEMP", now, 21.5, 0);
+ *
+ *    void onTemp(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen, void *userdata)
+ *    {
+ *      WBTVView<Reading> r(data, dlen);
+ *      if (r.valid())
+ *      {
+ *        float t = r.get<1>();
+ *      }
+ *    }
+ *
+ *Sizes and offsets are worked out by the compiler, publish() writes the fields straight into the transmit
+ *queue and get() reads each one straight out of message[], so nothing is copied to a struct on the way.
+ *Floats go as their IEEE bits. A double is only 4 bytes on AVR, so use float in anything an Arduino sees.
+ */
+
+//The unsigned type the same size as a field, which is what the bytes are shifted in and out of
+template <unsigned char Size> struct WBTVFieldBits;
+template <> struct WBTVFieldBits<1> { typedef uint8_t type; };
+template <> struct WBTVFieldBits<2> { typedef uint16_t type; };
+template <> struct WBTVFieldBits<4> { typedef uint32_t type; };
+template <> struct WBTVFieldBits<8> { typedef uint64_t type; };
+
+template <typename T>
+struct WBTVField
+{
+  typedef typename WBTVFieldBits<sizeof(T)>::type bits;
+  static constexpr unsigned char size = sizeof(T);
+
+  static inline void put(unsigned char * p, T value)
+  {
+    bits b;
+    unsigned char i;
+
+    //memcpy of a fixed size is just a move, and unlike a cast it's allowed for floats and signed types
+    memcpy(&b, &value, sizeof(T));
+    for (i = 0; i < sizeof(T); i++)
+    {
+      p[i] = (unsigned char)(b >> (8 * i));
+    }
+  }
+
+  static inline T get(const unsigned char * p)
+  {
+    bits b = 0;
+    unsigned char i;
+    T value;
+
+    for (i = 0; i < sizeof(T); i++)
+    {
+      b |= ((bits)p[i]) << (8 * i);
+    }
+    memcpy(&value, &b, sizeof(T));
+    return value;
+  }
+};
+
+//A list of fields, one right after the other with no padding
+template <typename... F>
+struct WBTVLayout;
+
+template <>
+struct WBTVLayout<>
+{
+  static constexpr unsigned int size = 0;
+  static inline void put(unsigned char *) {}
+};
+
+template <typename H, typename... F>
+struct WBTVLayout<H, F...>
+{
+  typedef H head;
+  typedef WBTVLayout<F...> tail;
+  static constexpr unsigned int size = sizeof(H) + WBTVLayout<F...>::size;
+
+  static inline void put(unsigned char * p, H value, F... rest)
+  {
+    WBTVField<H>::put(p, value);
+    tail::put(p + sizeof(H), rest...);
+  }
+};
+
+//The type of field N of a layout and where it starts
+template <unsigned char N, class Layout>
+struct WBTVLayoutField
+{
+  static_assert(Layout::size, "Field number is past the end of the layout");
+  typedef typename WBTVLayoutField<N - 1, typename Layout::tail>::type type;
+  static constexpr unsigned int offset = sizeof(typename Layout::head) + WBTVLayoutField<N - 1, typename Layout::tail>::offset;
+};
+
+template <class Layout>
+struct WBTVLayoutField<0, Layout>
+{
+  typedef typename Layout::head type;
+  static constexpr unsigned int offset = 0;
+};
+
+//Reads the fields of a layout out of a message without copying it
+template <class Layout>
+class WBTVView
+{
+public:
+  WBTVView(const unsigned char * data, unsigned char datalen) : data(data), good(datalen >= Layout::size) {}
+
+  //False if the message is too short to have all the fields, in which case don't get() anything.
+  bool valid() const
+  {
+    return good;
+  }
+
+  template <unsigned char N>
+  typename WBTVLayoutField<N, Layout>::type get() const
+  {
+    return WBTVField<typename WBTVLayoutField<N, Layout>::type>::get(data + WBTVLayoutField<N, Layout>::offset);
+  }
+
+private:
+  const unsigned char * data;
+  bool good;
+};
+
+#endif
@@ -0,0 +1,194 @@
+#include "../WBTVNode.h"
+
+WBTVFragmenter::WBTVFragmenter(WBTVNodeBase * node)
+{
+  this->node = node;
+  channel = 0;
+  data = 0;
+  datalen = 0;
+  index = count = 0;
+  channellen = 0;
+  chunk = 0;
+  id = 0;
+  handle = 0;
+}
+
+/*
+ *Start sending data as fragments on channel. Nothing is copied, so the channel and data have to
+ *stay around until isSending() says it's done. chunk is how much payload goes in each fragment,
+ *0 picks the most that still fits in a WBTV_MAX_MESSAGE reciever.
+ *Returns 0 if something is already being sent or the payload can't be split up.
+ */
+unsigned char WBTVFragmenter::send(const unsigned char * channel, unsigned char channellen, const unsigned char * data, unsigned int datalen, unsigned char chunk)
+{
+  unsigned int most;
+  unsigned long fragments;
+
+  if (isSending())
+  {
+    return 0;
+  }
+
+  //The reciever also has to hold the ~ and the checksum
+  if (((unsigned int)channellen + WBTV_FRAGMENT_HEADER + 3) >= WBTV_MAX_MESSAGE)
+  {
+    return 0;
+  }
+  most = WBTV_MAX_MESSAGE - 3 - WBTV_FRAGMENT_HEADER - channellen;
+  if ((chunk == 0) || (chunk > most))
+  {
+    chunk = most;
+  }
+
+  //An empty payload is still one empty fragment, so the reciever hears about it.
+  fragments = datalen ? (((unsigned long)datalen + chunk - 1) / chunk) : 1;
+  if (fragments > 65535)
+  {
+    return 0;
+  }
+
+  this->channel = channel;
+  this->channellen = channellen;
+  this->data = data;
+  this->datalen = datalen;
+  this->chunk = chunk;
+  count = fragments;
+  index = 0;
+  id++;
+  service();
+  return 1;
+}
+
+unsigned char WBTVFragmenter::stringSend(const char * channel, const unsigned char * data, unsigned int datalen)
+{
+  return send((const unsigned char *)channel, strlen(channel), data, datalen);
+}
+
+/*
+ *Put the next fragment in the queue once the last one has gone out. Call this along with node.service().
+ *Only one fragment waits at a time, so the queue stays free for everything else.
+ */
+void WBTVFragmenter::service()
+{
+  unsigned char frame[WBTV_MAX_MESSAGE];
+  unsigned int offset;
+  unsigned char len;
+
+  if (index >= count)
+  {
+    return;
+  }
+  if (handle && node->isSending(handle))
+  {
+    return;
+  }
+
+  offset = index * chunk;
+  len = ((datalen - offset) > chunk) ? chunk : (datalen - offset);
+
+  frame[0] = id;
+  frame[1] = index & 0xff;
+  frame[2] = index >> 8;
+  frame[3] = count & 0xff;
+  frame[4] = count >> 8;
+  memcpy(frame + WBTV_FRAGMENT_HEADER, data + offset, len);
+
+  handle = node->sendMessage(channel, channellen, frame, len + WBTV_FRAGMENT_HEADER);
+  //Queue full, try again next time
+  if (handle)
+  {
+    index++;
+  }
+}
+
+unsigned char WBTVFragmenter::isSending()
+{
+  return (index < count) || (handle && node->isSending(handle));
+}
+
+/*
+ *buffer is where the payload is put back together, so it needs to be as big as the biggest payload
+ *you expect. handler gets called with it once it is all there.
+ */
+WBTVReassembler::WBTVReassembler(unsigned char * buffer, unsigned int size, WBTV_reassembled_handler handler, void * userdata)
+{
+  this->buffer = buffer;
+  this->size = size;
+  done = handler;
+  this->userdata = userdata;
+  filled = index = count = 0;
+  id = 0;
+  active = 0;
+  dropped = 0;
+}
+
+unsigned char WBTVReassembler::subscribe(WBTVNodeBase * node, const unsigned char * channel, unsigned char channellen)
+{
+  return node->subscribe(channel, channellen, &WBTVReassembler::handler, this);
+}
+
+unsigned char WBTVReassembler::stringSubscribe(WBTVNodeBase * node, const char * channel)
+{
+  return node->stringSubscribe(channel, &WBTVReassembler::handler, this);
+}
+
+void WBTVReassembler::handler(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned char datalen, void * userdata)
+{
+  ((WBTVReassembler *)userdata)->feed(channel, channellen, data, datalen);
+}
+
+//Hand one fragment to the reassembler. Only needed if you aren't using subscribe().
+void WBTVReassembler::feed(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned char datalen)
+{
+  unsigned int fragindex, fragcount;
+  unsigned char len;
+
+  if (datalen < WBTV_FRAGMENT_HEADER)
+  {
+    return;
+  }
+  fragindex = data[1] | ((unsigned int)data[2] << 8);
+  fragcount = data[3] | ((unsigned int)data[4] << 8);
+  len = datalen - WBTV_FRAGMENT_HEADER;
+
+  if (fragindex == 0)
+  {
+    //A new payload. Anything half done is lost.
+    if (active)
+    {
+      dropped++;
+    }
+    active = 1;
+    id = data[0];
+    count = fragcount;
+    index = 0;
+    filled = 0;
+  }
+  else if (!active)
+  {
+    return;
+  }
+  else if ((data[0] != id) || (fragindex != index) || (fragcount != count))
+  {
+    active = 0;
+    dropped++;
+    return;
+  }
+
+  if ((fragindex >= count) || ((unsigned long)filled + len > size))
+  {
+    active = 0;
+    dropped++;
+    return;
+  }
+
+  memcpy(buffer + filled, data + WBTV_FRAGMENT_HEADER, len);
+  filled += len;
+  index++;
+
+  if (index == count)
+  {
+    active = 0;
+    done(channel, channellen, buffer, filled, userdata);
+  }
+}
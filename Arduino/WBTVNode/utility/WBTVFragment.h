@@ -0,0 +1,71 @@
+#ifndef __WBTV_FRAGMENT_HEADER__
+#define __WBTV_FRAGMENT_HEADER__
+/*
+ *Sending things bigger than one frame, like firmware images or logs.
+ *
+ *A big payload goes out as a series of ordinary messages on one channel. The data of each one starts with
+ *a 5 byte fragment header:
+ *
+ *    id, index low, index high, count low, count high, then the piece of the payload
+ *
+ *id is the same for every fragment of one payload and changes for the next one. index counts up from 0
+ *and count is the total number of fragments. Fragments are sent in order and a reciever
+ *that misses one throws the whole payload away and waits for the next fragment 0.
+ */
+
+class WBTVNodeBase;
+
+#define WBTV_FRAGMENT_HEADER 5
+
+//Called with the whole payload once the last fragment arrives.
+typedef void (*WBTV_reassembled_handler)(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned int datalen, void * userdata);
+
+class WBTVFragmenter
+{
+public:
+  WBTVFragmenter(WBTVNodeBase * node);
+  unsigned char send(const unsigned char * channel, unsigned char channellen, const unsigned char * data, unsigned int datalen, unsigned char chunk = 0);
+  unsigned char stringSend(const char * channel, const unsigned char * data, unsigned int datalen);
+  void service();
+  unsigned char isSending();
+
+private:
+  WBTVNodeBase *node;
+  const unsigned char *channel;
+  const unsigned char *data;
+  unsigned int datalen;
+  unsigned int index;
+  unsigned int count;
+  unsigned char channellen;
+  unsigned char chunk;
+  unsigned char id;
+  //The fragment in the node's queue right now
+  unsigned char handle;
+};
+
+class WBTVReassembler
+{
+public:
+  WBTVReassembler(unsigned char * buffer, unsigned int size, WBTV_reassembled_handler handler, void * userdata);
+  unsigned char subscribe(WBTVNodeBase * node, const unsigned char * channel, unsigned char channellen);
+  unsigned char stringSubscribe(WBTVNodeBase * node, const char * channel);
+  void feed(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned char datalen);
+  //Can be given straight to WBTVNode.subscribe() with the reassembler as the userdata
+  static void handler(unsigned char * channel, unsigned char channellen, unsigned char * data, unsigned char datalen, void * userdata);
+
+  //How many payloads were thrown away because of a missing fragment or not fitting in the buffer
+  unsigned int dropped;
+
+private:
+  unsigned char *buffer;
+  unsigned int size;
+  unsigned int filled;
+  unsigned int index;
+  unsigned int count;
+  WBTV_reassembled_handler done;
+  void *userdata;
+  unsigned char id;
+  unsigned char active;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include "../WBTVNode.h"
+
+#ifdef WBTV_PATTERNS
+//Go back to the root for a new header. Patterns that are just # match before anything has arrived.
+void WBTVNodeBase::trieStart()
+{
+  struct WBTV_trie_node root;
+
+  rxMatched = 0;
+  rxActiveCount = 0;
+  if (!trie)
+  {
+    return;
+  }
+  WBTV_read_trie(&root, &trie[0]);
+  rxActive[0] = 0;
+  rxActiveCount = 1;
+  rxMatched = root.rest;
+}
+
+/*
+ *Move every node the header could be at along by one character.
+ *A * node stays put until a /, and a * can also match an empty level, in which case a / goes straight past it.
+ *Each pattern is at one node at most, so there are never more than WBTV_MAX_PATTERNS of them.
+ */
+void WBTVNodeBase::trieStep(unsigned char chr)
+{
+  struct WBTV_trie_node node, child, after;
+  unsigned char next[WBTV_MAX_PATTERNS];
+  unsigned char count = 0;
+  unsigned char i, c, a;
+
+  for (i = 0; i < rxActiveCount; i++)
+  {
+    WBTV_read_trie(&node, &trie[rxActive[i]]);
+    if ((node.chr == '*') && (chr != '/'))
+    {
+      next[count++] = rxActive[i];
+      continue;
+    }
+    for (c = node.child; c; c = child.sibling)
+    {
+      WBTV_read_trie(&child, &trie[c]);
+      if ((child.chr == chr) || ((child.chr == '*') && (chr != '/')))
+      {
+        next[count++] = c;
+        rxMatched |= child.rest;
+      }
+      else if (child.chr == '*')
+      {
+        for (a = child.child; a; a = after.sibling)
+        {
+          WBTV_read_trie(&after, &trie[a]);
+          if (after.chr == '/')
+          {
+            next[count++] = a;
+            rxMatched |= after.rest;
+            break;
+          }
+        }
+      }
+    }
+  }
+  memcpy(rxActive, next, count);
+  rxActiveCount = count;
+}
+
+//Start again and run a whole header through, for when the one that came in was an alias.
+void WBTVNodeBase::trieRun(const unsigned char * header, unsigned char len)
+{
+  trieStart();
+  while (len-- && rxActiveCount)
+  {
+    trieStep(*header++);
+  }
+}
+
+//The header is done, add the patterns that end wherever it got to.
+void WBTVNodeBase::trieEnd()
+{
+  struct WBTV_trie_node node;
+  unsigned char i;
+
+  for (i = 0; i < rxActiveCount; i++)
+  {
+    WBTV_read_trie(&node, &trie[rxActive[i]]);
+    rxMatched |= node.ends;
+  }
+  rxActiveCount = 0;
+}
+
+//Hand the frame to every pattern that matched, in the order they were listed.
+void WBTVNodeBase::trieCall()
+{
+  WBTV_channel_handler handler;
+  unsigned char i;
+
+  for (i = 0; i < WBTV_MAX_PATTERNS; i++)
+  {
+    if (rxMatched & (1ul << i))
+    {
+      handler = WBTV_read_handler(&trieHandlers[i]);
+      handler((unsigned char*)message ,
+              headerTerminatorPosition,
+              (unsigned char *)message+headerTerminatorPosition+1,
+              recievePointer-(headerTerminatorPosition+3));
+    }
+  }
+}
+#endif
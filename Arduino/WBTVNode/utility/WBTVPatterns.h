@@ -0,0 +1,270 @@
+#ifndef __WBTV_PATTERNS_HEADER__
+#define __WBTV_PATTERNS_HEADER__
+#include <stdint.h>
+#include "WBTVByteClass.h"
+#include "WBTVDispatch.h"
+/*
+ *Wildcard and prefix subscriptions, for channels named in levels like SENS/ROOM1/TEMP.
+ *
+ *    void onRoom1(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen);
+ *    void onSensors(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen);
+ *
+ *    typedef WBTVPatterns<
+ *      WBTVPattern<&onRoom1, 'S','E','N','S','/','R','O','O','M','1','/','*'>,
+ *      WBTVPattern<&onSensors, 'S','E','N','S','/','#'> > MyPatterns;
+ *
+ *    node.setPatterns<MyPatterns>();
+ *
+ *A * matches any run of characters up to the next /, so it is one level, and it has to be the last thing in
+ *the pattern or come right before a /. A # has to be last, and matches anything at all from there on, so
+ *SENS/# gets everything under SENS/ and SENS# anything that starts with SENS. Everything else matches itself.
+ *
+ *The patterns are made into a trie by the compiler, one node per distinct prefix, and the table lives in flash.
+ *Each pattern can only be at one place in the trie at a time, so the recieve side keeps a short list of
+ *nodes the header so far could be at and moves it along one header byte at a time. When the ~ arrives it
+ *already knows which patterns matched, and if none did and nobody else wants the frame the data isn't buffered.
+ */
+
+//Which patterns matched, one bit each
+typedef unsigned long WBTV_pattern_mask;
+
+//A node of the trie. 0 is the root, which is never anyone's child, so 0 also means none.
+struct WBTV_trie_node
+{
+  //The character it matches, * for a whole level
+  unsigned char chr;
+  unsigned char child;
+  unsigned char sibling;
+  //Patterns that match if the header ends here
+  WBTV_pattern_mask ends;
+  //Patterns that match as soon as the header gets here, whatever comes after. These are the ones with a # next.
+  WBTV_pattern_mask rest;
+};
+
+#if defined(__AVR__)
+#define WBTV_read_trie(dst, src) memcpy_P((dst), (src), sizeof(struct WBTV_trie_node))
+#define WBTV_read_handler(addr) ((WBTV_channel_handler)pgm_read_word(addr))
+#else
+#define WBTV_read_trie(dst, src) (*(dst) = *(src))
+#define WBTV_read_handler(addr) (*(addr))
+#endif
+
+template <char... C>
+struct WBTVChars
+{
+  static constexpr char at(unsigned int i)
+  {
+    return 0;
+  }
+};
+
+template <char H, char... C>
+struct WBTVChars<H, C...>
+{
+  static constexpr char at(unsigned int i)
+  {
+    return i ? WBTVChars<C...>::at(i - 1) : H;
+  }
+};
+
+//A pattern plus the function that handles frames matching it.
+template <WBTV_channel_handler Handler, char... C>
+struct WBTVPattern
+{
+  static const unsigned char length = sizeof...(C);
+  static constexpr WBTV_channel_handler handler = Handler;
+
+  static constexpr char at(unsigned int i)
+  {
+    return WBTVChars<C...>::at(i);
+  }
+};
+
+/*
+ *Everything below here builds the trie at compile time.
+ *
+ *The node for the first n characters of pattern p belongs to the first pattern that starts that way.
+ *Numbering every character of every pattern in order, the nodes are the characters whose pattern owns them,
+ *and a node's id is 1 plus how many nodes come before it.
+ */
+
+template <class... P>
+struct WBTVPatternList
+{
+  static constexpr unsigned char length(unsigned int p)
+  {
+    return 0;
+  }
+  static constexpr char at(unsigned int p, unsigned int i)
+  {
+    return 0;
+  }
+};
+
+template <class H, class... P>
+struct WBTVPatternList<H, P...>
+{
+  static constexpr unsigned char length(unsigned int p)
+  {
+    return p ? WBTVPatternList<P...>::length(p - 1) : H::length;
+  }
+  static constexpr char at(unsigned int p, unsigned int i)
+  {
+    return p ? WBTVPatternList<P...>::at(p - 1, i) : H::at(i);
+  }
+};
+
+template <class L, unsigned int Count>
+struct WBTVTrieBuilder
+{
+  //Pattern q is at least n long and starts with the same n characters as p
+  static constexpr bool prefix(unsigned int q, unsigned int p, unsigned int n)
+  {
+    return (L::length(q) >= n) && same(q, p, n);
+  }
+  static constexpr bool same(unsigned int q, unsigned int p, unsigned int n)
+  {
+    return !n || ((L::at(q, n - 1) == L::at(p, n - 1)) && same(q, p, n - 1));
+  }
+
+  //p owns the node for its first n characters. Nodes for # aren't stored, the one before says what it matches.
+  static constexpr bool owns(unsigned int p, unsigned int n)
+  {
+    return (L::length(p) >= n) && (L::at(p, n - 1) != '#') && !earlier(0, p, n);
+  }
+  static constexpr bool earlier(unsigned int q, unsigned int p, unsigned int n)
+  {
+    return (q < p) && (prefix(q, p, n) || earlier(q + 1, p, n));
+  }
+
+  //Where pattern p's characters start in the numbering
+  static constexpr unsigned int offset(unsigned int p)
+  {
+    return p ? offset(p - 1) + L::length(p - 1) : 0;
+  }
+  static constexpr unsigned int total()
+  {
+    return offset(Count);
+  }
+  static constexpr unsigned int patternOf(unsigned int k, unsigned int p = 0)
+  {
+    return (k < offset(p + 1)) ? p : patternOf(k, p + 1);
+  }
+  static constexpr bool isNode(unsigned int k)
+  {
+    return owns(patternOf(k), k - offset(patternOf(k)) + 1);
+  }
+  //How many nodes are numbered lo up to hi, split in half each time so the compiler doesn't recurse too deep
+  static constexpr unsigned int nodes(unsigned int lo, unsigned int hi)
+  {
+    return (hi - lo == 0) ? 0 : (hi - lo == 1) ? (isNode(lo) ? 1 : 0) : nodes(lo, (lo + hi) / 2) + nodes((lo + hi) / 2, hi);
+  }
+  static constexpr unsigned int size()
+  {
+    return 1 + nodes(0, total());
+  }
+  //The number of the character that node i is
+  static constexpr unsigned int find(unsigned int i, unsigned int lo, unsigned int hi)
+  {
+    return (hi - lo <= 1) ? lo : (nodes(0, (lo + hi) / 2) >= i) ? find(i, lo, (lo + hi) / 2) : find(i, (lo + hi) / 2, hi);
+  }
+
+  //The id of the node for the first n characters of q, which q must own
+  static constexpr unsigned char link(unsigned int q, unsigned int n)
+  {
+    return (q >= Count) ? 0 : (unsigned char)(1 + nodes(0, offset(q) + n - 1));
+  }
+  //The first pattern from q on that starts with the first n characters of p and owns its node for m characters
+  static constexpr unsigned int owner(unsigned int q, unsigned int p, unsigned int n, unsigned int m)
+  {
+    return (q >= Count) ? Count : (prefix(q, p, n) && owns(q, m)) ? q : owner(q + 1, p, n, m);
+  }
+  //Children are in pattern order, so the first is owned by the first pattern that goes on past n.
+  static constexpr unsigned char child(unsigned int p, unsigned int n)
+  {
+    return link(owner(p, p, n, n + 1), n + 1);
+  }
+  static constexpr unsigned char sibling(unsigned int p, unsigned int n)
+  {
+    return n ? link(owner(p + 1, p, n - 1, n), n) : 0;
+  }
+
+  //Patterns that end here, counting a * at the end as matching an empty level
+  static constexpr WBTV_pattern_mask ends(unsigned int p, unsigned int n, unsigned int q = 0)
+  {
+    return (q >= Count) ? 0 :
+      ((prefix(q, p, n) && ((L::length(q) == n) || ((L::length(q) == n + 1) && (L::at(q, n) == '*')))) ? (1ul << q) : 0) |
+      ends(p, n, q + 1);
+  }
+  static constexpr WBTV_pattern_mask rest(unsigned int p, unsigned int n, unsigned int q = 0)
+  {
+    return (q >= Count) ? 0 :
+      ((prefix(q, p, n) && (L::length(q) == n + 1) && (L::at(q, n) == '#')) ? (1ul << q) : 0) |
+      rest(p, n, q + 1);
+  }
+
+  static constexpr struct WBTV_trie_node nodeFor(unsigned int p, unsigned int n)
+  {
+    return WBTV_trie_node{(unsigned char)(n ? L::at(p, n - 1) : 0), child(p, n), sibling(p, n), ends(p, n), rest(p, n)};
+  }
+  static constexpr struct WBTV_trie_node nodeAt(unsigned int k)
+  {
+    return nodeFor(patternOf(k), k - offset(patternOf(k)) + 1);
+  }
+  static constexpr struct WBTV_trie_node node(unsigned int i)
+  {
+    return i ? nodeAt(find(i, 0, total())) : nodeFor(0, 0);
+  }
+
+  //A * is last or has a / after it, and a # is last
+  static constexpr bool valid(unsigned int p, unsigned int i = 0)
+  {
+    return (i >= L::length(p)) ||
+      (((L::at(p, i) != '*') || (i + 1 == L::length(p)) || (L::at(p, i + 1) == '/')) &&
+       ((L::at(p, i) != '#') || (i + 1 == L::length(p))) &&
+       valid(p, i + 1));
+  }
+  static constexpr bool allValid(unsigned int p = 0)
+  {
+    return (p >= Count) || (L::length(p) && valid(p) && allValid(p + 1));
+  }
+};
+
+template <class Builder, class Indices>
+struct WBTVTrieTable;
+
+template <class Builder, unsigned int... I>
+struct WBTVTrieTable<Builder, WBTVIndices<I...> >
+{
+  static const struct WBTV_trie_node nodes[sizeof...(I)];
+};
+
+template <class Builder, unsigned int... I>
+const struct WBTV_trie_node WBTVTrieTable<Builder, WBTVIndices<I...> >::nodes[sizeof...(I)] WBTV_PROGMEM =
+{
+  Builder::node(I)...
+};
+
+template <class... P>
+struct WBTVPatterns
+{
+  typedef WBTVTrieBuilder<WBTVPatternList<P...>, sizeof...(P)> Builder;
+
+  static_assert(sizeof...(P) > 0, "WBTVPatterns needs at least one pattern");
+  static_assert(sizeof...(P) <= WBTV_MAX_PATTERNS, "More patterns than WBTV_MAX_PATTERNS");
+  static_assert(sizeof...(P) <= 8 * sizeof(WBTV_pattern_mask), "Too many patterns for one WBTVPatterns");
+  static_assert(Builder::allValid(), "A pattern is empty, has a * that isn't followed by / or the end, or has a # that isn't last");
+  static_assert(Builder::size() <= 256, "The patterns need more than 256 trie nodes");
+
+  typedef WBTVTrieTable<Builder, typename WBTVMakeIndices<Builder::size()>::type> Table;
+
+  static const WBTV_channel_handler handlers[sizeof...(P)];
+};
+
+template <class... P>
+const WBTV_channel_handler WBTVPatterns<P...>::handlers[sizeof...(P)] WBTV_PROGMEM =
+{
+  P::handler...
+};
+
+#endif
@@ -0,0 +1,327 @@
+#ifndef __WBTV_RECEIVER_HEADER__
+#define __WBTV_RECEIVER_HEADER__
+#include "protocol_definitions.h"
+#include "WBTVByteClass.h"
+/*
+ *The byte level half of recieving: escapes, the ! and \n, the ~ after the header and between segments,
+ *XOR framing, the buffer and the checksum. WBTVNodeBase is built on this, and so is anything else that has
+ *to take frames apart exactly the way a node does, like the host's parallel decoder, so there's one copy of the rules.
+ *
+ *Owner derives from WBTVReceiver<Owner> and calls receive() with each byte. Everything else a node does with a
+ *frame is up to Owner, which gets called at each step with these:
+ *
+ *    void rxStart();                        //An unescaped !, everything here has been reset
+ *    void rxHeaderByte(unsigned char chr);  //A byte of the header went into message[]
+ *    unsigned char rxChannel();             //The ~ after the header. The header can be swapped for another, sums and all. 0 drops the frame.
+ *    unsigned char rxHeader();              //Now the header is NUL terminated and the sums are its checksum. 0 drops the rest of the frame.
+ *    void rxEnd();                          //An unescaped \n, whatever state the frame is in
+ *    void rxDiscard();                      //The frame was too long, had too many segments or was cut short
+ *    void rxFrame(unsigned char good);      //A whole frame is in message[], good is whether the checksum matched
+ *
+ *They're called through the type rather than virtually, so on an AVR they can all be inlined.
+ */
+
+/*
+ *The data segments of a recieved frame, pointing straight into the node's buffer.
+ *Each segment is followed by a NUL, so text segments can be used as strings.
+ *Only good until the callback returns.
+ */
+struct WBTV_segments
+{
+  unsigned char *base;
+  unsigned char count;
+  //Where each segment starts in base. The one past the last is where the checksum starts, plus one.
+  unsigned char start[WBTV_MAX_SEGMENTS + 1];
+
+  unsigned char * segment(unsigned char i) const
+  {
+    return base + start[i];
+  }
+  unsigned char length(unsigned char i) const
+  {
+    return start[i + 1] - start[i] - 1;
+  }
+};
+
+template <class Owner>
+class WBTVReceiver
+{
+protected:
+  WBTVReceiver(unsigned char * buffer, unsigned char capacity) :
+    message(buffer), messageCapacity(capacity), recievePointer(0), headerTerminatorPosition(0),
+    rxSumSlow(0), rxSumFast(0), escape(0),
+    #ifdef WBTV_XOR_FRAMING
+    rxXor(0), rxKey(0),
+    #endif
+    garbage(0), lastSeparator(0)
+  {
+    rxSegments.base = buffer;
+    rxSegments.count = 0;
+  }
+
+  /*
+   *Process one incoming char.
+   *
+   *The checksum is computed as the bytes arrive rather than all at once at the end.
+   *Header bytes and the ~ are hashed immediately. Data bytes are hashed two behind,
+   *because until the \n shows up we can't know which two are the checksum. Those last
+   *two bytes are just the tail of message[], so the buffer itself is the delay line
+   *and checking a frame at the end is a couple of compares no matter how long it is.
+   */
+  inline void receive(unsigned char chr)
+  {
+    unsigned char cls;
+
+    //Handle the special chars
+    if (!escape)
+    {
+      cls = WBTV_byte_class(chr);
+      if (cls)
+      {
+        control(cls);
+        return;
+      }
+    }
+    //If we got this far, it means that we are either escaped or that the character was not a control char.
+    escape = 0;
+
+    //No point buffering or hashing the rest of a frame we are going to throw away
+    if (garbage)
+    {
+      return;
+    }
+
+    #ifdef WBTV_XOR_FRAMING
+    if (rxXor)
+    {
+      //A ~ on its own in front is just an empty channel
+      if (rxXor == 1)
+      {
+        garbage = 1;
+        return;
+      }
+      if (rxXor == 2)
+      {
+        rxKey = chr;
+        rxXor = 3;
+        return;
+      }
+      chr ^= rxKey;
+    }
+    #endif
+
+    //Set the garbage flag if we get a message that is too long
+    if (recievePointer >= messageCapacity)
+    {
+      owner()->rxDiscard();
+      garbage = 1;
+      return;
+    }
+
+    message[recievePointer] = chr;
+    recievePointer ++;
+
+    if (!headerTerminatorPosition)
+    {
+      updateRxHash(chr);
+      owner()->rxHeaderByte(chr);
+    }
+    //Data byte. The one two places back can't be part of the checksum any more.
+    else if (recievePointer - 3 > lastSeparator)
+    {
+      updateRxHash(message[recievePointer - 3]);
+    }
+  }
+
+  inline void updateRxHash(unsigned char chr)
+  {
+    rxSumSlow += chr;
+    rxSumFast += rxSumSlow;
+  }
+
+  //Buffer for the message, and how big it is
+  unsigned char *message;
+  unsigned char messageCapacity;
+  //Pointer to the place to put the new char
+  unsigned char recievePointer;
+  //Place to keep track of where the header stops and data begins
+  unsigned char headerTerminatorPosition;
+  //Running fletcher checksum of the frame being recieved
+  unsigned char rxSumSlow,rxSumFast;
+  //If the last char recieved was an unesaped escape, this is true
+  unsigned char escape;
+  #ifdef WBTV_XOR_FRAMING
+  //1 after a ~ straight after the !, 2 after a second one when the key is next, 3 once we have the key
+  unsigned char rxXor;
+  unsigned char rxKey;
+  #endif
+  //If this frame is garbage, true(like if it is too long, or nobody wants it)
+  unsigned char garbage;
+  //Where the last ~ went in message, and the segments so far
+  unsigned char lastSeparator;
+  struct WBTV_segments rxSegments;
+
+private:
+  inline Owner * owner()
+  {
+    return static_cast<Owner *>(this);
+  }
+
+  void control(unsigned char cls)
+  {
+    unsigned char wireSlow, wireFast, wanted;
+
+    if (cls == WBTV_CLASS_ESC)
+    {
+      //Handle an unescaped escape
+      escape = 1;
+      return;
+    }
+
+    if (cls == WBTV_CLASS_STH)
+    {
+      //an unescaped start of header byte resets everything.
+      recievePointer = 0;
+      headerTerminatorPosition = 0; //Stays zero until the ~ so we know we are still in the header.
+      garbage = 0;
+      lastSeparator = 0;
+      #ifdef WBTV_XOR_FRAMING
+      rxXor = 0;
+      #endif
+      rxSegments.count = 0;
+      rxSumSlow = rxSumFast = 0;
+      owner()->rxStart();
+      return;
+    }
+
+    //Handle the division between header and text
+    if (cls == WBTV_CLASS_STX)
+    {
+      if (garbage)
+      {
+        return;
+      }
+      #ifdef WBTV_XOR_FRAMING
+      //Two ~ straight after the ! mean an XOR framed frame, with the key next.
+      if (!recievePointer && (rxXor < 2))
+      {
+        rxXor++;
+        return;
+      }
+      #endif
+      //A zero length header is no good, and would be indistinguishable from still being in the header.
+      if (!recievePointer || recievePointer >= messageCapacity)
+      {
+        garbage = 1;
+        return;
+      }
+
+      //If we're past the header this is the start of another data segment.
+      if (headerTerminatorPosition)
+      {
+        separator();
+        return;
+      }
+
+      //The owner can swap the header for what it stands for, like an alias for its name,
+      //but the checksum carries on from the header that was actually sent.
+      wireSlow = rxSumSlow;
+      wireFast = rxSumFast;
+      if (!owner()->rxChannel())
+      {
+        garbage = 1;
+        return;
+      }
+      headerTerminatorPosition = recievePointer;
+      lastSeparator = recievePointer;
+      message[recievePointer] = 0; //Null terminator between header and data makes string callbacks work
+      recievePointer ++;
+      rxSegments.start[0] = recievePointer;
+      rxSegments.count = 1;
+
+      //Work out who wants this now, while rxSumSlow and rxSumFast are the checksum of just the header.
+      wanted = owner()->rxHeader();
+      rxSumSlow = wireSlow;
+      rxSumFast = wireFast;
+      //If nobody is going to want this, stop here and don't bother buffering the rest.
+      if (!wanted)
+      {
+        garbage = 1;
+        return;
+      }
+#ifdef WBTV_HASH_STX
+      updateRxHash(WBTV_STX);
+#endif
+      return;
+    }
+
+    //Handle end of packet
+    owner()->rxEnd();
+    end();
+  }
+
+  /*
+   *A ~ after the header starts a new data segment. The delay line in receive() only hashes
+   *bytes of the current segment, so the last two of the old one get hashed here, then the ~ itself,
+   *the same as the one after the header.
+   */
+  void separator()
+  {
+    unsigned char i;
+
+    if (rxSegments.count >= WBTV_MAX_SEGMENTS)
+    {
+      owner()->rxDiscard();
+      garbage = 1;
+      return;
+    }
+
+    i = recievePointer - 2;
+    if (i <= lastSeparator)
+    {
+      i = lastSeparator + 1;
+    }
+    for (; i < recievePointer; i++)
+    {
+      updateRxHash(message[i]);
+    }
+#ifdef WBTV_HASH_STX
+    updateRxHash(WBTV_STX);
+#endif
+
+    lastSeparator = recievePointer;
+    message[recievePointer] = 0; //Every segment is NUL terminated
+    recievePointer ++;
+    rxSegments.start[rxSegments.count] = recievePointer;
+    rxSegments.count++;
+  }
+
+  void end()
+  {
+    if (garbage)//If this packet was garbage, throw it away
+    {
+      return;
+    }
+    //Whatever happens, this frame is done. Anything else before the next ! is noise.
+    garbage = 1;
+
+    //If the headerTerminatorPosition is 0, then we either have a zero length header, or we never recieved a end-of header char.
+    if (!headerTerminatorPosition)
+    {
+      owner()->rxDiscard();
+      return;
+    }
+
+    //not possible to be a valid message becuse len(checksum) = 2
+    if (recievePointer < lastSeparator + 3)
+    {
+      owner()->rxDiscard();
+      return;
+    }
+
+    //Everything but the last two bytes has already been hashed, so just compare.
+    owner()->rxFrame((message[recievePointer - 1] == rxSumFast) && (message[recievePointer - 2] == rxSumSlow));
+  }
+};
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef __WBTV_RXRING_HEADER__
+#define __WBTV_RXRING_HEADER__
+#include <stdint.h>
+#ifdef __AVR__
+#include <util/atomic.h>
+#endif
+/*
+ *A receive buffer filled from an interrupt, with the micros() time every byte arrived.
+ *
+ *The UART RX interrupt pushes each byte the moment it comes in, and the node takes them out in service().
+ *That way the start of every frame has an exact arrival time no matter how slowly loop() runs,
+ *and a long loop() can't overflow the one or two byte hardware FIFO.
+ *
+ *The interrupt has to be yours. The Arduino core defines USART1_RX_vect itself as soon as Serial1 is used
+ *anywhere, and that includes handing it to the node, so with this ring Serial1 must not be touched at all.
+ *The node still needs a Stream to write to, which can be as small as this:
+ *
+ *    class Uart1Tx : public Stream
+ *    {
+ *    public:
+ *      size_t write(uint8_t c) { while (!(UCSR1A & _BV(UDRE1))); UDR1 = c; return 1; }
+ *      int available() { return 0; }
+ *      int read() { return -1; }
+ *      int peek() { return -1; }
+ *      void flush() {}
+ *    };
+ *
+ *    Uart1Tx tx;
+ *    WBTVNode node(&tx);
+ *    WBTVSizedRxRing<32> ring;
+ *    ISR(USART1_RX_vect) { ring.push(UDR1, micros()); }
+ *
+ *    //In setup(), since Serial1.begin() isn't there to do it
+ *    UBRR1 = F_CPU / 8 / 115200 - 1;
+ *    UCSR1A = _BV(U2X1);
+ *    UCSR1B = _BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1);
+ *    node.setRxRing(&ring);
+ *
+ *Only one side ever writes head and only the other writes tail, so no locking is needed,
+ *as long as there is one producer and one consumer.
+ */
+
+class WBTVRxRing
+{
+public:
+  //Producer side, safe to call from an interrupt. Returns 0 and counts an overrun if full.
+  inline unsigned char push(unsigned char chr, unsigned long stamp)
+  {
+    unsigned char h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    unsigned char next = (h + 1) & mask;
+    if (next == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+    {
+      overruns++;
+      return 0;
+    }
+    bytes[h] = chr;
+    stamps[h] = stamp;
+    //Publish the byte only after it is all written
+    __atomic_store_n(&head, next, __ATOMIC_RELEASE);
+    return 1;
+  }
+
+  //Consumer side
+  inline unsigned char available()
+  {
+    return (__atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail) & mask;
+  }
+
+  inline unsigned char pop(unsigned char * chr, unsigned long * stamp)
+  {
+    unsigned char t = tail;
+    if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+    {
+      return 0;
+    }
+    *chr = bytes[t];
+    *stamp = stamps[t];
+    __atomic_store_n(&tail, (unsigned char)((t + 1) & mask), __ATOMIC_RELEASE);
+    return 1;
+  }
+
+  //Bytes thrown away because the ring was full, read it with overrunCount() from outside the producer
+  inline uint32_t overrunCount()
+  {
+    uint32_t count;
+    #ifdef __AVR__
+    //Four bytes take four loads on an AVR, and the interrupt could land between any of them
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      count = overruns;
+    }
+    #else
+    count = __atomic_load_n(&overruns, __ATOMIC_RELAXED);
+    #endif
+    return count;
+  }
+
+  //Only the producer writes it. 32 bits so it doesn't wrap in any time that matters.
+  volatile uint32_t overruns;
+
+protected:
+  WBTVRxRing(unsigned char * bytes, unsigned long * stamps, unsigned char size)
+  {
+    this->bytes = bytes;
+    this->stamps = stamps;
+    mask = size - 1;
+    head = tail = 0;
+    overruns = 0;
+  }
+
+private:
+  unsigned char *bytes;
+  unsigned long *stamps;
+  unsigned char mask;
+  unsigned char head;
+  unsigned char tail;
+};
+
+//A ring holding Size-1 bytes. Size must be a power of two, up to 128. Each byte costs 5 of RAM.
+template <unsigned char Size>
+class WBTVSizedRxRing : public WBTVRxRing
+{
+public:
+  WBTVSizedRxRing() : WBTVRxRing(bytebuf, stampbuf, Size) {}
+
+private:
+  static_assert((Size >= 2) && (Size <= 128) && !(Size & (Size - 1)), "Ring size must be a power of two from 2 to 128");
+  unsigned char bytebuf[Size];
+  unsigned long stampbuf[Size];
+};
+
+#endif
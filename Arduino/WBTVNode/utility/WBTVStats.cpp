@@ -0,0 +1,62 @@
+#include "../WBTVNode.h"
+
+#ifdef WBTV_STATS
+static_assert(WBTV_MAX_SEGMENTS >= 3, "STAT messages need 3 segments");
+
+const struct WBTV_stats * WBTVNodeBase::stats()
+{
+  uint32_t overruns = 0;
+
+  //The ring keeps its own count, since only the interrupt may write it.
+  if (rxRing)
+  {
+    overruns = rxRing->overrunCount() - statRingBase;
+  }
+  statCounters.rxOverruns = (overruns > 0xffff) ? 0xffff : overruns;
+  return &statCounters;
+}
+
+void WBTVNodeBase::clearStats()
+{
+  memset(&statCounters, 0, sizeof(statCounters));
+  statRingBase = rxRing ? rxRing->overrunCount() : 0;
+}
+
+//Little endian, same as the TIME message.
+static unsigned char * WBTV_stat_pack(unsigned char * out, const uint16_t * values, unsigned char count)
+{
+  unsigned char i;
+  for (i = 0; i < count; i++)
+  {
+    *out++ = values[i] & 0xff;
+    *out++ = values[i] >> 8;
+  }
+  return out;
+}
+
+/*
+ *Queue the counters on STAT as three segments: the version byte followed by the counters in the order
+ *they are in struct WBTV_stats, then the latency histogram, then the backoff histogram.
+ *Every number is 16 bits, little endian.
+ */
+WBTV_tx_handle WBTVNodeBase::sendStats()
+{
+  unsigned char counters[1 + 2 * WBTV_STAT_COUNTERS];
+  unsigned char latency[2 * WBTV_STAT_BUCKETS];
+  unsigned char backoff[2 * WBTV_STAT_BUCKETS];
+  const unsigned char * segments[3] = {counters, latency, backoff};
+  const unsigned char lengths[3] = {sizeof(counters), sizeof(latency), sizeof(backoff)};
+  const struct WBTV_stats * s = stats();
+  const uint16_t values[WBTV_STAT_COUNTERS] =
+  {
+    s->rxFrames, s->rxBytes, s->rxChecksum, s->rxGarbage, s->rxOverruns,
+    s->txFrames, s->txBytes, s->collisions, s->timeouts, s->retries
+  };
+
+  counters[0] = WBTV_STAT_VERSION;
+  WBTV_stat_pack(counters + 1, values, WBTV_STAT_COUNTERS);
+  WBTV_stat_pack(latency, s->latency, WBTV_STAT_BUCKETS);
+  WBTV_stat_pack(backoff, s->backoff, WBTV_STAT_BUCKETS);
+  return sendMessage((const unsigned char *)"STAT", 4, segments, lengths, 3);
+}
+#endif
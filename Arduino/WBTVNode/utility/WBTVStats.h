@@ -0,0 +1,75 @@
+#ifndef __WBTV_STATS_HEADER__
+#define __WBTV_STATS_HEADER__
+#include <stdint.h>
+
+#ifdef WBTV_STATS
+/*
+ *What a node has been up to, see WBTVNode.stats() and WBTVNode.sendStats().
+ *Everything sticks at 65535 rather than wrapping, so a big number means "at least this many".
+ *
+ *The histograms are log2 buckets. Bucket 0 is anything under one unit, bucket k is from 2**(k-1) units
+ *up to 2**k, and the last bucket takes everything bigger. A latency unit is 1024us, about a millisecond,
+ *a backoff unit is 256us.
+ */
+struct WBTV_stats
+{
+  //Good frames, and every byte decoded
+  uint16_t rxFrames;
+  uint16_t rxBytes;
+  //Frames that failed the checksum
+  uint16_t rxChecksum;
+  //Frames thrown away because they were too long, had too many segments or were cut short
+  uint16_t rxGarbage;
+  //Bytes the receive ring had no room for, see setRxRing()
+  uint16_t rxOverruns;
+  //Frames that made it out, and every byte put on the wire including retries
+  uint16_t txFrames;
+  uint16_t txBytes;
+  //Bytes that came back different, and bytes that never came back
+  uint16_t collisions;
+  uint16_t timeouts;
+  //Times a frame had to start over from the beginning
+  uint16_t retries;
+  //From sendMessage() to the last byte going out
+  uint16_t latency[WBTV_STAT_BUCKETS];
+  //How long each attempt waited for the bus, from when it started waiting to its first byte
+  uint16_t backoff[WBTV_STAT_BUCKETS];
+};
+
+//How many counters come before the histograms
+#define WBTV_STAT_COUNTERS 10
+//Version byte at the start of a STAT message
+#define WBTV_STAT_VERSION 1
+//The counters and the two histograms, each segment of a STAT message
+#define WBTV_STAT_PAYLOAD (1 + 2 * WBTV_STAT_COUNTERS + 4 * WBTV_STAT_BUCKETS)
+
+//Add one, stopping at the top.
+static inline void WBTV_stat_inc(uint16_t * counter)
+{
+  if (*counter != 0xffff)
+  {
+    (*counter)++;
+  }
+}
+
+//Add n, stopping at the top.
+static inline void WBTV_stat_add(uint16_t * counter, unsigned int n)
+{
+  *counter = ((unsigned long)*counter + n > 0xffff) ? 0xffff : *counter + n;
+}
+
+//Which histogram bucket a time in microseconds goes in, with units of 2**shift microseconds.
+static inline unsigned char WBTV_stat_bucket(unsigned long us, unsigned char shift)
+{
+  unsigned char bucket = 0;
+  us >>= shift;
+  while (us && (bucket < WBTV_STAT_BUCKETS - 1))
+  {
+    us >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+#endif
+
+#endif
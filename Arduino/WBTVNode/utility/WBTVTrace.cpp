@@ -0,0 +1,89 @@
+#include "../WBTVNode.h"
+
+#ifdef WBTV_TRACE
+static_assert((WBTV_TRACE_SIZE >= 2) && (WBTV_TRACE_SIZE <= 128) && !(WBTV_TRACE_SIZE & (WBTV_TRACE_SIZE - 1)), "WBTV_TRACE_SIZE must be a power of two from 2 to 128");
+
+static struct WBTV_trace_entry WBTV_trace_ring[WBTV_TRACE_SIZE];
+//Next entry to write, and the oldest one not taken yet
+static uint8_t WBTV_trace_head = 0;
+static uint8_t WBTV_trace_tail = 0;
+uint8_t WBTV_trace_lost = 0;
+uint8_t WBTV_trace_paused = 0;
+
+//Trace points are only meant for the main loop, not interrupts.
+void WBTV_trace(uint8_t id)
+{
+  uint8_t next;
+
+  if (WBTV_trace_paused)
+  {
+    return;
+  }
+  WBTV_trace_ring[WBTV_trace_head].id = id;
+  WBTV_trace_ring[WBTV_trace_head].time = micros();
+  next = (WBTV_trace_head + 1) & (WBTV_TRACE_SIZE - 1);
+  //Full, so the oldest one goes
+  if (next == WBTV_trace_tail)
+  {
+    WBTV_trace_tail = (WBTV_trace_tail + 1) & (WBTV_TRACE_SIZE - 1);
+    if (WBTV_trace_lost != 255)
+    {
+      WBTV_trace_lost++;
+    }
+  }
+  WBTV_trace_head = next;
+}
+
+uint8_t WBTV_trace_count()
+{
+  return (WBTV_trace_head - WBTV_trace_tail) & (WBTV_TRACE_SIZE - 1);
+}
+
+uint8_t WBTV_trace_take(struct WBTV_trace_entry * out, uint8_t max)
+{
+  uint8_t n = 0;
+  while ((n < max) && (WBTV_trace_tail != WBTV_trace_head))
+  {
+    out[n++] = WBTV_trace_ring[WBTV_trace_tail];
+    WBTV_trace_tail = (WBTV_trace_tail + 1) & (WBTV_TRACE_SIZE - 1);
+  }
+  return n;
+}
+
+/*
+ *Empty the trace ring onto TRACE, as many messages as there is room for in the send queue.
+ *Returns how many entries went. Call it again once those are sent if there is more.
+ *Sending the dump isn't itself traced, but the frames going out on the bus are.
+ */
+unsigned char WBTVNodeBase::sendTrace()
+{
+  struct WBTV_trace_entry entries[WBTV_TRACE_PER_FRAME];
+  unsigned char frame[1 + WBTV_TRACE_PER_FRAME * WBTV_TRACE_ENTRY];
+  unsigned char *p;
+  unsigned char i, n, sent = 0;
+
+  WBTV_trace_paused++;
+  while (WBTV_trace_count() && (txCount < WBTV_TX_QUEUE))
+  {
+    n = WBTV_trace_take(entries, WBTV_TRACE_PER_FRAME);
+    p = frame;
+    *p++ = WBTV_trace_lost;
+    for (i = 0; i < n; i++)
+    {
+      *p++ = entries[i].id;
+      *p++ = entries[i].time & 0xff;
+      *p++ = (entries[i].time >> 8) & 0xff;
+      *p++ = (entries[i].time >> 16) & 0xff;
+      *p++ = (entries[i].time >> 24) & 0xff;
+    }
+    if (!sendMessage((const unsigned char *)"TRACE", 5, frame, p - frame))
+    {
+      break;
+    }
+    WBTV_trace_lost = 0;
+    sent += n;
+  }
+  WBTV_trace_paused--;
+  return sent;
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef __WBTV_TRACE_HEADER__
+#define __WBTV_TRACE_HEADER__
+#include <stdint.h>
+
+/*
+ *Trace points, for seeing where the time goes on the real hardware.
+ *
+ *With WBTV_TRACE defined every WBTV_TRACE_POINT(id) writes the id and micros() into a ring in RAM.
+ *Without it they compile to nothing at all. When the ring is full the oldest entries are overwritten
+ *and counted as lost, so what's there is always the most recent history.
+ *
+ *WBTVNode.sendTrace() empties the ring out onto the TRACE channel, and an empty message on TRACE
+ *asks every node to do so. host/trace/wbtv_trace turns that into a timeline and a breakdown of each stage.
+ *
+ *Ids under 128 belong to the library, use 128 and up for your own.
+ */
+
+//sendMessage() was called, and returned
+#define WBTV_EV_SEND 1
+#define WBTV_EV_QUEUED 2
+//A frame started waiting for the bus, its first byte went out, it lost, and it made it
+#define WBTV_EV_BACKOFF 3
+#define WBTV_EV_TX_START 4
+#define WBTV_EV_COLLIDE 5
+#define WBTV_EV_TX_DONE 6
+//A ! came in, the header was looked up at the ~, the \n came in
+#define WBTV_EV_RX_START 7
+#define WBTV_EV_RX_HEADER 8
+#define WBTV_EV_RX_END 9
+//The checksum was good and the frame went to a callback, which returned
+#define WBTV_EV_DISPATCH 10
+#define WBTV_EV_HANDLED 11
+//The checksum was bad
+#define WBTV_EV_RX_BAD 12
+//The first id free for applications
+#define WBTV_EV_USER 128
+
+//A TRACE message is one byte of how many entries were lost just before these, sticking at 255,
+//then each entry as its id and 4 byte little endian micros().
+#define WBTV_TRACE_ENTRY 5
+//Entries that fit in one TRACE message
+#define WBTV_TRACE_PER_FRAME ((WBTV_MAX_MESSAGE - 5 - 1 - 2 - 1) / WBTV_TRACE_ENTRY)
+
+#ifdef WBTV_TRACE
+struct WBTV_trace_entry
+{
+  uint8_t id;
+  uint32_t time;
+};
+
+void WBTV_trace(uint8_t id);
+//Take up to max of the oldest entries out of the ring, returns how many.
+uint8_t WBTV_trace_take(struct WBTV_trace_entry * out, uint8_t max);
+uint8_t WBTV_trace_count();
+//Entries overwritten before anyone took them, sticks at 255.
+extern uint8_t WBTV_trace_lost;
+//While this is nonzero trace points don't record anything.
+extern uint8_t WBTV_trace_paused;
+
+#define WBTV_TRACE_POINT(id) WBTV_trace(id)
+#else
+#define WBTV_TRACE_POINT(id) ((void)0)
+#endif
+
+#endif
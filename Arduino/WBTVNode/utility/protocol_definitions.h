@@ -4,9 +4,56 @@
 //Maximum time to wait on recieving a byte back that we sent.
 #define WBTV_MAX_WAIT 5000
 
+//Most bytes a node on a wired-OR bus can have sent but not yet heard back, see ECHO_WINDOW.
+//Costs this many bytes of RAM per node.
+#define WBTV_MAX_ECHO_WINDOW 8
+
 //How much space to resserve for the message buffer
 #define WBTV_MAX_MESSAGE 64
 
+//How many outgoing frames each node can hold. Each one costs WBTV_MAX_MESSAGE+6 bytes of RAM.
+#define WBTV_TX_QUEUE 2
+
+//How many channels per node can have their own priority or coalescing set.
+#define WBTV_CHANNEL_RULES 4
+
+//How many channels per node can be subscribed to with their own handler.
+#define WBTV_SUBSCRIPTIONS 4
+
+//How many ~ separated data segments one frame can carry. Costs a byte of RAM per node and per send queue slot for each.
+#define WBTV_MAX_SEGMENTS 4
+
+//Widen the backoff window after collisions and when the bus is busy, see WBTVNode::startBackoff().
+//Comment this to always use MIN_BACKOFF to MAX_BACKOFF.
+#define WBTV_ADAPTIVE_BACKOFF
+
+//The window never gets more than 2**WBTV_BACKOFF_MAX_EXP times as wide as MAX_BACKOFF-MIN_BACKOFF from collisions.
+#define WBTV_BACKOFF_MAX_EXP 5
+
+//Keep counters of frames, errors, collisions and send times, see WBTVNode.stats() and sendStats().
+//About 60 bytes of RAM per node. Comment this to leave them out.
+#define WBTV_STATS
+
+//Buckets in each of the latency and backoff histograms. A STAT message has to fit in WBTV_MAX_MESSAGE.
+#define WBTV_STAT_BUCKETS 8
+
+//Record trace points with micros() timestamps into a RAM ring that can be sent out on TRACE, see utility/WBTVTrace.h.
+//Uncomment to enable. Leave it off normally, it costs time on every frame and 5 bytes of RAM per entry.
+//#define WBTV_TRACE
+
+//Entries in the trace ring. Must be a power of two, up to 128.
+#define WBTV_TRACE_SIZE 64
+
+//How many bytes serviceAll() pulls out of the port at a time. This lives on the stack.
+#define WBTV_SERVICE_CHUNK 16
+
+//On a full duplex port, build each frame in a buffer and send it with one write() instead of a byte at a time.
+//The buffer lives on the stack and can take 2*WBTV_MAX_MESSAGE+WBTV_MAX_SEGMENTS+7 bytes, about 140 with the defaults,
+//which is a lot to find in the middle of a send on an AVR, so it's off unless you uncomment it. It only helps if the
+//port's write(buf,len) does something better than write one byte at a time, like a USB CDC port or a file descriptor.
+//The host build turns it on, see CMakeLists.txt.
+//#define WBTV_BULK_WRITE
+
 //Protocol symbol constants for STart of Header, STart of Text,
 //End of Transmission, and ESCape.
 #define WBTV_STH '!'
@@ -16,6 +63,26 @@
 
 #define WBTV_HASH_STX
 
+//Send long channel names as a short alias, and understand frames other nodes send that way. See utility/WBTVAlias.h.
+//Off unless you uncomment it, the table of aliases heard takes WBTV_ALIAS_TABLE*(WBTV_ALIAS_NAME+4) bytes of RAM
+//in every node, 80 with the defaults. The host build turns it on, see CMakeLists.txt.
+//#define WBTV_CHANNEL_ALIASES
+//How many aliases heard from other nodes a node can remember, and the longest name it will remember one for.
+//Each one takes WBTV_ALIAS_NAME+4 bytes of RAM.
+#define WBTV_ALIAS_TABLE 4
+#define WBTV_ALIAS_NAME 16
+
+//Wildcard and prefix subscriptions, see utility/WBTVPatterns.h. Costs a little time on every header byte once patterns are set.
+//Off unless you uncomment it, every node pays WBTV_MAX_PATTERNS+9 bytes of RAM for it whether it sets patterns or not,
+//17 on an AVR with the defaults. The host build turns it on, see CMakeLists.txt.
+//#define WBTV_PATTERNS
+//The most patterns one WBTVPatterns can have, up to 32. Each one takes a byte of RAM.
+#define WBTV_MAX_PATTERNS 8
+
+//Understand XOR framed frames, and send them on channels set up with WBTV_XOR_FRAMED. See utility/WBTVEncode.h.
+//Without it they get thrown away like any other frame with an empty channel.
+#define WBTV_XOR_FRAMING
+
 //Comment this to disable recording the packet arrival times.
 #define WBTV_RECORD_TIME
 
@@ -23,6 +90,10 @@
 //If left enabled, TIME broadcasts will be handled automatically for you,
 //And millisecond level time access functions will be provided.
 #define WBTV_ADV_MODE
+//The clock works out when TIME messages arrived from the recorded times, so it can't do without them.
+#if defined(WBTV_ADV_MODE) && !defined(WBTV_RECORD_TIME)
+#error "WBTV_ADV_MODE needs WBTV_RECORD_TIME"
+#endif
 
 //Increased noise resistance at the cost of one extra character before the actual message.
 //Full compatible with nodes not using this feature.
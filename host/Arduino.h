@@ -0,0 +1,53 @@
+#ifndef _WBTV_HOST_ARDUINO
+#define _WBTV_HOST_ARDUINO
+/*
+ *Minimal stand-in for the Arduino core, just enough for WBTVNode to build on a PC.
+ *
+ *Time comes from a virtual clock that only moves when the host program moves it,
+ *or by a small fixed amount every time micros() or millis() is read. The auto tick
+ *is what lets the busy-wait loops in waitTillICanSend() and writeWrapper() terminate,
+ *and it keeps runs completely reproducible.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+void pinMode(uint8_t pin, uint8_t mode);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+/*
+ *Host only API for driving the virtual hardware.
+ */
+
+//Full 64 bit virtual time in microseconds. micros() and millis() are truncated views of this.
+uint64_t WBTVHost_now();
+void WBTVHost_set_micros(uint64_t t);
+void WBTVHost_advance_micros(uint64_t us);
+
+//How many microseconds every read of micros() or millis() costs. Defaults to 1.
+//Setting it to zero freezes the clock, which will make any wired-OR send spin forever.
+void WBTVHost_set_autotick(unsigned int us);
+
+//Install a function that supplies the level of a pin for digitalRead().
+//With no reader installed every pin reads HIGH, which is the idle state of the bus.
+void WBTVHost_set_pin_reader(int (*reader)(uint8_t pin, void *arg), void *arg);
+
+#endif
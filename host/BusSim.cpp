@@ -0,0 +1,317 @@
+#include <algorithm>
+#include "Arduino.h"
+#include "BusSim.h"
+#include "WBTVNode.h"
+
+static int bus_pin_reader(uint8_t pin, void *arg)
+{
+  WBTVBusSim *bus = (WBTVBusSim *)arg;
+  return bus->level(bus->now());
+}
+
+WBTVBusPort::WBTVBusPort(WBTVBusSim *bus, uint8_t index, size_t rxCapacity) :
+  overruns(0), frameStarts(0), bytesWritten(0),
+  bus(bus), index(index), rxCapacity(rxCapacity), ring(0), txFree(0), escaped(false), node(0), pollInterval(0)
+{
+  //Spread the baud clocks around, the same way every run
+  clockPhase = ((uint64_t)(index + 1) * 2654435761u) % bus->bitTime();
+}
+
+int WBTVBusPort::available()
+{
+  return rx.size();
+}
+
+int WBTVBusPort::read()
+{
+  if (rx.empty())
+  {
+    return -1;
+  }
+  int c = rx.front();
+  rx.pop_front();
+  return c;
+}
+
+int WBTVBusPort::peek()
+{
+  if (rx.empty())
+  {
+    return -1;
+  }
+  return rx.front();
+}
+
+size_t WBTVBusPort::write(uint8_t chr)
+{
+  if (chr == WBTV_STH && !escaped)
+  {
+    frameStarts++;
+  }
+  escaped = (chr == WBTV_ESC) && !escaped;
+  bytesWritten++;
+  bus->transmit(this, chr);
+  return 1;
+}
+
+WBTVBusSim::WBTVBusSim(unsigned long baud) :
+  bytesOnLine(0), collidedBytes(0), framingErrors(0), rxDelay(0),
+  bit(1000000000ull / baud), time(0), seq(0),
+  decoderFree(0), edge(0), receiving(false), generation(0)
+{
+  //The simulation moves the clock, reading it shouldn't.
+  WBTVHost_set_autotick(0);
+  WBTVHost_set_micros(0);
+  WBTVHost_set_pin_reader(&bus_pin_reader, this);
+}
+
+WBTVBusSim::~WBTVBusSim()
+{
+  size_t i;
+  for (i = 0; i < ports.size(); i++)
+  {
+    delete ports[i];
+  }
+  WBTVHost_set_pin_reader(0, 0);
+  WBTVHost_set_autotick(1);
+}
+
+WBTVBusPort *WBTVBusSim::addPort(size_t rxCapacity)
+{
+  WBTVBusPort *port = new WBTVBusPort(this, ports.size(), rxCapacity);
+  ports.push_back(port);
+  return port;
+}
+
+void WBTVBusSim::attach(WBTVBusPort *port, WBTVNodeBase *node, uint64_t pollInterval, uint64_t phase)
+{
+  port->node = node;
+  port->pollInterval = pollInterval;
+  if (pollInterval)
+  {
+    schedule(time + phase, [this, port]() { poll(port); });
+  }
+}
+
+void WBTVBusSim::schedule(uint64_t t, std::function<void()> fn)
+{
+  Event ev;
+  ev.time = t;
+  ev.seq = seq++;
+  ev.fn = fn;
+  events.push(ev);
+}
+
+void WBTVBusSim::run(uint64_t until)
+{
+  while (!events.empty() && events.top().time <= until)
+  {
+    Event ev = events.top();
+    events.pop();
+    time = ev.time;
+    WBTVHost_set_micros(time / 1000);
+    ev.fn();
+  }
+  time = until;
+  WBTVHost_set_micros(time / 1000);
+}
+
+void WBTVBusSim::poll(WBTVBusPort *port)
+{
+  port->node->service();
+  schedule(time + port->pollInterval, [this, port]() { poll(port); });
+}
+
+//What one UART is putting on the line at time t. Idle is high.
+int WBTVBusSim::bitOf(const Transmission &tx, uint64_t t) const
+{
+  uint64_t k;
+  if (t < tx.start)
+  {
+    return 1;
+  }
+  k = (t - tx.start) / bit;
+  if (k == 0)
+  {
+    return 0;
+  }
+  if (k <= 8)
+  {
+    return (tx.chr >> (k - 1)) & 1;
+  }
+  return 1;
+}
+
+int WBTVBusSim::level(uint64_t t) const
+{
+  size_t i;
+  for (i = 0; i < line.size(); i++)
+  {
+    if (!bitOf(line[i], t))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void WBTVBusSim::transmit(WBTVBusPort *port, uint8_t chr)
+{
+  Transmission tx;
+  uint64_t tick;
+
+  //Wait for the next tick of the baud clock
+  tick = time + (port->clockPhase + bit - time % bit) % bit;
+  tx.port = port;
+  tx.start = std::max(tick, port->txFree);
+  tx.chr = chr;
+  port->txFree = tx.start + 10 * bit;
+  line.push_back(tx);
+  scheduleDecode();
+}
+
+/*
+ *Find the next falling edge the receiver can see and schedule the byte it starts.
+ *A new transmission can only pull the line down, so until the start bit has actually begun
+ *the edge may move earlier, and this gets run again.
+ */
+void WBTVBusSim::scheduleDecode()
+{
+  std::vector<uint64_t> candidates;
+  size_t i;
+  uint64_t k, t;
+
+  if (receiving && edge <= time)
+  {
+    return;
+  }
+
+  for (i = 0; i < line.size(); i++)
+  {
+    for (k = 0; k <= 9; k++)
+    {
+      t = line[i].start + k * bit;
+      if (t >= decoderFree && t > 0)
+      {
+        candidates.push_back(t);
+      }
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  receiving = false;
+  generation++;
+  for (i = 0; i < candidates.size(); i++)
+  {
+    t = candidates[i];
+    if (!level(t) && level(t - 1))
+    {
+      receiving = true;
+      edge = t;
+      unsigned long gen = generation;
+      schedule(t + bit * 19 / 2, [this, gen]() { decodeAt(gen); });
+      return;
+    }
+  }
+}
+
+void WBTVBusSim::decodeAt(unsigned long gen)
+{
+  uint8_t chr = 0;
+  unsigned int k, drivers = 0;
+  size_t i, j;
+
+  if (gen != generation)
+  {
+    return;
+  }
+
+  for (k = 1; k <= 8; k++)
+  {
+    chr |= level(edge + k * bit + bit / 2) << (k - 1);
+  }
+  if (!level(edge + bit * 19 / 2))
+  {
+    framingErrors++;
+  }
+
+  //Count the UARTs that were talking during this byte
+  for (i = 0; i < line.size(); i++)
+  {
+    if ((line[i].start < edge + 10 * bit) && (line[i].start + 10 * bit > edge))
+    {
+      for (j = 0; j < i; j++)
+      {
+        if ((line[j].port == line[i].port) && (line[j].start < edge + 10 * bit) && (line[j].start + 10 * bit > edge))
+        {
+          break;
+        }
+      }
+      if (j == i)
+      {
+        drivers++;
+      }
+    }
+  }
+  bytesOnLine++;
+  if (drivers > 1)
+  {
+    collidedBytes++;
+  }
+
+  //The stop bit is where real UARTs hand the byte over, plus however long the transceiver takes.
+  if (rxDelay)
+  {
+    schedule(time + rxDelay, [this, chr]() { deliver(chr); });
+  }
+  else
+  {
+    deliver(chr);
+  }
+
+  receiving = false;
+  decoderFree = edge + bit * 19 / 2;
+
+  //Forget anything that is over and done with
+  for (i = 0; i < line.size();)
+  {
+    if ((line[i].start + 10 * bit <= decoderFree) && (line[i].start + 10 * bit <= time))
+    {
+      line.erase(line.begin() + i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+  scheduleDecode();
+}
+
+void WBTVBusSim::deliver(uint8_t chr)
+{
+  size_t i;
+
+  for (i = 0; i < ports.size(); i++)
+  {
+    if (ports[i]->ring)
+    {
+      //Overruns are counted by the ring
+      ports[i]->ring->push(chr, time / 1000);
+    }
+    else if (ports[i]->rx.size() >= ports[i]->rxCapacity)
+    {
+      ports[i]->overruns++;
+    }
+    else
+    {
+      ports[i]->rx.push_back(chr);
+    }
+  }
+  for (i = 0; i < ports.size(); i++)
+  {
+    if (ports[i]->node && !ports[i]->pollInterval)
+    {
+      ports[i]->node->serviceAll();
+    }
+  }
+}
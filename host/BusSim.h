@@ -0,0 +1,143 @@
+#ifndef _WBTV_HOST_BUSSIM
+#define _WBTV_HOST_BUSSIM
+#include <deque>
+#include <functional>
+#include <queue>
+#include <vector>
+#include "Stream.h"
+
+class WBTVNodeBase;
+class WBTVBusSim;
+class WBTVRxRing;
+
+/*
+ *One node's UART on a simulated wired-OR bus.
+ *
+ *Bytes written go out on the shared line, one UART frame at a time, and every byte the
+ *line carries comes back out of read(), including our own, just like the real wiring.
+ *The port's pin() is what the node should be given as its sense pin.
+ */
+class WBTVBusPort : public Stream
+{
+public:
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t chr);
+
+  uint8_t pin() const { return index; }
+  //Act like a UART RX interrupt and push each byte into ring, stamped with the exact time it arrived,
+  //instead of buffering it here. Give the node the same ring with setRxRing().
+  void setRing(WBTVRxRing *ring) { this->ring = ring; }
+
+  //Bytes lost because the receive buffer was full
+  unsigned long overruns;
+  //Unescaped ! written, which is one per frame attempt
+  unsigned long frameStarts;
+  unsigned long bytesWritten;
+
+private:
+  friend class WBTVBusSim;
+  WBTVBusPort(WBTVBusSim *bus, uint8_t index, size_t rxCapacity);
+
+  WBTVBusSim *bus;
+  uint8_t index;
+  std::deque<uint8_t> rx;
+  size_t rxCapacity;
+  WBTVRxRing *ring;
+  //When the UART will be done with what it has already been given
+  uint64_t txFree;
+  //Where this UART's baud clock ticks. A written byte starts on the next tick, not straight away.
+  uint64_t clockPhase;
+  //The last byte written was an unescaped escape
+  bool escaped;
+  WBTVNodeBase *node;
+  uint64_t pollInterval;
+};
+
+/*
+ *Deterministic discrete-event model of a wired-OR bus with any number of unmodified nodes on it.
+ *
+ *Every byte is a 10 bit UART frame, start bit, 8 data bits LSB first, stop bit. Like a real UART a byte
+ *starts on the next tick of the port's own baud clock, so two nodes that both see the line idle can
+ *start up to a bit apart and collide. The line is the AND
+ *of every UART driving it, so overlapping frames corrupt each other the way they do on a real
+ *open collector bus. One receiver decodes the line, sampling mid-bit after each falling edge,
+ *and hands the bytes to every port. digitalRead() of a port's pin gives the line level right now.
+ *
+ *Nodes run as if each sat in its own loop() calling service() every pollInterval.
+ *All times are nanoseconds of simulated time. The virtual micros() follows the simulation.
+ */
+class WBTVBusSim
+{
+public:
+  WBTVBusSim(unsigned long baud);
+  ~WBTVBusSim();
+
+  //A new port. rxCapacity is the size of the UART receive buffer, 64 on most Arduinos.
+  WBTVBusPort *addPort(size_t rxCapacity = 64);
+  //Call node.service() on the port's node every pollInterval, starting at phase.
+  //A pollInterval of 0 means the node decodes every byte as it arrives and never sends, which is what a monitor does.
+  void attach(WBTVBusPort *port, WBTVNodeBase *node, uint64_t pollInterval, uint64_t phase = 0);
+
+  //Run fn at time t.
+  void schedule(uint64_t t, std::function<void()> fn);
+  //Run until the given time.
+  void run(uint64_t until);
+
+  uint64_t now() const { return time; }
+  uint64_t bitTime() const { return bit; }
+  uint64_t byteTime() const { return bit * 10; }
+  int level(uint64_t t) const;
+
+  //Bytes decoded from the line, how many of those had more than one UART driving the line, and bad stop bits
+  unsigned long bytesOnLine;
+  unsigned long collidedBytes;
+  unsigned long framingErrors;
+  //Nanoseconds from the stop bit of a byte on the line to it reaching the ports, like going through a CAN transceiver
+  //or an isolator. The line level seen by digitalRead() isn't delayed.
+  uint64_t rxDelay;
+
+private:
+  friend class WBTVBusPort;
+
+  struct Transmission
+  {
+    WBTVBusPort *port;
+    uint64_t start;
+    uint8_t chr;
+  };
+
+  struct Event
+  {
+    uint64_t time;
+    unsigned long seq;
+    std::function<void()> fn;
+    bool operator<(const Event &other) const
+    {
+      return (time != other.time) ? (time > other.time) : (seq > other.seq);
+    }
+  };
+
+  void transmit(WBTVBusPort *port, uint8_t chr);
+  void scheduleDecode();
+  void decodeAt(unsigned long generation);
+  void deliver(uint8_t chr);
+  int bitOf(const Transmission &tx, uint64_t t) const;
+  void poll(WBTVBusPort *port);
+
+  uint64_t bit;
+  uint64_t time;
+  unsigned long seq;
+  std::priority_queue<Event> events;
+  std::vector<WBTVBusPort *> ports;
+  std::deque<Transmission> line;
+
+  //The receiver is free from decoderFree on. If it has found a start bit it is at edge.
+  uint64_t decoderFree;
+  uint64_t edge;
+  bool receiving;
+  unsigned long generation;
+};
+
+#endif
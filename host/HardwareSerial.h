@@ -0,0 +1,5 @@
+#ifndef _WBTV_HOST_HARDWARESERIAL
+#define _WBTV_HOST_HARDWARESERIAL
+//There are no UARTs on the host, everything goes through a Stream.
+#include "Stream.h"
+#endif
@@ -0,0 +1,44 @@
+#ifndef _WBTV_HOST_MEMORYSTREAM
+#define _WBTV_HOST_MEMORYSTREAM
+#include <vector>
+#include "Stream.h"
+
+/*
+ *An in-memory Stream. Bytes fed in with feed() come out of read(),
+ *and everything written is captured in tx() for inspection.
+ *
+ *With loopback enabled every written byte is also queued for reading, which is
+ *exactly what a wired-OR bus with nobody else on it looks like to the node:
+ *it hears its own transmission.
+ */
+class WBTVMemoryStream : public Stream
+{
+public:
+  WBTVMemoryStream(bool loopback = false);
+
+  int available();
+  int read();
+  int peek();
+  size_t write(uint8_t chr);
+  size_t write(const uint8_t *buffer, size_t size);
+
+  //Queue bytes to be read by the node.
+  void feed(const uint8_t *data, size_t len);
+  void feed(const std::vector<uint8_t> &data) { feed(data.data(), data.size()); }
+
+  //Everything the node has written since the last clearTx().
+  const std::vector<uint8_t> &tx() const { return txbuf; }
+  void clearTx() { txbuf.clear(); }
+
+  //Drop anything not yet read.
+  void clearRx() { rxbuf.clear(); rxpos = 0; }
+
+  bool loopback;
+
+private:
+  std::vector<uint8_t> rxbuf;
+  size_t rxpos;
+  std::vector<uint8_t> txbuf;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _WBTV_HOST_STREAM
+#define _WBTV_HOST_STREAM
+#include "Arduino.h"
+
+/*
+ *Host version of the Arduino Print/Stream pair.
+ *Only the parts WBTVNode actually uses are here, with the same signatures and
+ *semantics as the real core so that code written against one works on the other.
+ */
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t chr) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+};
+
+class Stream : public Print
+{
+public:
+  Stream() : _timeout(1000) {}
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+  //Read up to length bytes, waiting at most the timeout between bytes, like the real core does.
+  size_t readBytes(char *buffer, size_t length);
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+
+protected:
+  unsigned long _timeout;
+  int timedRead();
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include <string.h>
+#include "Arduino.h"
+#include "Stream.h"
+#include "MemoryStream.h"
+
+/*
+ *Virtual clock, pins and RNG backing the host version of the Arduino core.
+ */
+
+static uint64_t host_time = 0;
+static unsigned int host_autotick = 1;
+static int (*host_pin_reader)(uint8_t, void *) = 0;
+static void *host_pin_reader_arg = 0;
+static uint32_t host_random_state = 2463534242u;
+
+uint64_t WBTVHost_now()
+{
+  return host_time;
+}
+
+void WBTVHost_set_micros(uint64_t t)
+{
+  host_time = t;
+}
+
+void WBTVHost_advance_micros(uint64_t us)
+{
+  host_time += us;
+}
+
+void WBTVHost_set_autotick(unsigned int us)
+{
+  host_autotick = us;
+}
+
+void WBTVHost_set_pin_reader(int (*reader)(uint8_t pin, void *arg), void *arg)
+{
+  host_pin_reader = reader;
+  host_pin_reader_arg = arg;
+}
+
+unsigned long micros()
+{
+  host_time += host_autotick;
+  return (uint32_t)host_time;
+}
+
+unsigned long millis()
+{
+  host_time += host_autotick;
+  return (uint32_t)(host_time / 1000);
+}
+
+void delay(unsigned long ms)
+{
+  host_time += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  host_time += us;
+}
+
+int digitalRead(uint8_t pin)
+{
+  if (host_pin_reader)
+  {
+    return host_pin_reader(pin, host_pin_reader_arg);
+  }
+  return HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+//Same xorshift the library uses internally, good enough for the stand in random().
+long random(long max)
+{
+  if (max <= 0)
+  {
+    return 0;
+  }
+  host_random_state ^= host_random_state << 13;
+  host_random_state ^= host_random_state >> 17;
+  host_random_state ^= host_random_state << 5;
+  return host_random_state % max;
+}
+
+long random(long min, long max)
+{
+  if (min >= max)
+  {
+    return min;
+  }
+  return random(max - min) + min;
+}
+
+void randomSeed(unsigned long seed)
+{
+  if (seed)
+  {
+    host_random_state = seed;
+  }
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--)
+  {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+int Stream::timedRead()
+{
+  int c;
+  unsigned long start = millis();
+  do
+  {
+    c = read();
+    if (c >= 0)
+    {
+      return c;
+    }
+  } while (millis() - start < _timeout);
+  return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length)
+  {
+    int c = timedRead();
+    if (c < 0)
+    {
+      break;
+    }
+    *buffer++ = (char)c;
+    count++;
+  }
+  return count;
+}
+
+WBTVMemoryStream::WBTVMemoryStream(bool loopback) : loopback(loopback), rxpos(0)
+{
+}
+
+int WBTVMemoryStream::available()
+{
+  return rxbuf.size() - rxpos;
+}
+
+int WBTVMemoryStream::read()
+{
+  if (rxpos >= rxbuf.size())
+  {
+    return -1;
+  }
+  int c = rxbuf[rxpos++];
+  //Reclaim the space once everything queued has been consumed.
+  if (rxpos == rxbuf.size())
+  {
+    rxbuf.clear();
+    rxpos = 0;
+  }
+  return c;
+}
+
+int WBTVMemoryStream::peek()
+{
+  if (rxpos >= rxbuf.size())
+  {
+    return -1;
+  }
+  return rxbuf[rxpos];
+}
+
+size_t WBTVMemoryStream::write(uint8_t chr)
+{
+  txbuf.push_back(chr);
+  if (loopback)
+  {
+    rxbuf.push_back(chr);
+  }
+  return 1;
+}
+
+size_t WBTVMemoryStream::write(const uint8_t *buffer, size_t size)
+{
+  txbuf.insert(txbuf.end(), buffer, buffer + size);
+  if (loopback)
+  {
+    rxbuf.insert(rxbuf.end(), buffer, buffer + size);
+  }
+  return size;
+}
+
+void WBTVMemoryStream::feed(const uint8_t *data, size_t len)
+{
+  rxbuf.insert(rxbuf.end(), data, data + len);
+}
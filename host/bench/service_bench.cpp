@@ -0,0 +1,140 @@
+/*
+ *Compares the per-byte service() path with serviceAll() and decodeBuffer().
+ *
+ *A batch of encoded frames is queued in an in-memory port and drained by each
+ *path in turn. Frames/second is reported along with the speedup over service(),
+ *which has to go through available() and read() once per byte.
+ *
+ *Usage: service_bench [megabytes per case, default 4]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "WBTVNode.h"
+#include "MemoryStream.h"
+
+struct Mix
+{
+  const char *name;
+  const char *channel;
+  unsigned char datalen;
+};
+
+static const Mix mixes[] =
+{
+  {"short chan, 1B", "LED", 1},
+  {"short chan, 16B", "CONV", 16},
+  {"short chan, 48B", "DATA", 48},
+  {"long chan, 40B", "SENS/ROOM1/LOG", 40},
+};
+
+static unsigned long framesSeen;
+
+static void countingCallback(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen)
+{
+  framesSeen++;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+enum Path
+{
+  PER_BYTE,
+  DRAIN_ALL,
+  BUFFER
+};
+
+static double run(Path path, const std::vector<uint8_t> &stream, unsigned long passes, unsigned long expected)
+{
+  WBTVMemoryStream port;
+  WBTVNode node(&port);
+  node.setBinaryCallback(&countingCallback);
+  framesSeen = 0;
+  double busy = 0;
+  unsigned long p;
+
+  for (p = 0; p < passes; p++)
+  {
+    //Filling the port is not part of what we are measuring.
+    if (path != BUFFER)
+    {
+      port.feed(stream);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (path == PER_BYTE)
+    {
+      while (port.available())
+      {
+        node.service();
+      }
+    }
+    else if (path == DRAIN_ALL)
+    {
+      node.serviceAll();
+    }
+    else
+    {
+      node.decodeBuffer(stream.data(), stream.size());
+    }
+    busy += seconds_since(start);
+  }
+
+  if (framesSeen != expected)
+  {
+    printf("  MISMATCH: decoded %lu of %lu frames\n", framesSeen, expected);
+    exit(1);
+  }
+  return busy;
+}
+
+int main(int argc, char **argv)
+{
+  double megabytes = 4;
+  const unsigned int batch = 256;
+  unsigned int m, i;
+  static const char *names[] = {"service", "serviceAll", "decodeBuffer"};
+
+  if (argc > 1)
+  {
+    megabytes = atof(argv[1]);
+  }
+
+  printf("%-18s %-13s %12s %9s\n", "mix", "path", "frames/s", "speedup");
+
+  for (m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++)
+  {
+    const Mix &mix = mixes[m];
+    unsigned char payload[WBTV_MAX_MESSAGE];
+    WBTVMemoryStream txport;
+    WBTVNode sender(&txport);
+
+    for (i = 0; i < batch; i++)
+    {
+      unsigned int j;
+      for (j = 0; j < mix.datalen; j++)
+      {
+        payload[j] = (i * 31 + j * 7) & 0xff;
+      }
+      sender.sendMessage((const unsigned char *)mix.channel, strlen(mix.channel), payload, mix.datalen);
+    }
+    std::vector<uint8_t> stream = txport.tx();
+    unsigned long passes = (unsigned long)((megabytes * 1048576.0) / stream.size()) + 1;
+    double baseline = 0;
+
+    for (i = 0; i < 3; i++)
+    {
+      double secs = run((Path)i, stream, passes, batch * passes);
+      double fps = ((double)batch * passes) / secs;
+      if (i == 0)
+      {
+        baseline = fps;
+      }
+      printf("%-18s %-13s %12.0f %8.2fx\n", mix.name, names[i], fps, fps / baseline);
+    }
+  }
+  return 0;
+}
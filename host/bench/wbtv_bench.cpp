@@ -0,0 +1,157 @@
+/*
+ *Throughput benchmark for the WBTVNode hot paths, run on the host build.
+ *
+ *For a set of channel/payload mixes it encodes a batch of frames with sendMessage(),
+ *then feeds the resulting byte stream through decodeChar(), and reports bytes/second
+ *and ns/byte for both directions. Decoded frames are counted against the number sent,
+ *so a broken decoder shows up as a mismatch rather than as a suspiciously fast number.
+ *
+ *Usage: wbtv_bench [megabytes per case, default 4]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "WBTVNode.h"
+#include "MemoryStream.h"
+
+struct Mix
+{
+  const char *name;
+  const char *channel;
+  unsigned char datalen;
+  //0 is printable text, 1 is uniformly random binary, 2 is nothing but control characters
+  int fill;
+};
+
+static const Mix mixes[] =
+{
+  {"short chan, 1B", "LED", 1, 1},
+  {"short chan, 16B text", "CONV", 16, 0},
+  {"short chan, 48B binary", "DATA", 48, 1},
+  {"long chan, 8B binary", "SENS/ROOM1/TEMP", 8, 1},
+  {"long chan, 40B text", "SENS/ROOM1/LOG", 40, 0},
+  {"escape heavy, 24B", "ESC", 24, 2},
+};
+
+static unsigned long framesSeen;
+
+static void countingCallback(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen)
+{
+  framesSeen++;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void fill_payload(const Mix &m, unsigned char *out, unsigned int seed)
+{
+  static const unsigned char control[] = {WBTV_STH, WBTV_STX, WBTV_EOT, WBTV_ESC};
+  unsigned int i;
+  for (i = 0; i < m.datalen; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    if (m.fill == 0)
+    {
+      out[i] = 'a' + ((seed >> 16) % 26);
+    }
+    else if (m.fill == 1)
+    {
+      out[i] = seed >> 16;
+    }
+    else
+    {
+      out[i] = control[(seed >> 16) & 3];
+    }
+  }
+}
+
+static void report(const char *name, const char *path, double bytes, double frames, double secs)
+{
+  printf("%-24s %-7s %12.0f %9.2f %12.0f\n", name, path, bytes / secs, (secs * 1e9) / bytes, frames / secs);
+}
+
+int main(int argc, char **argv)
+{
+  double megabytes = 4;
+  unsigned int m, i;
+  const unsigned int batch = 64;
+
+  if (argc > 1)
+  {
+    megabytes = atof(argv[1]);
+  }
+
+  printf("%-24s %-7s %12s %9s %12s\n", "mix", "path", "bytes/s", "ns/byte", "frames/s");
+
+  for (m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++)
+  {
+    const Mix &mix = mixes[m];
+    unsigned char payloads[batch][WBTV_MAX_MESSAGE];
+    unsigned char clen = strlen(mix.channel);
+
+    for (i = 0; i < batch; i++)
+    {
+      fill_payload(mix, payloads[i], i + 1);
+    }
+
+    //Encode. Full duplex, so this measures framing, escaping and hashing, not CSMA.
+    WBTVMemoryStream txport;
+    WBTVNode sender(&txport);
+    sender.sendMessage((const unsigned char *)mix.channel, clen, payloads[0], mix.datalen);
+    double frameBytes = txport.tx().size();
+    unsigned long reps = (unsigned long)((megabytes * 1048576.0) / frameBytes) + 1;
+    txport.clearTx();
+
+    double txBytes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long r = 0; r < reps; r++)
+    {
+      sender.sendMessage((const unsigned char *)mix.channel, clen, payloads[r % batch], mix.datalen);
+      if (txport.tx().size() > 65536)
+      {
+        txBytes += txport.tx().size();
+        txport.clearTx();
+      }
+    }
+    double secs = seconds_since(start);
+    txBytes += txport.tx().size();
+    report(mix.name, "send", txBytes, reps, secs);
+
+    //Build one batch of encoded frames and decode it over and over.
+    txport.clearTx();
+    for (i = 0; i < batch; i++)
+    {
+      sender.sendMessage((const unsigned char *)mix.channel, clen, payloads[i], mix.datalen);
+    }
+    std::vector<uint8_t> stream = txport.tx();
+    unsigned long passes = (unsigned long)((megabytes * 1048576.0) / stream.size()) + 1;
+
+    WBTVMemoryStream rxport;
+    WBTVNode receiver(&rxport);
+    receiver.setBinaryCallback(&countingCallback);
+    framesSeen = 0;
+
+    const uint8_t *bytes = stream.data();
+    size_t len = stream.size();
+    start = std::chrono::steady_clock::now();
+    for (unsigned long p = 0; p < passes; p++)
+    {
+      for (size_t b = 0; b < len; b++)
+      {
+        receiver.decodeChar(bytes[b]);
+      }
+    }
+    secs = seconds_since(start);
+    report(mix.name, "decode", (double)len * passes, (double)batch * passes, secs);
+
+    if (framesSeen != batch * passes)
+    {
+      printf("  MISMATCH: decoded %lu of %lu frames\n", framesSeen, (unsigned long)batch * passes);
+      return 1;
+    }
+  }
+  return 0;
+}
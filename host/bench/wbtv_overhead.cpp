@@ -0,0 +1,161 @@
+/*
+ *How many bytes frames take on the wire, escaped and with XOR framing allowed, for the kinds of payload
+ *people actually send. Nothing is timed, it just encodes a lot of frames with WBTV_encode() and counts.
+ *
+ *Usage: wbtv_overhead [frames per case, default 100000] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "WBTVNode.h"
+
+struct Payload
+{
+  const char *name;
+  const char *channel;
+  //Fills data with one payload and returns its length
+  unsigned char (*make)(unsigned char *data);
+};
+
+static uint64_t rng_state;
+
+static uint32_t next()
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (rng_state * 2685821657736338717ull) >> 32;
+}
+
+static void putLE(unsigned char *data, uint64_t value, unsigned char bytes)
+{
+  while (bytes--)
+  {
+    *data++ = value & 0xff;
+    value >>= 8;
+  }
+}
+
+//What a sensor node prints, like "23.4C 51%"
+static unsigned char makeText(unsigned char *data)
+{
+  return sprintf((char *)data, "%d.%dC %d%%", 15 + next() % 15, next() % 10, 30 + next() % 40);
+}
+
+//A TIME broadcast: 64 bit seconds, 32 bit fraction of which the top 16 are real, 16 bit error, as fillTime() does it
+static unsigned char makeTime(unsigned char *data)
+{
+  putLE(data, 1700000000ull + next() % 100000000, 8);
+  data[8] = 0;
+  data[9] = 127;
+  putLE(data + 10, next() & 0xffff, 2);
+  putLE(data + 12, next() % 2000, 2);
+  return 14;
+}
+
+//16 samples from a 12 bit ADC, 16 bits each, wandering around a level
+static unsigned char makeSamples(unsigned char *data)
+{
+  int level = next() % 4096, i;
+  for (i = 0; i < 16; i++)
+  {
+    level += (int)(next() % 65) - 32;
+    level = level < 0 ? 0 : level > 4095 ? 4095 : level;
+    putLE(data + 2 * i, level, 2);
+  }
+  return 32;
+}
+
+//8 floats from an IMU
+static unsigned char makeFloats(unsigned char *data)
+{
+  int i;
+  for (i = 0; i < 8; i++)
+  {
+    float f = (float)((int)(next() % 20001) - 10000) / 1000.0f;
+    memcpy(data + 4 * i, &f, 4);
+  }
+  return 32;
+}
+
+//A block of a firmware image, which looks a lot like random bytes
+static unsigned char makeFirmware(unsigned char *data)
+{
+  int i;
+  for (i = 0; i < 48; i++)
+  {
+    data[i] = next();
+  }
+  return 48;
+}
+
+//The worst there is
+static unsigned char makeControl(unsigned char *data)
+{
+  static const char controls[] = {WBTV_STH, WBTV_STX, WBTV_EOT, WBTV_ESC};
+  int i;
+  for (i = 0; i < 48; i++)
+  {
+    data[i] = controls[next() % 4];
+  }
+  return 48;
+}
+
+static const Payload payloads[] =
+{
+  {"text reading", "TEMP", makeText},
+  {"TIME", "TIME", makeTime},
+  {"16 bit ADC samples", "ADC", makeSamples},
+  {"float IMU samples", "IMU", makeFloats},
+  {"firmware block", "FW", makeFirmware},
+  {"all control chars", "ESC", makeControl},
+};
+
+int main(int argc, char **argv)
+{
+  unsigned long frames = (argc > 1) ? atol(argv[1]) : 100000;
+  unsigned char data[WBTV_MAX_MESSAGE];
+  unsigned char wire[WBTV_ENCODED_MAX(WBTV_MAX_MESSAGE, 1)];
+  unsigned int p;
+
+  rng_state = ((argc > 2) ? strtoull(argv[2], 0, 10) : 1) * 0x9E3779B97F4A7C15ull + 1;
+
+  printf("bytes on the wire per frame, mean and worst, and the share of them that isn't channel or data\n\n");
+  printf("%-20s %7s %8s %6s %8s %8s %6s %8s %6s\n",
+         "payload", "bytes", "escaped", "worst", "overhead", "xor", "worst", "overhead", "xor'd");
+  for (p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++)
+  {
+    const Payload &pl = payloads[p];
+    unsigned char clen = strlen(pl.channel);
+    double raw = 0, escaped = 0, xored = 0;
+    unsigned int worstEscaped = 0, worstXor = 0, len;
+    unsigned long used = 0, i;
+    int key;
+
+    for (i = 0; i < frames; i++)
+    {
+      unsigned char dlen = pl.make(data);
+      raw += clen + dlen;
+
+      len = WBTV_encode(wire, (const unsigned char *)pl.channel, clen, data, dlen);
+      escaped += len;
+      worstEscaped = len > worstEscaped ? len : worstEscaped;
+
+      key = WBTV_xor_key((const unsigned char *)pl.channel, clen, data, dlen);
+      if (key >= 0)
+      {
+        len = WBTV_encode(wire, (const unsigned char *)pl.channel, clen, data, dlen, 0, 0, key);
+        used++;
+      }
+      xored += len;
+      worstXor = len > worstXor ? len : worstXor;
+    }
+    printf("%-20s %7.1f %8.1f %6u %7.1f%% %8.1f %6u %7.1f%% %5.1f%%\n",
+           pl.name, raw / frames,
+           escaped / frames, worstEscaped, 100.0 * (escaped - raw) / escaped,
+           xored / frames, worstXor, 100.0 * (xored - raw) / xored,
+           100.0 * used / frames);
+  }
+  return 0;
+}
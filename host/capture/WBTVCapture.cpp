@@ -0,0 +1,694 @@
+#include "WBTVCapture.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char segmentMagic[8] = {'W', 'B', 'T', 'V', 'C', 'A', 'P', 0};
+static const char indexMagic[8] = {'W', 'B', 'T', 'V', 'I', 'D', 'X', 0};
+//Buffered records are written once there is this much of them, even without flush()
+#define WBTV_CAPTURE_BUFFER 262144
+
+//Segments are little endian whatever this is running on, so they're written and read a byte at a time
+static inline void WBTV_capture_put_le(uint8_t *p, uint64_t value, unsigned int len)
+{
+  for (unsigned int i = 0; i < len; i++)
+  {
+    p[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static inline uint64_t WBTV_capture_get_le(const uint8_t *p, unsigned int len)
+{
+  uint64_t value = 0;
+  for (unsigned int i = 0; i < len; i++)
+  {
+    value |= (uint64_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+static inline uint64_t WBTV_capture_pad(uint64_t size)
+{
+  return (size + 7) & ~(uint64_t)7;
+}
+
+//foo.wbtvcap -> foo.wbtvidx
+static std::string WBTV_capture_index_path(const std::string &segment)
+{
+  std::string p = segment;
+  size_t dot = p.rfind(".wbtvcap");
+  if (dot != std::string::npos)
+  {
+    p.erase(dot);
+  }
+  return p + ".wbtvidx";
+}
+
+//The same order as std::string, which is what the channel table is sorted by
+static int WBTV_capture_compare(const char *a, size_t alen, const uint8_t *b, size_t blen)
+{
+  int c = memcmp(a, b, (alen < blen) ? alen : blen);
+  if (c)
+  {
+    return c;
+  }
+  return (alen < blen) ? -1 : (alen > blen);
+}
+
+static bool WBTV_capture_write_all(int fd, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (len)
+  {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool WBTVCaptureWriter::open(const char *d, uint64_t bytes)
+{
+  close();
+  if (mkdir(d, 0755) < 0 && errno != EEXIST)
+  {
+    perror(d);
+    return false;
+  }
+  dir = d;
+  //Offsets in the index are 32 bits
+  segmentBytes = (bytes < 4096) ? 4096 : ((bytes > 0xffffffffULL) ? 0xffffffffULL : bytes);
+  return true;
+}
+
+bool WBTVCaptureWriter::startSegment(uint64_t time)
+{
+  uint8_t header[WBTV_CAPTURE_HEADER] = {0};
+  uint32_t version = WBTV_CAPTURE_VERSION;
+  char name[32];
+
+  //Named for the first record, nudged along if two segments somehow start in the same nanosecond
+  do
+  {
+    snprintf(name, sizeof(name), "/%020llu.wbtvcap", (unsigned long long)time++);
+    path = dir + name;
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+  }
+  while (fd < 0 && errno == EEXIST);
+  if (fd < 0)
+  {
+    perror(path.c_str());
+    return false;
+  }
+  memcpy(header, segmentMagic, 8);
+  WBTV_capture_put_le(header + 8, version, 4);
+  buffer.assign(header, header + sizeof(header));
+  written = 0;
+  //Every segment says which port is which, so it makes sense on its own
+  for (size_t i = 0; i < ports.size(); i++)
+  {
+    if (!ports[i].empty())
+    {
+      put(time, i, WBTV_CAPTURE_PORT, 0, 0, (const uint8_t *)ports[i].data(), ports[i].size());
+    }
+  }
+  return true;
+}
+
+void WBTVCaptureWriter::setPortName(uint16_t port, const char *name)
+{
+  if (ports.size() <= port)
+  {
+    ports.resize(port + 1);
+  }
+  ports[port] = name;
+  if (fd >= 0)
+  {
+    append(0, port, WBTV_CAPTURE_PORT, 0, 0, (const uint8_t *)name, strlen(name));
+  }
+}
+
+void WBTVCaptureWriter::finishSegment()
+{
+  WBTVCaptureSegment segment;
+  flush();
+  ::close(fd);
+  fd = -1;
+  //Indexing it straight back out of the page cache keeps there being only one way an index is made.
+  if (segment.open(path.c_str()))
+  {
+    segment.saveIndex();
+  }
+}
+
+bool WBTVCaptureWriter::append(uint64_t time, uint16_t port, uint8_t kind, const uint8_t *channel, uint8_t channellen, const uint8_t *data, uint32_t datalen)
+{
+  uint64_t size = WBTV_CAPTURE_RECORD_HEADER + channellen + (uint64_t)datalen;
+
+  if (dir.empty() || (WBTV_capture_pad(size) + WBTV_CAPTURE_HEADER > segmentBytes))
+  {
+    return false;
+  }
+  if ((fd >= 0) && (written + buffer.size() + WBTV_capture_pad(size) > segmentBytes))
+  {
+    finishSegment();
+  }
+  if ((fd < 0) && !startSegment(time))
+  {
+    return false;
+  }
+
+  put(time, port, kind, channel, channellen, data, datalen);
+  if (buffer.size() >= WBTV_CAPTURE_BUFFER)
+  {
+    return flush();
+  }
+  return true;
+}
+
+void WBTVCaptureWriter::put(uint64_t time, uint16_t port, uint8_t kind, const uint8_t *channel, uint8_t channellen, const uint8_t *data, uint32_t datalen)
+{
+  uint32_t size = WBTV_CAPTURE_RECORD_HEADER + channellen + datalen;
+  uint8_t header[WBTV_CAPTURE_RECORD_HEADER];
+
+  WBTV_capture_put_le(header, size, 4);
+  WBTV_capture_put_le(header + 4, port, 2);
+  header[6] = channellen;
+  header[7] = kind;
+  WBTV_capture_put_le(header + 8, time, 8);
+  buffer.insert(buffer.end(), header, header + sizeof(header));
+  buffer.insert(buffer.end(), channel, channel + channellen);
+  buffer.insert(buffer.end(), data, data + datalen);
+  buffer.resize(buffer.size() + WBTV_capture_pad(size) - size, 0);
+}
+
+bool WBTVCaptureWriter::flush()
+{
+  if ((fd < 0) || buffer.empty())
+  {
+    return true;
+  }
+  if (!WBTV_capture_write_all(fd, buffer.data(), buffer.size()))
+  {
+    perror(path.c_str());
+    return false;
+  }
+  written += buffer.size();
+  buffer.clear();
+  return true;
+}
+
+void WBTVCaptureWriter::close()
+{
+  if (fd >= 0)
+  {
+    finishSegment();
+  }
+}
+
+WBTVCaptureSegment::WBTVCaptureSegment() : records(0), first(0), last(0), data(0), size(0), indexMap(0), indexSize(0), covered(0),
+  times(0), timeCount(0), channels(0), channelCount(0), postings(0), postingCount(0), names(0)
+{
+}
+
+void WBTVCaptureSegment::close()
+{
+  if (data)
+  {
+    munmap((void *)data, size);
+  }
+  if (indexMap)
+  {
+    munmap((void *)indexMap, indexSize);
+  }
+  data = 0;
+  indexMap = 0;
+  size = indexSize = 0;
+  covered = records = first = last = 0;
+  timeCount = channelCount = postingCount = 0;
+  builtTimes.clear();
+  builtChannels.clear();
+  builtPostings.clear();
+  builtNames.clear();
+  ports.clear();
+}
+
+static const uint8_t *WBTV_capture_map(const char *path, size_t *size)
+{
+  struct stat st;
+  void *p;
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    ::close(fd);
+    return 0;
+  }
+  p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+  {
+    return 0;
+  }
+  *size = st.st_size;
+  return (const uint8_t *)p;
+}
+
+bool WBTVCaptureSegment::open(const char *p)
+{
+  const WBTVCaptureIndexHeader *h;
+  uint64_t need;
+
+  close();
+  path = p;
+  data = WBTV_capture_map(p, &size);
+  if (!data || size < WBTV_CAPTURE_HEADER || memcmp(data, segmentMagic, 8))
+  {
+    fprintf(stderr, "%s: not a WBTV capture\n", p);
+    close();
+    return false;
+  }
+
+  //Use the index file if it's sane and covers the whole segment
+  indexMap = WBTV_capture_map(WBTV_capture_index_path(path).c_str(), &indexSize);
+  h = (const WBTVCaptureIndexHeader *)indexMap;
+  if (indexMap && indexSize >= sizeof(*h) && !memcmp(h->magic, indexMagic, 8) && h->version == WBTV_CAPTURE_VERSION && h->covered == size)
+  {
+    need = sizeof(*h) + h->times * (uint64_t)sizeof(WBTVCaptureTime) + h->channels * (uint64_t)sizeof(WBTVCaptureChannel) + h->postings * 4ULL;
+    if (need <= indexSize)
+    {
+      times = (const WBTVCaptureTime *)(indexMap + sizeof(*h));
+      timeCount = h->times;
+      channels = (const WBTVCaptureChannel *)(times + timeCount);
+      channelCount = h->channels;
+      postings = (const uint32_t *)(channels + channelCount);
+      postingCount = h->postings;
+      names = (const char *)(postings + postingCount);
+      records = h->records;
+      covered = h->covered;
+      first = h->first;
+      last = h->last;
+      readPorts();
+      return true;
+    }
+  }
+  if (indexMap)
+  {
+    munmap((void *)indexMap, indexSize);
+    indexMap = 0;
+    indexSize = 0;
+  }
+  buildIndex();
+  readPorts();
+  return true;
+}
+
+void WBTVCaptureSegment::readPorts()
+{
+  WBTVCaptureRecord rec;
+  uint64_t offset = WBTV_CAPTURE_HEADER, next;
+  while (record(offset, &rec, &next) && rec.kind == WBTV_CAPTURE_PORT)
+  {
+    if (ports.size() <= rec.port)
+    {
+      ports.resize(rec.port + 1);
+    }
+    ports[rec.port].assign((const char *)rec.data, rec.datalen);
+    offset = next;
+  }
+}
+
+void WBTVCaptureSegment::buildIndex()
+{
+  std::map<std::string, std::vector<uint32_t> > byChannel;
+  std::map<std::string, std::vector<uint32_t> >::iterator c;
+  WBTVCaptureRecord rec;
+  uint64_t offset = WBTV_CAPTURE_HEADER, next;
+
+  //record() only trusts covered, and this is where we find out what it is.
+  covered = size;
+  records = 0;
+  while (record(offset, &rec, &next))
+  {
+    if (!records)
+    {
+      first = rec.time;
+    }
+    if (rec.time > last || !records)
+    {
+      last = rec.time;
+    }
+    if (!(records % WBTV_CAPTURE_TIME_STRIDE))
+    {
+      WBTVCaptureTime t = {last, offset};
+      builtTimes.push_back(t);
+    }
+    if (rec.kind == WBTV_CAPTURE_DECODED)
+    {
+      byChannel[std::string((const char *)rec.channel, rec.channellen)].push_back(offset);
+    }
+    records++;
+    offset = next;
+  }
+  //A record cut short at the end, by a crash or because it's still being written, is left out.
+  covered = offset;
+
+  for (c = byChannel.begin(); c != byChannel.end(); c++)
+  {
+    WBTVCaptureChannel entry = {(uint32_t)builtPostings.size(), (uint32_t)c->second.size(), (uint32_t)builtNames.size(), (uint32_t)c->first.size()};
+    builtChannels.push_back(entry);
+    builtPostings.insert(builtPostings.end(), c->second.begin(), c->second.end());
+    builtNames += c->first;
+  }
+  times = builtTimes.data();
+  timeCount = builtTimes.size();
+  channels = builtChannels.data();
+  channelCount = builtChannels.size();
+  postings = builtPostings.data();
+  postingCount = builtPostings.size();
+  names = builtNames.data();
+}
+
+bool WBTVCaptureSegment::saveIndex() const
+{
+  WBTVCaptureIndexHeader h;
+  std::string out = WBTV_capture_index_path(path);
+  std::string temp = out + ".new";
+  const char *n = names;
+  size_t namesLen = 0;
+  uint32_t i;
+  bool ok;
+  int fd;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, indexMagic, 8);
+  h.version = WBTV_CAPTURE_VERSION;
+  h.channels = channelCount;
+  h.records = records;
+  //Only a segment that is nothing but whole records gets an index, otherwise it would never match the size.
+  h.covered = covered;
+  h.first = first;
+  h.last = last;
+  h.times = timeCount;
+  h.postings = postingCount;
+  for (i = 0; i < channelCount; i++)
+  {
+    namesLen = std::max(namesLen, (size_t)channels[i].name + channels[i].namelen);
+  }
+
+  fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror(temp.c_str());
+    return false;
+  }
+  ok = WBTV_capture_write_all(fd, &h, sizeof(h)) &&
+       WBTV_capture_write_all(fd, times, timeCount * sizeof(WBTVCaptureTime)) &&
+       WBTV_capture_write_all(fd, channels, channelCount * sizeof(WBTVCaptureChannel)) &&
+       WBTV_capture_write_all(fd, postings, postingCount * 4) &&
+       WBTV_capture_write_all(fd, n, namesLen);
+  ::close(fd);
+  if (!ok || rename(temp.c_str(), out.c_str()) < 0)
+  {
+    perror(out.c_str());
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool WBTVCaptureSegment::record(uint64_t offset, WBTVCaptureRecord *rec, uint64_t *next) const
+{
+  uint32_t recsize;
+  const uint8_t *p = data + offset;
+
+  if (offset + WBTV_CAPTURE_RECORD_HEADER > covered)
+  {
+    return false;
+  }
+  recsize = (uint32_t)WBTV_capture_get_le(p, 4);
+  if (recsize < (uint32_t)WBTV_CAPTURE_RECORD_HEADER + p[6] || offset + recsize > covered)
+  {
+    return false;
+  }
+  rec->port = (uint16_t)WBTV_capture_get_le(p + 4, 2);
+  rec->channellen = p[6];
+  rec->kind = p[7];
+  rec->time = WBTV_capture_get_le(p + 8, 8);
+  rec->channel = p + WBTV_CAPTURE_RECORD_HEADER;
+  rec->data = rec->channel + rec->channellen;
+  rec->datalen = recsize - WBTV_CAPTURE_RECORD_HEADER - rec->channellen;
+  *next = offset + WBTV_capture_pad(recsize);
+  return true;
+}
+
+uint64_t WBTVCaptureSegment::seek(uint64_t time) const
+{
+  WBTVCaptureRecord rec;
+  uint64_t offset = WBTV_CAPTURE_HEADER, next, latest = 0;
+  uint32_t lo = 0, hi = timeCount;
+
+  //The first entry that reaches time, then step through the stride before it.
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    if (times[mid].time < time)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  if (lo > 0)
+  {
+    offset = times[lo - 1].offset;
+    latest = times[lo - 1].time;
+  }
+  while (record(offset, &rec, &next))
+  {
+    latest = std::max(latest, rec.time);
+    if (latest >= time)
+    {
+      return offset;
+    }
+    offset = next;
+  }
+  return covered;
+}
+
+const uint32_t *WBTVCaptureSegment::channel(const uint8_t *name, uint8_t namelen, uint32_t *count) const
+{
+  uint32_t lo = 0, hi = channelCount;
+  while (lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    int c = WBTV_capture_compare(names + channels[mid].name, channels[mid].namelen, name, namelen);
+    if (!c)
+    {
+      *count = channels[mid].count;
+      return postings + channels[mid].first;
+    }
+    if (c < 0)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  *count = 0;
+  return 0;
+}
+
+bool WBTVCapture::open(const char *path)
+{
+  std::vector<std::string> files;
+  struct stat st;
+  size_t i;
+
+  close();
+  if (stat(path, &st) < 0)
+  {
+    perror(path);
+    return false;
+  }
+  if (S_ISDIR(st.st_mode))
+  {
+    DIR *d = opendir(path);
+    struct dirent *e;
+    while (d && (e = readdir(d)))
+    {
+      size_t len = strlen(e->d_name);
+      if (len > 8 && !strcmp(e->d_name + len - 8, ".wbtvcap"))
+      {
+        files.push_back(std::string(path) + "/" + e->d_name);
+      }
+    }
+    if (d)
+    {
+      closedir(d);
+    }
+    //Named for their first record, so this is oldest first
+    std::sort(files.begin(), files.end());
+  }
+  else
+  {
+    files.push_back(path);
+  }
+
+  for (i = 0; i < files.size(); i++)
+  {
+    WBTVCaptureSegment *s = new WBTVCaptureSegment;
+    if (s->open(files[i].c_str()))
+    {
+      segments.push_back(s);
+    }
+    else
+    {
+      delete s;
+    }
+  }
+  return !segments.empty();
+}
+
+std::string WBTVCapture::portName(uint16_t port) const
+{
+  size_t i;
+  for (i = 0; i < segments.size(); i++)
+  {
+    if (port < segments[i]->ports.size() && !segments[i]->ports[port].empty())
+    {
+      return segments[i]->ports[port];
+    }
+  }
+  return "";
+}
+
+void WBTVCapture::close()
+{
+  size_t i;
+  for (i = 0; i < segments.size(); i++)
+  {
+    delete segments[i];
+  }
+  segments.clear();
+}
+
+WBTVCaptureQuery::WBTVCaptureQuery(const WBTVCapture &c, uint64_t f, uint64_t t) : capture(c), from(f), to(t), segment(0), started(false), at(0), stop(0)
+{
+}
+
+void WBTVCaptureQuery::addChannel(const uint8_t *channel, uint8_t channellen)
+{
+  std::string name((const char *)channel, channellen);
+  //Twice would return its records twice
+  if (std::find(wanted.begin(), wanted.end(), name) == wanted.end())
+  {
+    wanted.push_back(name);
+  }
+}
+
+void WBTVCaptureQuery::addChannel(const char *channel)
+{
+  addChannel((const uint8_t *)channel, strlen(channel));
+}
+
+bool WBTVCaptureQuery::startSegment()
+{
+  const WBTVCaptureSegment *s;
+  size_t i;
+
+  if (segment >= capture.segments.size())
+  {
+    return false;
+  }
+  s = capture.segments[segment];
+  at = s->seek(from);
+  stop = (to == UINT64_MAX) ? s->end() : s->seek(to);
+
+  //Each channel's list, cut down to the range
+  lists.clear();
+  remaining.clear();
+  for (i = 0; i < wanted.size(); i++)
+  {
+    uint32_t count;
+    const uint32_t *list = s->channel((const uint8_t *)wanted[i].data(), wanted[i].size(), &count);
+    const uint32_t *begin = std::lower_bound(list, list + count, at);
+    const uint32_t *end = std::lower_bound(begin, list + count, stop);
+    if (begin != end)
+    {
+      lists.push_back(begin);
+      remaining.push_back(end - begin);
+    }
+  }
+  started = true;
+  return true;
+}
+
+bool WBTVCaptureQuery::next(WBTVCaptureRecord *rec)
+{
+  uint64_t after;
+
+  for (;;)
+  {
+    if (!started && !startSegment())
+    {
+      return false;
+    }
+    const WBTVCaptureSegment *s = capture.segments[segment];
+
+    if (wanted.empty())
+    {
+      if (at < stop && s->record(at, rec, &after))
+      {
+        at = after;
+        return true;
+      }
+    }
+    else
+    {
+      //Whichever channel has the earliest record next
+      size_t i, best = lists.size();
+      for (i = 0; i < lists.size(); i++)
+      {
+        if (remaining[i] && (best == lists.size() || *lists[i] < *lists[best]))
+        {
+          best = i;
+        }
+      }
+      if (best < lists.size())
+      {
+        uint64_t offset = *lists[best]++;
+        remaining[best]--;
+        if (s->record(offset, rec, &after))
+        {
+          return true;
+        }
+        continue;
+      }
+    }
+    segment++;
+    started = false;
+  }
+}
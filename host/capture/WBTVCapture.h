@@ -0,0 +1,215 @@
+#ifndef _WBTV_HOST_CAPTURE
+#define _WBTV_HOST_CAPTURE
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ *Captures of bus traffic that are kept as long as you like, for looking into what happened after the fact
+ *and for replaying as a load test. wbtvd writes them with --capture, wbtv_replay reads them.
+ *
+ *A capture is a directory of segments. Each segment is only ever appended to, and a new one is started when
+ *it gets too big, named for the time of its first record so they sort in order. A segment is a 16 byte header,
+ *"WBTVCAP" and a NUL then a 32 bit version and 4 spare bytes, followed by records. A record is laid out like the
+ *ones in the shared memory ring: size(everything, unpadded, 32 bits), port(16 bits), channel length(8 bits),
+ *kind(8 bits) and time in nanoseconds since the epoch(64 bits), then the channel, then the data, padded to 8 bytes.
+ *Everything is little endian. A raw record is bytes exactly as they came off the port with no channel, a decoded
+ *record is one message, and a port record, written at the start of every segment, has the name of a port as its data.
+ *
+ *When a segment is finished a sidecar index is written next to it, with the extension changed to .wbtvidx,
+ *listing every record on each channel and every 64th record by time. A segment without one, because the writer
+ *died or it's still being written, is indexed in memory when it's opened. The index is only a cache and is mapped
+ *as it is, so unlike the segments it's in the byte order of whatever wrote it. Elsewhere the version won't match
+ *and the segment gets indexed in memory instead.
+ *
+ *Readers map the files and hand out pointers into them, so going through a capture copies nothing.
+ */
+
+#define WBTV_CAPTURE_VERSION 1
+#define WBTV_CAPTURE_HEADER 16
+#define WBTV_CAPTURE_RECORD_HEADER 16
+//How many records apart the entries in the time index are
+#define WBTV_CAPTURE_TIME_STRIDE 64
+
+//Record kinds
+#define WBTV_CAPTURE_DECODED 0
+#define WBTV_CAPTURE_RAW 1
+#define WBTV_CAPTURE_PORT 2
+
+struct WBTVCaptureRecord
+{
+  uint64_t time;
+  uint16_t port;
+  uint8_t kind;
+  const uint8_t *channel;
+  uint8_t channellen;
+  const uint8_t *data;
+  uint32_t datalen;
+};
+
+//The index file is this header, then the time entries, then the channel entries sorted by name,
+//then the offsets of the records on each channel, then the channel names.
+struct WBTVCaptureIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t channels;
+  uint64_t records;
+  //How many bytes of the segment were indexed, if it's grown since the index is out of date
+  uint64_t covered;
+  uint64_t first;
+  uint64_t last;
+  uint32_t times;
+  uint32_t postings;
+  uint64_t spare;
+};
+
+//The latest time of any record up to and including the one at offset, so these always go up
+//even if the clock went backwards.
+struct WBTVCaptureTime
+{
+  uint64_t time;
+  uint64_t offset;
+};
+
+struct WBTVCaptureChannel
+{
+  //Index of the first of count offsets
+  uint32_t first;
+  uint32_t count;
+  //Where the name is in the name area
+  uint32_t name;
+  uint32_t namelen;
+};
+
+class WBTVCaptureWriter
+{
+public:
+  WBTVCaptureWriter() : fd(-1), written(0), segmentBytes(0) {}
+  ~WBTVCaptureWriter() { close(); }
+
+  //Start writing a new segment in dir, which is created if need be. Segments are started afresh at segmentBytes.
+  bool open(const char *dir, uint64_t segmentBytes);
+  //Name a port, recorded now and at the start of every segment after.
+  void setPortName(uint16_t port, const char *name);
+  //Add a record. It's buffered until flush(), or until there is a good amount of it.
+  bool append(uint64_t time, uint16_t port, uint8_t kind, const uint8_t *channel, uint8_t channellen, const uint8_t *data, uint32_t datalen);
+  //Hand everything buffered to the kernel, in one write().
+  bool flush();
+  //Flush, close the segment and write its index.
+  void close();
+
+private:
+  bool startSegment(uint64_t time);
+  void finishSegment();
+  void put(uint64_t time, uint16_t port, uint8_t kind, const uint8_t *channel, uint8_t channellen, const uint8_t *data, uint32_t datalen);
+
+  std::string dir;
+  std::string path;
+  int fd;
+  uint64_t written;
+  uint64_t segmentBytes;
+  std::vector<uint8_t> buffer;
+  std::vector<std::string> ports;
+};
+
+class WBTVCaptureSegment
+{
+public:
+  WBTVCaptureSegment();
+  ~WBTVCaptureSegment() { close(); }
+
+  //Map a segment and its index, or index it now if the index is missing or out of date.
+  bool open(const char *path);
+  void close();
+  //Write out the index for what's been indexed, for a segment that doesn't have one yet.
+  bool saveIndex() const;
+
+  //Offsets of the first record and just past the last complete one
+  uint64_t begin() const { return WBTV_CAPTURE_HEADER; }
+  uint64_t end() const { return covered; }
+  //Read the record at offset, false if there isn't a whole one there. next is where the one after it starts.
+  bool record(uint64_t offset, WBTVCaptureRecord *rec, uint64_t *next) const;
+  //Where the first record at or after time is, or end(). Records before a clock jump backwards count as later.
+  uint64_t seek(uint64_t time) const;
+  //Offsets of every record on a channel, in order. 0 if there aren't any.
+  const uint32_t *channel(const uint8_t *name, uint8_t namelen, uint32_t *count) const;
+
+  uint64_t records;
+  uint64_t first;
+  uint64_t last;
+  std::string path;
+  //From the port records at the start
+  std::vector<std::string> ports;
+
+private:
+  void buildIndex();
+  void readPorts();
+
+  const uint8_t *data;
+  size_t size;
+  const uint8_t *indexMap;
+  size_t indexSize;
+  uint64_t covered;
+
+  //Either point into the index file or at the vectors below
+  const WBTVCaptureTime *times;
+  uint32_t timeCount;
+  const WBTVCaptureChannel *channels;
+  uint32_t channelCount;
+  const uint32_t *postings;
+  uint32_t postingCount;
+  const char *names;
+
+  std::vector<WBTVCaptureTime> builtTimes;
+  std::vector<WBTVCaptureChannel> builtChannels;
+  std::vector<uint32_t> builtPostings;
+  std::string builtNames;
+};
+
+//Every segment in a capture, oldest first
+class WBTVCapture
+{
+public:
+  ~WBTVCapture() { close(); }
+  //A capture directory, or a single segment file
+  bool open(const char *path);
+  void close();
+  //The name of a port, from the first segment that has one
+  std::string portName(uint16_t port) const;
+
+  std::vector<WBTVCaptureSegment *> segments;
+};
+
+/*
+ *Goes through the records in a time range, optionally only on some channels.
+ *Records are returned in the order they were written.
+ */
+class WBTVCaptureQuery
+{
+public:
+  //Times in nanoseconds since the epoch, from inclusive, to exclusive. 0 and UINT64_MAX for everything.
+  WBTVCaptureQuery(const WBTVCapture &capture, uint64_t from, uint64_t to);
+  void addChannel(const uint8_t *channel, uint8_t channellen);
+  void addChannel(const char *channel);
+  //The next record, pointing into the capture. False at the end.
+  bool next(WBTVCaptureRecord *rec);
+
+private:
+  bool startSegment();
+
+  const WBTVCapture &capture;
+  uint64_t from;
+  uint64_t to;
+  std::vector<std::string> wanted;
+  size_t segment;
+  bool started;
+  //The current segment's range, and for channel queries where each channel's list is up to
+  uint64_t at;
+  uint64_t stop;
+  std::vector<const uint32_t *> lists;
+  std::vector<uint32_t> remaining;
+};
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ *Plays a capture made by wbtvd --capture back, either out a serial port or pty, or through a local WBTVNode to see
+ *how fast the decoder gets through it. Also lists what's in a capture.
+ *
+ *Decoded records are sent with sendMessage(), raw records are written or fed to decodeBuffer() exactly as they were captured.
+ *
+ *Usage: wbtv_replay [--fast] [--from seconds] [--to seconds] [-c channel ...] [--port n] [--raw | --decoded]
+ *                   [--loops n] [--out port[:speed]] [--print] capture
+ *  --fast     don't wait between records, go as fast as possible
+ *  --from     start this many seconds into the capture, --to stop there
+ *  -c         only this channel, as many times as you like. Raw records are skipped.
+ *  --port     only records that came in on this port, counting from 0 in the order wbtvd was given them
+ *  --raw      only raw records, --decoded only decoded ones. A capture made with --capture-raw has both.
+ *  --loops    play it this many times over
+ *  --out      send to a serial port or pty instead of decoding locally
+ *  --print    list the records instead of playing them
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#include "WBTVNode.h"
+#include "MemoryStream.h"
+#include "WBTVCapture.h"
+
+//Collects what a node writes so it goes out in one write()
+class BufferStream : public Stream
+{
+public:
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  size_t write(uint8_t chr)
+  {
+    out.push_back(chr);
+    return 1;
+  }
+  //Whole frames come through here with WBTV_BULK_WRITE
+  size_t write(const uint8_t *buffer, size_t size)
+  {
+    out.insert(out.end(), buffer, buffer + size);
+    return size;
+  }
+  std::vector<uint8_t> out;
+};
+
+static unsigned long framesSeen;
+
+static void countingCallback(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen)
+{
+  framesSeen++;
+}
+
+static int openOut(const char *arg)
+{
+  std::string name(arg);
+  long baud = 115200;
+  size_t colon = name.rfind(':');
+  struct termios tio;
+  speed_t speed;
+  int fd;
+
+  if (colon != std::string::npos)
+  {
+    baud = atol(name.c_str() + colon + 1);
+    name.erase(colon);
+  }
+  switch (baud)
+  {
+  case 9600: speed = B9600; break;
+  case 19200: speed = B19200; break;
+  case 38400: speed = B38400; break;
+  case 57600: speed = B57600; break;
+  case 115200: speed = B115200; break;
+  case 230400: speed = B230400; break;
+  case 460800: speed = B460800; break;
+  case 921600: speed = B921600; break;
+  default:
+    fprintf(stderr, "%s: unsupported speed %ld\n", name.c_str(), baud);
+    return -1;
+  }
+  fd = open(name.c_str(), O_RDWR | O_NOCTTY);
+  if (fd < 0)
+  {
+    perror(name.c_str());
+    return -1;
+  }
+  if (tcgetattr(fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+static void printRecord(const WBTVCapture &capture, const WBTVCaptureRecord &r)
+{
+  uint32_t i;
+  time_t sec = r.time / 1000000000ULL;
+  struct tm t;
+  std::string port = capture.portName(r.port);
+
+  localtime_r(&sec, &t);
+  printf("%04d-%02d-%02d %02d:%02d:%02d.%06lu %s ", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+         (unsigned long)(r.time % 1000000000ULL) / 1000, port.empty() ? "?" : port.c_str());
+  if (r.kind == WBTV_CAPTURE_RAW)
+  {
+    printf("raw %u bytes\n", r.datalen);
+    return;
+  }
+  printf("%.*s ~ ", (int)r.channellen, (const char *)r.channel);
+  for (i = 0; i < r.datalen; i++)
+  {
+    uint8_t c = r.data[i];
+    if (c >= 32 && c < 127 && c != '\\')
+    {
+      putchar(c);
+    }
+    else
+    {
+      printf("\\x%02x", c);
+    }
+  }
+  putchar('\n');
+}
+
+//Sleep until the moment a record captured at time should go, relative to the first
+static void pace(uint64_t time, uint64_t base, const struct timespec &start)
+{
+  struct timespec when = start;
+  uint64_t offset;
+  if (time <= base)
+  {
+    return;
+  }
+  offset = time - base;
+  when.tv_sec += offset / 1000000000ULL;
+  when.tv_nsec += offset % 1000000000ULL;
+  if (when.tv_nsec >= 1000000000L)
+  {
+    when.tv_sec++;
+    when.tv_nsec -= 1000000000L;
+  }
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, 0);
+}
+
+int main(int argc, char **argv)
+{
+  WBTVCapture capture;
+  WBTVCaptureRecord r;
+  std::vector<const char *> channels;
+  const char *path = 0, *out = 0;
+  double from = 0, to = -1;
+  long onlyPort = -1, loops = 1, l;
+  bool fast = false, print = false;
+  int kind = -1;
+  int a, fd = -1;
+  unsigned long records = 0, frames = 0, skipped = 0;
+  double bytes = 0;
+
+  for (a = 1; a < argc; a++)
+  {
+    const char *arg = argv[a];
+    const char *val = (a + 1 < argc) ? argv[a + 1] : "";
+    if (!strcmp(arg, "--fast")) fast = true;
+    else if (!strcmp(arg, "--print")) print = true;
+    else if (!strcmp(arg, "--raw")) kind = WBTV_CAPTURE_RAW;
+    else if (!strcmp(arg, "--decoded")) kind = WBTV_CAPTURE_DECODED;
+    else if (!strcmp(arg, "--from")) from = atof(val), a++;
+    else if (!strcmp(arg, "--to")) to = atof(val), a++;
+    else if (!strcmp(arg, "-c")) channels.push_back(val), a++;
+    else if (!strcmp(arg, "--port")) onlyPort = atol(val), a++;
+    else if (!strcmp(arg, "--loops")) loops = atol(val), a++;
+    else if (!strcmp(arg, "--out")) out = val, a++;
+    else if (arg[0] != '-') path = arg;
+    else
+    {
+      path = 0;
+      break;
+    }
+  }
+  if (!path)
+  {
+    fprintf(stderr, "usage: wbtv_replay [--fast] [--from seconds] [--to seconds] [-c channel ...] [--port n] [--raw | --decoded]\n"
+                    "                   [--loops n] [--out port[:speed]] [--print] capture\n");
+    return 1;
+  }
+  if (!capture.open(path))
+  {
+    return 1;
+  }
+  if (out && (fd = openOut(out)) < 0)
+  {
+    return 1;
+  }
+
+  uint64_t start = capture.segments[0]->first;
+  uint64_t begin = start + (uint64_t)(from * 1e9);
+  uint64_t end = (to < 0) ? UINT64_MAX : start + (uint64_t)(to * 1e9);
+
+  //The local decoder gets a node per port, so raw bytes from different ports don't run together
+  BufferStream encoded;
+  WBTVSizedNode<255> sender(&encoded);
+  std::vector<WBTVMemoryStream *> streams;
+  std::vector<WBTVSizedNode<255> *> receivers;
+
+  std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+  for (l = 0; l < loops; l++)
+  {
+    WBTVCaptureQuery query(capture, begin, end);
+    struct timespec wall;
+    uint64_t base = 0;
+    size_t c;
+
+    for (c = 0; c < channels.size(); c++)
+    {
+      query.addChannel(channels[c]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+
+    while (query.next(&r))
+    {
+      const uint8_t *bytesOut;
+      size_t len;
+
+      if (r.kind == WBTV_CAPTURE_PORT || (onlyPort >= 0 && r.port != onlyPort) || (kind >= 0 && r.kind != kind))
+      {
+        continue;
+      }
+      records++;
+      if (print)
+      {
+        printRecord(capture, r);
+        continue;
+      }
+      if (!base)
+      {
+        base = r.time;
+      }
+      if (!fast)
+      {
+        pace(r.time, base, wall);
+      }
+
+      if (r.kind == WBTV_CAPTURE_RAW)
+      {
+        bytesOut = r.data;
+        len = r.datalen;
+      }
+      else
+      {
+        if (WBTV_RX_SIZE(r.channellen, r.datalen, 0) > WBTV_MAX_MESSAGE)
+        {
+          skipped++;
+          continue;
+        }
+        encoded.out.clear();
+        sender.sendMessage(r.channel, r.channellen, r.data, r.datalen);
+        bytesOut = encoded.out.data();
+        len = encoded.out.size();
+      }
+      bytes += len;
+
+      if (fd >= 0)
+      {
+        while (len)
+        {
+          ssize_t n = write(fd, bytesOut, len);
+          if (n <= 0)
+          {
+            perror(out);
+            return 1;
+          }
+          bytesOut += n;
+          len -= n;
+        }
+        continue;
+      }
+      while (receivers.size() <= r.port)
+      {
+        streams.push_back(new WBTVMemoryStream);
+        receivers.push_back(new WBTVSizedNode<255>(streams.back()));
+        receivers.back()->setBinaryCallback(&countingCallback);
+      }
+      receivers[r.port]->decodeBuffer(bytesOut, len);
+    }
+  }
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count();
+
+  if (!print)
+  {
+    frames = (fd >= 0) ? records - skipped : framesSeen;
+    printf("%lu records, %.0f bytes in %.3fs: %.0f frames/s, %.2f MB/s\n", records, bytes, secs, frames / secs, bytes / secs / 1e6);
+    if (fd < 0)
+    {
+      printf("%lu frames decoded\n", framesSeen);
+    }
+    if (skipped)
+    {
+      printf("%lu messages too long for a node to recieve skipped\n", skipped);
+    }
+  }
+  return 0;
+}
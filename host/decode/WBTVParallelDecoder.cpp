@@ -0,0 +1,292 @@
+#include "WBTVParallelDecoder.h"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "WBTVNode.h"
+
+//A chunk's frames, with everything they point at kept in one block
+struct WBTVDecodedChunk
+{
+  struct Frame
+  {
+    uint64_t end;
+    size_t at;
+    uint8_t channellen;
+    uint8_t datalen;
+  };
+
+  size_t begin;
+  size_t end;
+  //Whether the first byte of the chunk is escaped
+  bool escaped;
+  bool ready;
+  std::vector<Frame> frames;
+  std::vector<uint8_t> bytes;
+};
+
+/*
+ *A WBTVReceiver, the same one WBTVNodeBase recieves with, that collects frames instead of dispatching them.
+ *It does what a node would about STAT and TRACE requests, wbtv_pdecode --check compares the two.
+ */
+class WBTVFrameScanner : public WBTVReceiver<WBTVFrameScanner>
+{
+  friend class WBTVReceiver<WBTVFrameScanner>;
+public:
+  WBTVFrameScanner(unsigned char capacity) : WBTVReceiver<WBTVFrameScanner>(buffer, capacity), out(0), offset(0), request(0)
+  {
+  }
+
+  //Decode len bytes, the first of which is at offset in the whole input.
+  void scan(const uint8_t *data, size_t len, uint64_t at, WBTVDecodedChunk *chunk)
+  {
+    size_t i;
+    out = chunk;
+    for (i = 0; i < len; i++)
+    {
+      offset = at + i;
+      receive(data[i]);
+    }
+  }
+
+  //Decode from data up to the next unescaped !, or limit. Returns how many bytes that was.
+  size_t scanToStart(const uint8_t *data, size_t limit, uint64_t at, WBTVDecodedChunk *chunk)
+  {
+    size_t i;
+    out = chunk;
+    for (i = 0; i < limit; i++)
+    {
+      if (!escape && data[i] == WBTV_STH)
+      {
+        break;
+      }
+      offset = at + i;
+      receive(data[i]);
+    }
+    return i;
+  }
+
+private:
+  void rxStart()
+  {
+  }
+
+  void rxHeaderByte(unsigned char)
+  {
+  }
+
+  //Aliases aren't expanded, see WBTVParallelDecoder.h
+  unsigned char rxChannel()
+  {
+    return 1;
+  }
+
+  unsigned char rxHeader()
+  {
+    request = 0;
+#ifdef WBTV_STATS
+    request |= WBTV_STAT_CHANNEL::matches(message, headerTerminatorPosition, rxSumSlow, rxSumFast);
+#endif
+#ifdef WBTV_TRACE
+    request |= WBTV_TRACE_CHANNEL::matches(message, headerTerminatorPosition, rxSumSlow, rxSumFast);
+#endif
+    return 1;
+  }
+
+  void rxEnd()
+  {
+  }
+
+  void rxDiscard()
+  {
+  }
+
+  void rxFrame(unsigned char good)
+  {
+    uint8_t header = headerTerminatorPosition;
+
+    if (!good)
+    {
+      return;
+    }
+    //The node answers these itself
+    if (request && (recievePointer == header + 3))
+    {
+      return;
+    }
+
+    WBTVDecodedChunk::Frame f = {offset, out->bytes.size(), header, (uint8_t)(recievePointer - (header + 3))};
+    out->bytes.insert(out->bytes.end(), message, message + header);
+    out->bytes.insert(out->bytes.end(), message + header + 1, message + header + 1 + f.datalen);
+    out->frames.push_back(f);
+  }
+
+  WBTVDecodedChunk *out;
+  //Where in the input the byte being decoded is
+  uint64_t offset;
+  //True if this frame is on STAT or TRACE
+  unsigned char request;
+  unsigned char buffer[256];
+};
+
+WBTVParallelDecoder::WBTVParallelDecoder(unsigned t, unsigned char c, size_t k) : threads(t), capacity(c), chunk(k)
+{
+  if (!threads)
+  {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (!threads)
+  {
+    threads = 1;
+  }
+  if (chunk < 64)
+  {
+    chunk = 64;
+  }
+}
+
+//Hand a chunk's frames to the callback, returns how many
+static uint64_t WBTV_emit_chunk(const WBTVDecodedChunk &c, WBTVDecodedCallback callback, void *arg)
+{
+  size_t i;
+  for (i = 0; i < c.frames.size(); i++)
+  {
+    const WBTVDecodedChunk::Frame &f = c.frames[i];
+    WBTVDecodedFrame frame;
+    frame.end = f.end;
+    frame.channel = &c.bytes[f.at];
+    frame.channellen = f.channellen;
+    frame.data = frame.channel + f.channellen;
+    frame.datalen = f.datalen;
+    callback(&frame, arg);
+  }
+  return c.frames.size();
+}
+
+uint64_t WBTVParallelDecoder::decodeSequential(const uint8_t *data, size_t len, WBTVDecodedCallback callback, void *arg)
+{
+  WBTVFrameScanner scanner(capacity);
+  WBTVDecodedChunk out;
+  uint64_t frames = 0;
+  size_t at = 0, n;
+
+  //A chunk at a time, so the frames don't all pile up before they're handed over
+  while (at < len)
+  {
+    n = std::min(chunk, len - at);
+    out.frames.clear();
+    out.bytes.clear();
+    scanner.scan(data + at, n, at, &out);
+    frames += WBTV_emit_chunk(out, callback, arg);
+    at += n;
+  }
+  return frames;
+}
+
+//Decode one chunk, from its first unescaped ! up to the one after its end.
+static void WBTV_decode_chunk(const uint8_t *data, size_t len, unsigned char capacity, WBTVDecodedChunk *c, bool first)
+{
+  WBTVFrameScanner scanner(capacity);
+  size_t start = c->begin;
+
+  //The first chunk starts the same way a node does, from nothing, whatever the first byte is.
+  if (!first)
+  {
+    bool escaped = c->escaped;
+    for (; start < c->end; start++)
+    {
+      if (escaped)
+      {
+        escaped = false;
+      }
+      else if (data[start] == WBTV_ESC)
+      {
+        escaped = true;
+      }
+      else if (data[start] == WBTV_STH)
+      {
+        break;
+      }
+    }
+    //None at all, so whichever chunk has the one before decodes this one too.
+    if (start == c->end)
+    {
+      return;
+    }
+  }
+  scanner.scan(data + start, c->end - start, start, c);
+  scanner.scanToStart(data + c->end, len - c->end, c->end, c);
+}
+
+uint64_t WBTVParallelDecoder::decode(const uint8_t *data, size_t len, WBTVDecodedCallback callback, void *arg)
+{
+  size_t count = (len + chunk - 1) / chunk, i, emitted = 0;
+  std::vector<WBTVDecodedChunk> chunks(count);
+  std::vector<std::thread> pool;
+  std::atomic<size_t> next(0);
+  std::mutex lock;
+  std::condition_variable done, room;
+  size_t run = 0;
+  uint64_t frames = 0;
+  //How far ahead of the callback the pool may get, so a slow callback doesn't mean keeping every frame in memory
+  const size_t window = threads * 4;
+
+  //Pass one: how long a run of backslashes each chunk starts after, and so whether its first byte is escaped.
+  for (i = 0; i < count; i++)
+  {
+    size_t b;
+    chunks[i].begin = i * chunk;
+    chunks[i].end = std::min(len, (i + 1) * chunk);
+    chunks[i].escaped = run & 1;
+    chunks[i].ready = false;
+    for (b = chunks[i].end; b > chunks[i].begin && data[b - 1] == WBTV_ESC; b--)
+    {
+    }
+    //All backslashes, so the run carries on from the chunk before
+    run = (b == chunks[i].begin) ? run + (chunks[i].end - b) : chunks[i].end - b;
+  }
+
+  //Pass two: decode them all on the pool, and hand them back in order as they finish.
+  for (i = 0; i < threads && i < count; i++)
+  {
+    pool.push_back(std::thread([&]()
+    {
+      size_t c;
+      while ((c = next++) < count)
+      {
+        {
+          std::unique_lock<std::mutex> l(lock);
+          room.wait(l, [&]() { return c < emitted + window; });
+        }
+        WBTV_decode_chunk(data, len, capacity, &chunks[c], c == 0);
+        std::lock_guard<std::mutex> l(lock);
+        chunks[c].ready = true;
+        done.notify_all();
+      }
+    }));
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    {
+      std::unique_lock<std::mutex> l(lock);
+      done.wait(l, [&]() { return chunks[i].ready; });
+    }
+    frames += WBTV_emit_chunk(chunks[i], callback, arg);
+    std::vector<WBTVDecodedChunk::Frame>().swap(chunks[i].frames);
+    std::vector<uint8_t>().swap(chunks[i].bytes);
+    {
+      std::lock_guard<std::mutex> l(lock);
+      emitted = i + 1;
+      room.notify_all();
+    }
+  }
+  for (i = 0; i < pool.size(); i++)
+  {
+    pool[i].join();
+  }
+  return frames;
+}
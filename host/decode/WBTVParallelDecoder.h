@@ -0,0 +1,54 @@
+#ifndef _WBTV_HOST_PARALLELDECODER
+#define _WBTV_HOST_PARALLELDECODER
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *Decodes a big block of raw bus bytes, like a capture off a serial tap, on every core at once.
+ *
+ *The input is cut into chunks. A ! that isn't escaped resets the receiver completely, so each chunk can be
+ *decoded on its own from the first unescaped ! in it, and carries on past its end up to the next one.
+ *Whether a byte is escaped only depends on how many backslashes come right before it, so a quick first pass
+ *counts the run of backslashes at the end of each chunk, adding on the chunk before when a chunk is nothing
+ *but backslashes, and that says whether each chunk starts escaped.
+ *
+ *The chunks are decoded on a pool of threads and the frames are handed back in the order they were in the input,
+ *exactly as a WBTVNode with a binary callback and PASS_TIME set would have, checksums checked and all. Like the node,
+ *the data of a frame with several segments has a NUL between each, and empty STAT and TRACE requests aren't passed on
+ *when the library is built to answer them. Channel aliases aren't expanded, since the announcement that explains one
+ *could be in any chunk before it, so those frames come out with a NUL and the alias for a channel.
+ *
+ *Each chunk gets its own WBTVReceiver, the same byte level reciever the node is built on, rather than a whole node,
+ *since the node also keeps the clock, the random pool and the trace ring, which are shared by every node in a program.
+ */
+
+struct WBTVDecodedFrame
+{
+  //Where in the input the \n that ended it was
+  uint64_t end;
+  const uint8_t *channel;
+  uint8_t channellen;
+  const uint8_t *data;
+  uint8_t datalen;
+};
+
+//Called with each frame in order, always on the thread that called decode(). The frame is only good until it returns.
+typedef void (*WBTVDecodedCallback)(const WBTVDecodedFrame *frame, void *arg);
+
+class WBTVParallelDecoder
+{
+public:
+  //threads 0 means one per core. capacity is the receive buffer size of the node being matched.
+  WBTVParallelDecoder(unsigned threads = 0, unsigned char capacity = 255, size_t chunk = 1 << 20);
+
+  //Decode len bytes, returns how many frames were good.
+  uint64_t decode(const uint8_t *data, size_t len, WBTVDecodedCallback callback, void *arg);
+  //The same thing on one thread, one byte after another
+  uint64_t decodeSequential(const uint8_t *data, size_t len, WBTVDecodedCallback callback, void *arg);
+
+  unsigned threads;
+  unsigned char capacity;
+  size_t chunk;
+};
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ *Decodes a file of raw bus bytes on every core with WBTVParallelDecoder.
+ *
+ *Usage: wbtv_pdecode [--threads n] [--chunk kilobytes] [--capacity bytes] [--print] [--check] [--scale]
+ *                    [--corpus megabytes] [--seed n] [file]
+ *  --threads   how many to decode on, default one per core
+ *  --chunk     how much each task gets, default 1024
+ *  --capacity  receive buffer of the node to match, default 255
+ *  --print     print every frame
+ *  --check     decode it again with a WBTVNode, a byte at a time, and make sure every frame is the same
+ *  --scale     time it on 1, 2, 4 ... threads, up to --threads
+ *  --corpus    make up this many megabytes of nasty test input instead of reading a file, and write it to file if given:
+ *              good and bad frames, escaped and XOR framed, junk, frames cut short, frames too long, and long runs of backslashes
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "WBTVNode.h"
+#include "MemoryStream.h"
+#include "WBTVParallelDecoder.h"
+
+struct Frame
+{
+  uint64_t end;
+  std::string channel;
+  std::string data;
+};
+
+//A node with a receive buffer of any size up to 255
+class CheckNode : public WBTVNodeBase
+{
+public:
+  CheckNode(Stream *port, unsigned char capacity) : WBTVNodeBase(port, buffer, capacity) {}
+private:
+  unsigned char buffer[256];
+};
+
+static std::vector<Frame> *collected;
+static uint64_t nodePosition;
+
+static void collect(const WBTVDecodedFrame *f, void *arg)
+{
+  Frame frame = {f->end, std::string((const char *)f->channel, f->channellen), std::string((const char *)f->data, f->datalen)};
+  ((std::vector<Frame> *)arg)->push_back(frame);
+}
+
+static void nodeCallback(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen)
+{
+  Frame frame = {nodePosition, std::string((const char *)channel, clen), std::string((const char *)data, dlen)};
+  collected->push_back(frame);
+}
+
+static void printFrame(const WBTVDecodedFrame *f, void *arg)
+{
+  unsigned int i;
+  printf("%llu %.*s ~ ", (unsigned long long)f->end, (int)f->channellen, (const char *)f->channel);
+  for (i = 0; i < f->datalen; i++)
+  {
+    uint8_t c = f->data[i];
+    if (c >= 32 && c < 127 && c != '\\')
+    {
+      putchar(c);
+    }
+    else
+    {
+      printf("\\x%02x", c);
+    }
+  }
+  putchar('\n');
+}
+
+static void ignore(const WBTVDecodedFrame *f, void *arg)
+{
+}
+
+static uint32_t corpusRandom(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static void putEscaped(std::vector<uint8_t> &out, uint8_t c)
+{
+  if (c == WBTV_STH || c == WBTV_STX || c == WBTV_EOT || c == WBTV_ESC)
+  {
+    out.push_back(WBTV_ESC);
+  }
+  out.push_back(c);
+}
+
+//One frame, as sendMessage() would write it, with data segments split by ~.
+//With a key it's XOR framed, and everything after the !~~ and key is XORed with it instead of escaped.
+static void putFrame(std::vector<uint8_t> &out, const std::string &channel, const std::vector<std::string> &segments, bool corrupt, int key = -1)
+{
+  uint8_t slow = 0, fast = 0;
+  size_t i, j;
+  out.push_back(WBTV_STH);
+  if (key >= 0)
+  {
+    out.push_back(WBTV_STX);
+    out.push_back(WBTV_STX);
+    out.push_back(key);
+  }
+  for (i = 0; i < channel.size(); i++)
+  {
+    if (key >= 0)
+    {
+      out.push_back(channel[i] ^ key);
+    }
+    else
+    {
+      putEscaped(out, channel[i]);
+    }
+    slow += (uint8_t)channel[i];
+    fast += slow;
+  }
+  for (j = 0; j < segments.size(); j++)
+  {
+    out.push_back(WBTV_STX);
+    slow += WBTV_STX;
+    fast += slow;
+    for (i = 0; i < segments[j].size(); i++)
+    {
+      if (key >= 0)
+      {
+        out.push_back(segments[j][i] ^ key);
+      }
+      else
+      {
+        putEscaped(out, segments[j][i]);
+      }
+      slow += (uint8_t)segments[j][i];
+      fast += slow;
+    }
+  }
+  slow ^= corrupt ? 1 : 0;
+  if (key >= 0)
+  {
+    out.push_back(slow ^ key);
+    out.push_back(fast ^ key);
+  }
+  else
+  {
+    putEscaped(out, slow);
+    putEscaped(out, fast);
+  }
+  out.push_back(WBTV_EOT);
+}
+
+//A key that makes an XOR framed frame out of this, or -1. Same as WBTV_xor_key(), but for any length.
+static int corpusKey(const std::string &channel, const std::vector<std::string> &segments)
+{
+  std::string all = channel;
+  uint8_t slow = 0, fast = 0;
+  size_t i, j;
+  int key;
+
+  for (i = 0; i < channel.size(); i++)
+  {
+    slow += (uint8_t)channel[i];
+    fast += slow;
+  }
+  for (j = 0; j < segments.size(); j++)
+  {
+    slow += WBTV_STX;
+    fast += slow;
+    for (i = 0; i < segments[j].size(); i++)
+    {
+      slow += (uint8_t)segments[j][i];
+      fast += slow;
+    }
+    all += segments[j];
+  }
+  all += (char)slow;
+  all += (char)fast;
+  for (key = 0; key < 256; key++)
+  {
+    if (WBTV_byte_class(key))
+    {
+      continue;
+    }
+    for (i = 0; i < all.size(); i++)
+    {
+      if (WBTV_byte_class((uint8_t)all[i] ^ key))
+      {
+        break;
+      }
+    }
+    if (i == all.size())
+    {
+      return key;
+    }
+  }
+  return -1;
+}
+
+static void makeCorpus(std::vector<uint8_t> &out, double megabytes, uint32_t seed)
+{
+  static const char *channels[] = {"TEMP", "LED", "STAT", "TRACE", "TIME", "SENS/ROOM1/TEMP", "!~\\\n", ""};
+  static const uint8_t nasty[] = {WBTV_STH, WBTV_STX, WBTV_EOT, WBTV_ESC, 0, 'a'};
+  size_t target = (size_t)(megabytes * 1048576);
+  uint32_t state = seed ? seed : 1;
+
+  while (out.size() < target)
+  {
+    uint32_t what = corpusRandom(&state) % 100;
+    uint32_t n, i;
+
+    if (what < 70)
+    {
+      //A frame, sometimes with a few segments, sometimes empty, sometimes too long, sometimes with a bad checksum
+      std::vector<std::string> segments(1 + ((corpusRandom(&state) % 8 == 0) ? corpusRandom(&state) % 6 : 0));
+      std::string channel = channels[corpusRandom(&state) % 8];
+      for (i = 0; i < segments.size(); i++)
+      {
+        n = corpusRandom(&state) % ((corpusRandom(&state) % 20 == 0) ? 300 : 40);
+        while (n--)
+        {
+          uint32_t r = corpusRandom(&state);
+          segments[i] += (char)((r & 0x300) ? 'a' + r % 26 : nasty[r % 6]);
+        }
+      }
+      if (corpusRandom(&state) % 10 == 0)
+      {
+        segments.assign(1, "");
+      }
+      putFrame(out, channel, segments, corpusRandom(&state) % 10 == 0,
+               (corpusRandom(&state) % 4 == 0) ? corpusKey(channel, segments) : -1);
+      //Sometimes cut short by the next !
+      if (corpusRandom(&state) % 20 == 0)
+      {
+        out.resize(out.size() - 1 - corpusRandom(&state) % 4);
+      }
+    }
+    else if (what < 90)
+    {
+      //Junk, heavy on the control characters
+      n = corpusRandom(&state) % 64;
+      while (n--)
+      {
+        out.push_back(nasty[corpusRandom(&state) % 6]);
+      }
+    }
+    else
+    {
+      //A run of backslashes, now and then long enough to cover whole chunks, then a ! that might be escaped
+      n = corpusRandom(&state) % ((corpusRandom(&state) % 50 == 0) ? 70000 : 9);
+      out.insert(out.end(), n, WBTV_ESC);
+      out.push_back(WBTV_STH);
+    }
+  }
+}
+
+static std::vector<Frame> decodeWithNode(const uint8_t *data, size_t len, unsigned char capacity)
+{
+  std::vector<Frame> frames;
+  WBTVMemoryStream port;
+  CheckNode node(&port, capacity);
+  size_t i;
+
+  node.setBinaryCallback(&nodeCallback);
+  #ifdef WBTV_ADV_MODE
+  node.PASS_TIME = 1;
+  #endif
+  collected = &frames;
+  for (i = 0; i < len; i++)
+  {
+    nodePosition = i;
+    node.decodeChar(data[i]);
+    //Answers to STAT requests pile up here
+    if (port.tx().size() > 65536)
+    {
+      port.clearTx();
+    }
+  }
+  return frames;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned threads = 0, capacity = 255;
+  double chunkKB = 1024, corpus = 0;
+  uint32_t seed = 1;
+  bool print = false, check = false, scale = false;
+  const char *path = 0;
+  const uint8_t *data;
+  size_t len;
+  std::vector<uint8_t> generated;
+  int a;
+
+  for (a = 1; a < argc; a++)
+  {
+    const char *arg = argv[a];
+    const char *val = (a + 1 < argc) ? argv[a + 1] : "";
+    if (!strcmp(arg, "--print")) print = true;
+    else if (!strcmp(arg, "--check")) check = true;
+    else if (!strcmp(arg, "--scale")) scale = true;
+    else if (!strcmp(arg, "--threads")) threads = atoi(val), a++;
+    else if (!strcmp(arg, "--chunk")) chunkKB = atof(val), a++;
+    else if (!strcmp(arg, "--capacity")) capacity = atoi(val), a++;
+    else if (!strcmp(arg, "--corpus")) corpus = atof(val), a++;
+    else if (!strcmp(arg, "--seed")) seed = strtoul(val, 0, 0), a++;
+    else if (arg[0] != '-') path = arg;
+    else
+    {
+      fprintf(stderr, "usage: wbtv_pdecode [--threads n] [--chunk kilobytes] [--capacity bytes] [--print] [--check] [--scale]\n"
+                      "                    [--corpus megabytes] [--seed n] [file]\n");
+      return 1;
+    }
+  }
+  if ((!path && corpus <= 0) || capacity < 1 || capacity > 255)
+  {
+    fprintf(stderr, "need a file, or --corpus, and a capacity from 1 to 255\n");
+    return 1;
+  }
+
+  if (corpus > 0)
+  {
+    makeCorpus(generated, corpus, seed);
+    data = generated.data();
+    len = generated.size();
+    if (path)
+    {
+      FILE *f = fopen(path, "wb");
+      if (!f || fwrite(data, 1, len, f) != len)
+      {
+        perror(path);
+        return 1;
+      }
+      fclose(f);
+    }
+  }
+  else
+  {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+      perror(path);
+      return 1;
+    }
+    len = st.st_size;
+    data = len ? (const uint8_t *)mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0) : (const uint8_t *)"";
+    if (data == MAP_FAILED)
+    {
+      perror(path);
+      return 1;
+    }
+    close(fd);
+  }
+
+  WBTVParallelDecoder decoder(threads, capacity, (size_t)(chunkKB * 1024));
+
+  if (print)
+  {
+    decoder.decode(data, len, &printFrame, 0);
+    return 0;
+  }
+
+  if (check)
+  {
+    std::vector<Frame> parallel, sequential, node;
+    size_t i;
+    decoder.decode(data, len, &collect, &parallel);
+    decoder.decodeSequential(data, len, &collect, &sequential);
+    node = decodeWithNode(data, len, capacity);
+    printf("%zu bytes: %zu frames from WBTVNode, %zu sequential, %zu on %u threads in %zu byte chunks\n",
+           len, node.size(), sequential.size(), parallel.size(), decoder.threads, decoder.chunk);
+    for (i = 0; i < node.size() || i < parallel.size() || i < sequential.size(); i++)
+    {
+      const Frame *n = (i < node.size()) ? &node[i] : 0;
+      const Frame *p = (i < parallel.size()) ? &parallel[i] : 0;
+      const Frame *s = (i < sequential.size()) ? &sequential[i] : 0;
+      if (!n || !p || !s || n->end != p->end || n->channel != p->channel || n->data != p->data ||
+          s->end != p->end || s->channel != p->channel || s->data != p->data)
+      {
+        printf("MISMATCH at frame %zu, ending at %llu\n", i, (unsigned long long)(n ? n->end : p ? p->end : s->end));
+        return 1;
+      }
+    }
+    printf("all the same\n");
+    return 0;
+  }
+
+  std::vector<unsigned> counts;
+  if (scale)
+  {
+    unsigned t;
+    for (t = 1; t < decoder.threads; t *= 2)
+    {
+      counts.push_back(t);
+    }
+  }
+  counts.push_back(decoder.threads);
+
+  printf("%-8s %12s %10s %8s\n", "threads", "frames", "MB/s", "speedup");
+  double single = 0;
+  for (size_t c = 0; c < counts.size(); c++)
+  {
+    WBTVParallelDecoder d(counts[c], capacity, decoder.chunk);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t frames = d.decode(data, len, &ignore, 0);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!c)
+    {
+      single = secs;
+    }
+    printf("%-8u %12llu %10.1f %8.2f\n", counts[c], (unsigned long long)frames, len / secs / 1e6, single / secs);
+  }
+  return 0;
+}
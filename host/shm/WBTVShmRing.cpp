@@ -0,0 +1,371 @@
+#include "WBTVShmRing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static_assert(sizeof(std::atomic<uint64_t>) == 8 && ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock free 64 bit atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == 4, "the futex word has to be a plain 32 bit int");
+
+//Records start on a cache line after the header
+#define WBTV_SHM_DATA ((sizeof(WBTVShmHeader) + 63) & ~(size_t)63)
+
+static inline uint64_t WBTV_shm_pad(uint64_t size)
+{
+  return (size + 7) & ~(uint64_t)7;
+}
+
+//Not FUTEX_PRIVATE, the other end is in another process.
+static long WBTV_shm_futex(std::atomic<uint32_t> *word, int op, uint32_t val, const struct timespec *timeout)
+{
+  return syscall(SYS_futex, (uint32_t *)word, op, val, timeout, 0, 0);
+}
+
+void WBTVShmMap::close()
+{
+  if (header)
+  {
+    munmap(header, mapped);
+  }
+  if (fd >= 0)
+  {
+    ::close(fd);
+  }
+  header = 0;
+  ring = 0;
+  mapped = 0;
+  fd = -1;
+}
+
+bool WBTVShmMap::map(int f, size_t size)
+{
+  void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+  if (p == MAP_FAILED)
+  {
+    ::close(f);
+    return false;
+  }
+  fd = f;
+  mapped = size;
+  header = (WBTVShmHeader *)p;
+  ring = (uint8_t *)p + WBTV_SHM_DATA;
+  return true;
+}
+
+void WBTVShmMap::copyOut(uint64_t pos, void *out, size_t len) const
+{
+  size_t capacity = header->capacity;
+  size_t at = pos & (capacity - 1);
+  size_t first = (len < capacity - at) ? len : capacity - at;
+  memcpy(out, ring + at, first);
+  memcpy((uint8_t *)out + first, ring, len - first);
+}
+
+void WBTVShmWriter::copyIn(uint64_t pos, const void *in, size_t len)
+{
+  size_t capacity = header->capacity;
+  size_t at = pos & (capacity - 1);
+  size_t first = (len < capacity - at) ? len : capacity - at;
+  memcpy(ring + at, in, first);
+  memcpy(ring, (const uint8_t *)in + first, len - first);
+}
+
+bool WBTVShmWriter::create(const char *path, size_t capacity, mode_t mode)
+{
+  std::string temp = std::string(path) + ".new";
+  int f;
+
+  close();
+  if ((capacity < 256) || (capacity & (capacity - 1)))
+  {
+    fprintf(stderr, "%s: ring size must be a power of two, at least 256\n", path);
+    return false;
+  }
+
+  //Set it up under another name and rename it into place, so nobody can attach to half a ring.
+  unlink(temp.c_str());
+  f = open(temp.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+  if (f < 0 || ftruncate(f, WBTV_SHM_DATA + capacity) < 0)
+  {
+    perror(temp.c_str());
+    if (f >= 0)
+    {
+      ::close(f);
+    }
+    return false;
+  }
+  //Readers need to be able to register as waiters whatever the umask says
+  fchmod(f, mode);
+  if (!map(f, WBTV_SHM_DATA + capacity))
+  {
+    perror(temp.c_str());
+    return false;
+  }
+
+  //A fresh file is all zeros, so only the non zero parts need setting.
+  header->capacity = capacity;
+  header->version = WBTV_SHM_VERSION;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = WBTV_SHM_MAGIC;
+  if (rename(temp.c_str(), path) < 0)
+  {
+    perror(path);
+    unlink(temp.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+void WBTVShmWriter::setPortName(uint16_t port, const char *name)
+{
+  if (header && port < WBTV_SHM_PORTS)
+  {
+    strncpy(header->ports[port], name, WBTV_SHM_PORT_NAME - 1);
+  }
+}
+
+bool WBTVShmWriter::append(uint64_t time, uint16_t port, const uint8_t *channel, uint8_t channellen, const uint8_t *data, uint32_t datalen)
+{
+  uint8_t head[WBTV_SHM_RECORD_HEADER];
+  uint64_t size = WBTV_SHM_RECORD_HEADER + channellen + (uint64_t)datalen;
+  uint64_t at, end, tail;
+
+  if (!header || WBTV_shm_pad(size) > header->capacity)
+  {
+    return false;
+  }
+  at = header->head.load(std::memory_order_relaxed);
+  end = at + WBTV_shm_pad(size);
+
+  //Step the tail past every record this one is about to overwrite
+  tail = header->tail.load(std::memory_order_relaxed);
+  while (end - tail > header->capacity)
+  {
+    uint32_t old;
+    copyOut(tail, &old, 4);
+    tail += WBTV_shm_pad(old);
+  }
+  header->tail.store(tail, std::memory_order_release);
+
+  //Claim the space before touching it. Anyone reading something in it will see this when they check afterwards.
+  header->writeEnd.store(end, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(head, &size, 4);
+  memcpy(head + 4, &port, 2);
+  head[6] = channellen;
+  head[7] = 0;
+  memcpy(head + 8, &time, 8);
+  copyIn(at, head, sizeof(head));
+  copyIn(at + sizeof(head), channel, channellen);
+  copyIn(at + sizeof(head) + channellen, data, datalen);
+
+  header->head.store(end, std::memory_order_release);
+  return true;
+}
+
+void WBTVShmWriter::wake()
+{
+  if (!header)
+  {
+    return;
+  }
+  header->futex.fetch_add(1, std::memory_order_seq_cst);
+  if (header->waiters.load(std::memory_order_seq_cst))
+  {
+    WBTV_shm_futex(&header->futex, FUTEX_WAKE, 0x7fffffff, 0);
+  }
+}
+
+void WBTVShmWriter::close()
+{
+  //Tell anyone still attached that nothing more is coming.
+  if (header)
+  {
+    header->closed.store(1, std::memory_order_seq_cst);
+    wake();
+  }
+  WBTVShmMap::close();
+}
+
+bool WBTVShmReader::open(const char *path, bool oldest)
+{
+  struct stat st;
+  int f;
+
+  close();
+  f = ::open(path, O_RDWR);
+  if (f < 0)
+  {
+    perror(path);
+    return false;
+  }
+  if (fstat(f, &st) < 0 || (size_t)st.st_size < WBTV_SHM_DATA + 256 || !map(f, st.st_size))
+  {
+    fprintf(stderr, "%s: not a WBTV ring\n", path);
+    ::close(f);
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->magic != WBTV_SHM_MAGIC || header->version != WBTV_SHM_VERSION || WBTV_SHM_DATA + header->capacity > mapped)
+  {
+    fprintf(stderr, "%s: not a WBTV ring, or a different version\n", path);
+    close();
+    return false;
+  }
+  pos = oldest ? header->tail.load(std::memory_order_acquire) : header->head.load(std::memory_order_acquire);
+  lost = 0;
+  return true;
+}
+
+void WBTVShmReader::addChannel(const uint8_t *channel, uint8_t channellen)
+{
+  channels.push_back(std::string((const char *)channel, channellen));
+}
+
+void WBTVShmReader::addChannel(const char *channel)
+{
+  channels.push_back(channel);
+}
+
+bool WBTVShmReader::wanted(const uint8_t *channel, uint8_t channellen) const
+{
+  size_t i;
+  if (channels.empty())
+  {
+    return true;
+  }
+  for (i = 0; i < channels.size(); i++)
+  {
+    if (channels[i].size() == channellen && !memcmp(channels[i].data(), channel, channellen))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+int WBTVShmReader::next(WBTVShmMessage *msg)
+{
+  uint64_t capacity = header->capacity;
+
+  for (;;)
+  {
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    uint32_t size = 0;
+    bool sane;
+
+    if (pos == head)
+    {
+      return header->closed.load(std::memory_order_acquire) ? WBTV_SHM_CLOSED : WBTV_SHM_EMPTY;
+    }
+    if (head - pos <= capacity)
+    {
+      copyOut(pos, &size, 4);
+    }
+    //Only a record that was overwritten while we looked at it can have a silly size
+    sane = (size >= WBTV_SHM_RECORD_HEADER) && (WBTV_shm_pad(size) <= head - pos);
+    if (sane)
+    {
+      record.resize(size);
+      copyOut(pos, &record[0], size);
+    }
+
+    //If the writer got to any of it while we were copying, the copy can't be trusted.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!sane || header->writeEnd.load(std::memory_order_relaxed) - pos > capacity)
+    {
+      uint64_t tail = header->tail.load(std::memory_order_acquire);
+      if (tail < pos)
+      {
+        tail = header->head.load(std::memory_order_acquire);
+      }
+      lost += tail - pos;
+      pos = tail;
+      return WBTV_SHM_OVERRUN;
+    }
+    pos += WBTV_shm_pad(size);
+
+    msg->channellen = record[6];
+    if ((uint32_t)WBTV_SHM_RECORD_HEADER + msg->channellen > size)
+    {
+      continue;
+    }
+    msg->channel = &record[WBTV_SHM_RECORD_HEADER];
+    if (!wanted(msg->channel, msg->channellen))
+    {
+      continue;
+    }
+    memcpy(&msg->port, &record[4], 2);
+    memcpy(&msg->time, &record[8], 8);
+    msg->data = msg->channel + msg->channellen;
+    msg->datalen = size - WBTV_SHM_RECORD_HEADER - msg->channellen;
+    return WBTV_SHM_OK;
+  }
+}
+
+int WBTVShmReader::wait(WBTVShmMessage *msg, int timeout)
+{
+  struct timespec deadline, now, left;
+  int r;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while ((r = next(msg)) == WBTV_SHM_EMPTY)
+  {
+    uint32_t seen;
+
+    //Register first, then look again, so the writer either sees us waiting or we see what it wrote.
+    header->waiters.fetch_add(1, std::memory_order_seq_cst);
+    seen = header->futex.load(std::memory_order_seq_cst);
+    if (header->head.load(std::memory_order_seq_cst) == pos && !header->closed.load(std::memory_order_seq_cst))
+    {
+      if (timeout < 0)
+      {
+        WBTV_shm_futex(&header->futex, FUTEX_WAIT, seen, 0);
+      }
+      else
+      {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left.tv_sec = deadline.tv_sec - now.tv_sec;
+        left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (left.tv_nsec < 0)
+        {
+          left.tv_sec--;
+          left.tv_nsec += 1000000000L;
+        }
+        if (left.tv_sec < 0)
+        {
+          header->waiters.fetch_sub(1, std::memory_order_seq_cst);
+          return WBTV_SHM_EMPTY;
+        }
+        WBTV_shm_futex(&header->futex, FUTEX_WAIT, seen, &left);
+      }
+    }
+    header->waiters.fetch_sub(1, std::memory_order_seq_cst);
+  }
+  return r;
+}
+
+std::string WBTVShmReader::portName(uint16_t port) const
+{
+  if (!header || port >= WBTV_SHM_PORTS)
+  {
+    return "";
+  }
+  return std::string(header->ports[port], strnlen(header->ports[port], WBTV_SHM_PORT_NAME));
+}
@@ -0,0 +1,137 @@
+#ifndef _WBTV_HOST_SHMRING
+#define _WBTV_HOST_SHMRING
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+ *A broadcast ring of WBTV messages in a memory mapped file, so any number of local programs can follow
+ *the traffic wbtvd sees without going through sqlite.
+ *
+ *There is one writer. Readers never block it and never write anything but the waiter count, so a reader
+ *that falls behind just finds its place overwritten and is told how much it missed. Following the ring
+ *is plain loads from the mapping, the only syscall is the futex when a reader wants to sleep until
+ *something arrives.
+ *
+ *The file is a WBTVShmHeader followed by capacity bytes of records. Each record is a 16 byte header,
+ *size(everything, unpadded, 32 bits), port(16 bits), channel length(8 bits), flags(8 bits) and
+ *time in nanoseconds since the epoch(64 bits), then the channel, then the data, padded to 8 bytes.
+ *Records wrap around the end of the buffer. Positions count bytes since the ring was created and
+ *never wrap, the byte for a position is at position % capacity.
+ */
+
+#define WBTV_SHM_MAGIC 0x56544257u
+#define WBTV_SHM_VERSION 1
+#define WBTV_SHM_PORTS 16
+#define WBTV_SHM_PORT_NAME 48
+#define WBTV_SHM_RECORD_HEADER 16
+
+//What WBTVShmReader::next() found
+#define WBTV_SHM_OK 0
+#define WBTV_SHM_EMPTY 1
+//The reader fell behind and skipped ahead, WBTVShmReader::lost says how far
+#define WBTV_SHM_OVERRUN 2
+//The writer has gone away and everything it wrote has been read
+#define WBTV_SHM_CLOSED 3
+
+struct WBTVShmHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  //Where the next record goes. Everything before it is complete.
+  std::atomic<uint64_t> head;
+  //The oldest record that hasn't been overwritten
+  std::atomic<uint64_t> tail;
+  //The end of the record being written, which may already be trampling what's at writeEnd - capacity
+  std::atomic<uint64_t> writeEnd;
+  //Bumped whenever there is something new, and how many readers are asleep on it
+  std::atomic<uint32_t> futex;
+  std::atomic<uint32_t> waiters;
+  //Set when the writer shuts down
+  std::atomic<uint32_t> closed;
+  char ports[WBTV_SHM_PORTS][WBTV_SHM_PORT_NAME];
+};
+
+struct WBTVShmMessage
+{
+  uint64_t time;
+  uint16_t port;
+  const uint8_t *channel;
+  uint8_t channellen;
+  const uint8_t *data;
+  uint32_t datalen;
+};
+
+class WBTVShmMap
+{
+public:
+  WBTVShmMap() : header(0), ring(0), mapped(0), fd(-1) {}
+  ~WBTVShmMap() { close(); }
+  void close();
+
+protected:
+  bool map(int fd, size_t size);
+  //Copy len bytes from position pos, wrapping around the end
+  void copyOut(uint64_t pos, void *out, size_t len) const;
+
+  WBTVShmHeader *header;
+  uint8_t *ring;
+  size_t mapped;
+  int fd;
+};
+
+class WBTVShmWriter : public WBTVShmMap
+{
+public:
+  ~WBTVShmWriter() { close(); }
+  //Make a new ring at path, replacing whatever was there. capacity must be a power of two.
+  //Readers open it read/write to register as waiters, so mode is who may follow it: the owner and group by default.
+  bool create(const char *path, size_t capacity, mode_t mode = 0660);
+  void setPortName(uint16_t port, const char *name);
+  //Add a message. It is visible to readers as soon as this returns, but sleeping readers need wake().
+  bool append(uint64_t time, uint16_t port, const uint8_t *channel, uint8_t channellen, const uint8_t *data, uint32_t datalen);
+  //Wake any readers waiting. Costs a syscall only if someone is waiting.
+  void wake();
+  //Mark the ring closed, so readers know to stop waiting, and unmap it.
+  void close();
+
+private:
+  void copyIn(uint64_t pos, const void *in, size_t len);
+};
+
+class WBTVShmReader : public WBTVShmMap
+{
+public:
+  WBTVShmReader() : lost(0), pos(0) {}
+
+  //Attach to a ring. Reading starts at whatever comes next, or with everything still in the ring if oldest is set.
+  bool open(const char *path, bool oldest = false);
+
+  //Only return messages on these channels. With none added everything is returned.
+  void addChannel(const uint8_t *channel, uint8_t channellen);
+  void addChannel(const char *channel);
+
+  //The next message, without blocking. msg points into the reader and is good until the next call.
+  int next(WBTVShmMessage *msg);
+  //Like next(), but sleep up to timeout milliseconds(-1 for ever) for one to arrive.
+  int wait(WBTVShmMessage *msg, int timeout);
+
+  //Name of a port, from the writer
+  std::string portName(uint16_t port) const;
+
+  //Bytes of records skipped over because the writer lapped us
+  uint64_t lost;
+
+private:
+  bool wanted(const uint8_t *channel, uint8_t channellen) const;
+
+  uint64_t pos;
+  std::vector<uint8_t> record;
+  std::vector<std::string> channels;
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ *Follows the ring wbtvd writes with --ring and prints each message, as an example of using WBTVShmReader
+ *and a quick way to watch the bus.
+ *
+ *Usage: wbtv_listen [--oldest] [-c channel ...] [--count] [ring file, default /dev/shm/wbtv.ring]
+ *  --oldest  start with everything still in the ring instead of what comes next
+ *  -c        only show this channel, as many times as you like
+ *  --count   don't print messages, just a line a second of how many came in and how many were missed
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "WBTVShmRing.h"
+
+static void printMessage(const WBTVShmReader &reader, const WBTVShmMessage &m)
+{
+  uint32_t i;
+  time_t sec = m.time / 1000000000ULL;
+  struct tm t;
+
+  localtime_r(&sec, &t);
+  printf("%02d:%02d:%02d.%06lu %s %.*s ~ ", t.tm_hour, t.tm_min, t.tm_sec, (unsigned long)(m.time % 1000000000ULL) / 1000,
+         reader.portName(m.port).c_str(), (int)m.channellen, (const char *)m.channel);
+  //Printable text as is, anything else as hex escapes
+  for (i = 0; i < m.datalen; i++)
+  {
+    uint8_t c = m.data[i];
+    if (c >= 32 && c < 127 && c != '\\')
+    {
+      putchar(c);
+    }
+    else
+    {
+      printf("\\x%02x", c);
+    }
+  }
+  putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+  WBTVShmReader reader;
+  WBTVShmMessage m;
+  const char *path = "/dev/shm/wbtv.ring";
+  bool oldest = false, count = false;
+  unsigned long messages = 0;
+  uint64_t lastLost = 0;
+  time_t lastReport = time(0);
+  int a, r;
+
+  for (a = 1; a < argc; a++)
+  {
+    if (!strcmp(argv[a], "--oldest"))
+    {
+      oldest = true;
+    }
+    else if (!strcmp(argv[a], "--count"))
+    {
+      count = true;
+    }
+    else if (!strcmp(argv[a], "-c") && a + 1 < argc)
+    {
+      reader.addChannel(argv[++a]);
+    }
+    else if (argv[a][0] == '-')
+    {
+      fprintf(stderr, "usage: wbtv_listen [--oldest] [-c channel ...] [--count] [ring file]\n");
+      return 1;
+    }
+    else
+    {
+      path = argv[a];
+    }
+  }
+
+  if (!reader.open(path, oldest))
+  {
+    return 1;
+  }
+
+  while ((r = reader.wait(&m, count ? 1000 : -1)) != WBTV_SHM_CLOSED)
+  {
+    if (r == WBTV_SHM_OK)
+    {
+      messages++;
+      if (!count)
+      {
+        printMessage(reader, m);
+      }
+    }
+    else if (r == WBTV_SHM_OVERRUN && !count)
+    {
+      printf("-- fell behind, %llu bytes of messages missed\n", (unsigned long long)(reader.lost - lastLost));
+      lastLost = reader.lost;
+    }
+    if (count && time(0) != lastReport)
+    {
+      printf("%lu messages, %llu bytes missed\n", messages, (unsigned long long)(reader.lost - lastLost));
+      fflush(stdout);
+      messages = 0;
+      lastLost = reader.lost;
+      lastReport = time(0);
+    }
+    else if (!count)
+    {
+      fflush(stdout);
+    }
+  }
+  if (count)
+  {
+    printf("%lu messages, %llu bytes missed\n", messages, (unsigned long long)(reader.lost - lastLost));
+  }
+  printf("-- ring closed\n");
+  return 0;
+}
@@ -0,0 +1,363 @@
+/*
+ *Throughput and latency of a wired-OR bus full of WBTVNodes, under whatever load you like.
+ *
+ *Every node sends fixed size messages on channel LOAD at random (Poisson) times, with the total
+ *offered load given as a fraction of what the line can carry. A monitor node on the same bus
+ *picks them up and works out how long each one took from sendMessage() to arriving.
+ *
+ *Usage: wbtv_sim [--nodes 30] [--baud 9600] [--load 0.3] [--sweep] [--seconds 10]
+ *                [--payload 8] [--poll 20] [--min-backoff us] [--max-backoff us] [--seed 1]
+ *                [--urgent 0] [--priority-window 0] [--echo-window 1] [--rx-delay 0]
+ *
+ *--poll is how often, in microseconds, each node's loop gets round to calling service().
+ *The backoff defaults are the library's 1100/1200 scaled to the baud rate.
+ *--sweep runs a range of loads instead of just one.
+ *--urgent adds that many WBTV_PRIORITY_URGENT messages a second on channel STOP, spread over all the nodes,
+ *on top of the load, and reports their latency on a line of its own. --priority-window sets PRIORITY_WINDOW
+ *on every node, which is what gives them their own arbitration window.
+ *--echo-window sets ECHO_WINDOW on every node, how many bytes each keeps in flight before it has heard them back.
+ *--rx-delay is how many microseconds the line takes to reach the UARTs, as through a CAN transceiver or an isolator.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "WBTVNode.h"
+#include "BusSim.h"
+
+struct Options
+{
+  unsigned int nodes;
+  unsigned long baud;
+  double load;
+  bool sweep;
+  double seconds;
+  unsigned int payload;
+  double poll;
+  long minBackoff;
+  long maxBackoff;
+  uint64_t seed;
+  double urgent;
+  long priorityWindow;
+  unsigned int echoWindow;
+  double rxDelay;
+};
+
+//Everything about one class of traffic
+struct Results
+{
+  unsigned long offered;
+  unsigned long rejected;
+  unsigned long delivered;
+  unsigned long duplicates;
+  unsigned long payloadBytes;
+  std::vector<double> latencies;
+  std::unordered_map<uint32_t, uint64_t> inFlight;
+  WBTVBusSim *bus;
+  const char *channel;
+  unsigned char priority;
+  unsigned int payload;
+};
+
+static uint64_t rng_state;
+
+static double uniform()
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t exponential(double mean)
+{
+  return (uint64_t)(-log(1.0 - uniform()) * mean);
+}
+
+static void onLoad(unsigned char *channel, unsigned char clen, unsigned char *data, unsigned char dlen, void *userdata)
+{
+  Results *r = (Results *)userdata;
+  uint32_t key;
+
+  if (dlen < 3)
+  {
+    return;
+  }
+  key = ((uint32_t)data[0] << 16) | data[1] | ((uint32_t)data[2] << 8);
+  std::unordered_map<uint32_t, uint64_t>::iterator it = r->inFlight.find(key);
+  if (it == r->inFlight.end())
+  {
+    r->duplicates++;
+    return;
+  }
+  r->latencies.push_back((r->bus->now() - it->second) / 1000.0);
+  r->inFlight.erase(it);
+  r->delivered++;
+  r->payloadBytes += dlen;
+}
+
+//One node's stream of messages of one class
+struct Sender
+{
+  WBTVNode *node;
+  unsigned char id;
+  uint16_t seq;
+  double meanGap;
+  Results *results;
+};
+
+static void arrival(WBTVBusSim *bus, Sender *s, uint64_t stop)
+{
+  Results *r = s->results;
+  unsigned char data[255];
+
+  memset(data, 'x', sizeof(data));
+  data[0] = s->id;
+  data[1] = s->seq & 0xff;
+  data[2] = s->seq >> 8;
+
+  r->offered++;
+  if (s->node->sendMessage((const unsigned char *)r->channel, strlen(r->channel), data, r->payload, r->priority))
+  {
+    r->inFlight[((uint32_t)s->id << 16) | s->seq] = bus->now();
+    s->seq++;
+  }
+  else
+  {
+    r->rejected++;
+  }
+
+  uint64_t next = bus->now() + exponential(s->meanGap);
+  if (next < stop)
+  {
+    bus->schedule(next, [bus, s, stop]() { arrival(bus, s, stop); });
+  }
+}
+
+static void startSender(WBTVBusSim *bus, Sender *s, uint64_t stop)
+{
+  bus->schedule(exponential(s->meanGap), [bus, s, stop]() { arrival(bus, s, stop); });
+}
+
+static void initResults(Results &r, WBTVBusSim *bus, const char *channel, unsigned char priority, unsigned int payload)
+{
+  r.offered = r.rejected = r.delivered = r.duplicates = r.payloadBytes = 0;
+  r.bus = bus;
+  r.channel = channel;
+  r.priority = priority;
+  r.payload = payload;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+  size_t i;
+  if (v.empty())
+  {
+    return 0;
+  }
+  i = (size_t)(p * (v.size() - 1) + 0.5);
+  return v[i];
+}
+
+static void simulate(const Options &o, double load, bool header)
+{
+  WBTVBusSim bus(o.baud);
+  bus.rxDelay = (uint64_t)(o.rxDelay * 1000);
+  Results r, urgent;
+  std::vector<WBTVBusPort *> ports;
+  std::vector<WBTVNode *> nodes;
+  std::vector<Sender> senders(o.nodes);
+  std::vector<Sender> urgentSenders(o.nodes);
+  unsigned long attempts = 0, overruns = 0;
+  unsigned int i;
+
+  initResults(r, &bus, "LOAD", WBTV_PRIORITY_DEFAULT, o.payload);
+  initResults(urgent, &bus, "STOP", WBTV_PRIORITY_URGENT, 3);
+
+  //Start, channel, ~, data, two checksum bytes and the end
+  double frameBytes = 1 + 4 + 1 + o.payload + 2 + 1;
+  double framesPerSecond = load * (o.baud / 10.0) / frameBytes;
+  uint64_t stop = (uint64_t)(o.seconds * 1e9);
+
+  WBTVBusPort *monitorPort = bus.addPort();
+  WBTVNode monitor(monitorPort);
+  monitor.stringSubscribe("LOAD", &onLoad, &r);
+  monitor.stringSubscribe("STOP", &onLoad, &urgent);
+  bus.attach(monitorPort, &monitor, 0);
+
+  for (i = 0; i < o.nodes; i++)
+  {
+    WBTVBusPort *port = bus.addPort();
+    WBTVNode *node = new WBTVNode(port, port->pin());
+    node->MIN_BACKOFF = o.minBackoff;
+    node->MAX_BACKOFF = o.maxBackoff;
+    node->PRIORITY_WINDOW = o.priorityWindow;
+    node->ECHO_WINDOW = o.echoWindow;
+    ports.push_back(port);
+    nodes.push_back(node);
+
+    //No two MCUs run their loop at quite the same rate
+    uint64_t poll = (uint64_t)(o.poll * 1000 * (0.9 + 0.2 * uniform()));
+    bus.attach(port, node, poll, (uint64_t)(uniform() * poll));
+
+    senders[i].node = node;
+    senders[i].id = i;
+    senders[i].seq = 0;
+    senders[i].meanGap = 1e9 * o.nodes / framesPerSecond;
+    senders[i].results = &r;
+    startSender(&bus, &senders[i], stop);
+
+    if (o.urgent > 0)
+    {
+      urgentSenders[i] = senders[i];
+      urgentSenders[i].meanGap = 1e9 * o.nodes / o.urgent;
+      urgentSenders[i].results = &urgent;
+      startSender(&bus, &urgentSenders[i], stop);
+    }
+  }
+
+  //Stop offering at the end, then give the queues a second to empty
+  bus.run(stop + 1000000000ull);
+
+  for (i = 0; i < o.nodes; i++)
+  {
+    attempts += ports[i]->frameStarts;
+    overruns += ports[i]->overruns;
+    delete nodes[i];
+  }
+  overruns += monitorPort->overruns;
+
+  std::sort(r.latencies.begin(), r.latencies.end());
+  std::sort(urgent.latencies.begin(), urgent.latencies.end());
+  unsigned long delivered = r.delivered + urgent.delivered;
+
+  if (header)
+  {
+    printf("%6s %9s %9s %7s %7s %8s %8s %8s %9s %9s %9s %9s %6s\n",
+           "load", "goodput", "payload", "sent", "lost", "attempts", "collide", "retries",
+           "p50 ms", "p90 ms", "p99 ms", "max ms", "overr");
+  }
+  double seconds = o.seconds + 1;
+  double capacity = o.baud / 10.0;
+  printf("%6.2f %8.1f%% %7.0fB/s %7lu %7lu %8lu %7.1f%% %8.2f %9.2f %9.2f %9.2f %9.2f %6lu\n",
+         load,
+         100.0 * r.delivered * frameBytes / (capacity * seconds),
+         r.payloadBytes / seconds,
+         r.delivered,
+         r.rejected + r.inFlight.size(),
+         attempts,
+         attempts ? 100.0 * (attempts - delivered) / attempts : 0.0,
+         delivered ? (double)(attempts - delivered) / delivered : 0.0,
+         percentile(r.latencies, 0.5) / 1000,
+         percentile(r.latencies, 0.9) / 1000,
+         percentile(r.latencies, 0.99) / 1000,
+         r.latencies.empty() ? 0.0 : r.latencies.back() / 1000,
+         overruns);
+  if (o.urgent > 0)
+  {
+    printf("%6s %9s %9s %7lu %7lu %8s %8s %8s %9.2f %9.2f %9.2f %9.2f\n",
+           "urgent", "", "",
+           urgent.delivered,
+           urgent.rejected + urgent.inFlight.size(),
+           "", "", "",
+           percentile(urgent.latencies, 0.5) / 1000,
+           percentile(urgent.latencies, 0.9) / 1000,
+           percentile(urgent.latencies, 0.99) / 1000,
+           urgent.latencies.empty() ? 0.0 : urgent.latencies.back() / 1000);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Options o;
+  int i;
+
+  o.nodes = 30;
+  o.baud = 9600;
+  o.load = 0.3;
+  o.sweep = false;
+  o.seconds = 10;
+  o.payload = 8;
+  o.poll = 20;
+  o.minBackoff = -1;
+  o.maxBackoff = -1;
+  o.seed = 1;
+  o.urgent = 0;
+  o.priorityWindow = 0;
+  o.echoWindow = 1;
+  o.rxDelay = 0;
+
+  for (i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc) ? argv[i + 1] : "";
+    if (!strcmp(arg, "--sweep"))
+    {
+      o.sweep = true;
+      continue;
+    }
+    if (!strcmp(arg, "--nodes")) o.nodes = atoi(val);
+    else if (!strcmp(arg, "--baud")) o.baud = atol(val);
+    else if (!strcmp(arg, "--load")) o.load = atof(val);
+    else if (!strcmp(arg, "--seconds")) o.seconds = atof(val);
+    else if (!strcmp(arg, "--payload")) o.payload = atoi(val);
+    else if (!strcmp(arg, "--poll")) o.poll = atof(val);
+    else if (!strcmp(arg, "--min-backoff")) o.minBackoff = atol(val);
+    else if (!strcmp(arg, "--max-backoff")) o.maxBackoff = atol(val);
+    else if (!strcmp(arg, "--seed")) o.seed = strtoull(val, 0, 10);
+    else if (!strcmp(arg, "--urgent")) o.urgent = atof(val);
+    else if (!strcmp(arg, "--priority-window")) o.priorityWindow = atol(val);
+    else if (!strcmp(arg, "--echo-window")) o.echoWindow = atoi(val);
+    else if (!strcmp(arg, "--rx-delay")) o.rxDelay = atof(val);
+    else
+    {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return 1;
+    }
+    i++;
+  }
+
+  if (o.nodes < 1 || o.nodes > 250 || o.baud < 300 || o.payload < 3 || o.payload > WBTV_MAX_MESSAGE - 7)
+  {
+    fprintf(stderr, "need 1-250 nodes, a real baud rate, and a payload of 3-%d bytes\n", WBTV_MAX_MESSAGE - 7);
+    return 1;
+  }
+  if (o.minBackoff < 0)
+  {
+    o.minBackoff = 1100L * 9600 / o.baud;
+  }
+  if (o.maxBackoff < 0)
+  {
+    o.maxBackoff = 1200L * 9600 / o.baud;
+  }
+
+  printf("%u nodes, %lu baud, %u byte payload, backoff %ld-%ldus, service() every %.0fus\n",
+         o.nodes, o.baud, o.payload, o.minBackoff, o.maxBackoff, o.poll);
+  if ((o.echoWindow != 1) || (o.rxDelay > 0))
+  {
+    printf("%u bytes in flight at a time, %.0fus from the line to the UARTs\n", o.echoWindow, o.rxDelay);
+  }
+  if (o.urgent > 0)
+  {
+    printf("plus %.1f urgent messages a second, priority window %ldus\n", o.urgent, o.priorityWindow);
+  }
+  printf("goodput is frames delivered as a share of the line, lost is refused by a full queue or never delivered\n\n");
+
+  rng_state = o.seed * 0x9E3779B97F4A7C15ull + 1;
+  if (o.sweep)
+  {
+    static const double loads[] = {0.05, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.8, 1.0, 1.5};
+    for (i = 0; i < (int)(sizeof(loads) / sizeof(loads[0])); i++)
+    {
+      simulate(o, loads[i], i == 0);
+    }
+  }
+  else
+  {
+    simulate(o, o.load, true);
+  }
+  return 0;
+}
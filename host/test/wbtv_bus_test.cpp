@@ -0,0 +1,229 @@
+/*
+ *Checks of the transmit engine on a simulated wired-OR bus: backing off while someone else is sending,
+ *getting out of a collision, what happens when the queue is full, and coalescing.
+ *
+ *A monitor node that never sends counts every frame that makes it onto the bus, and each case
+ *checks every frame that should get there gets there exactly once. Run by ctest, and exits nonzero on a failure.
+ *
+ *Usage: wbtv_bus_test
+ */
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "WBTVNode.h"
+#include "BusSim.h"
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static void check(bool ok, const char *what, const char *file, int line)
+{
+  if (!ok)
+  {
+    printf("%s:%d: failed: %s\n", file, line, what);
+    failures++;
+  }
+}
+
+//Everything the monitor heard, as channel=data, in order
+static std::vector<std::string> heard;
+
+static void onFrame(unsigned char *channel, unsigned char channellen, unsigned char *data, unsigned char datalen)
+{
+  heard.push_back(std::string((char *)channel, channellen) + "=" + std::string((char *)data, datalen));
+}
+
+static unsigned int count(const std::string &frame)
+{
+  unsigned int i, n = 0;
+
+  for (i = 0; i < heard.size(); i++)
+  {
+    n += (heard[i] == frame) ? 1 : 0;
+  }
+  return n;
+}
+
+static int position(const std::string &frame)
+{
+  unsigned int i;
+
+  for (i = 0; i < heard.size(); i++)
+  {
+    if (heard[i] == frame)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+//A 9600 baud bus with a monitor and two sending nodes, all servicing every 20us
+struct Bus
+{
+  WBTVBusSim sim;
+  WBTVBusPort *monitorPort, *portA, *portB;
+  WBTVNode monitor, a, b;
+
+  Bus() : sim(9600), monitorPort(sim.addPort()), portA(sim.addPort()), portB(sim.addPort()),
+          monitor(monitorPort), a(portA, portA->pin()), b(portB, portB->pin())
+  {
+    heard.clear();
+    monitor.setBinaryCallback(&onFrame);
+    sim.attach(monitorPort, &monitor, 0);
+    sim.attach(portA, &a, 20000);
+    sim.attach(portB, &b, 20000);
+  }
+};
+
+static const uint64_t ms = 1000000;
+
+//Both nodes start at exactly the same moment with different first bytes, so they have to collide.
+static void collision()
+{
+  Bus bus;
+
+  bus.a.MIN_BACKOFF = bus.a.MAX_BACKOFF = 500;
+  bus.b.MIN_BACKOFF = bus.b.MAX_BACKOFF = 500;
+  bus.sim.schedule(1 * ms, [&bus]()
+  {
+    CHECK(bus.a.stringSendMessage("A", "from a"));
+    CHECK(bus.b.stringSendMessage("B", "from b"));
+    //Both are now waiting exactly 500us. Give the retries some room to come apart.
+    bus.a.MAX_BACKOFF = bus.b.MAX_BACKOFF = 3000;
+  });
+  bus.sim.run(1000 * ms);
+
+  CHECK(bus.a.stats()->collisions >= 1);
+  CHECK(bus.b.stats()->collisions >= 1);
+  CHECK(bus.a.stats()->retries >= 1);
+  CHECK(bus.b.stats()->retries >= 1);
+  CHECK(bus.sim.collidedBytes > 0);
+  CHECK(count("A=from a") == 1);
+  CHECK(count("B=from b") == 1);
+  CHECK(bus.a.stats()->txFrames == 1);
+  CHECK(bus.b.stats()->txFrames == 1);
+  CHECK(bus.a.queueSpace() == WBTV_TX_QUEUE);
+  CHECK(bus.b.queueSpace() == WBTV_TX_QUEUE);
+}
+
+//b wants to send while a's frame is on the line, so it has to wait for it to finish.
+static void backoff()
+{
+  Bus bus;
+
+  bus.a.MIN_BACKOFF = bus.a.MAX_BACKOFF = 500;
+  bus.sim.schedule(1 * ms, [&bus]()
+  {
+    CHECK(bus.a.stringSendMessage("LONG", "a frame that takes a good while to send"));
+  });
+  //Well into a's frame, which is about 50 bytes or 50ms at 9600 baud
+  bus.sim.schedule(10 * ms, [&bus]()
+  {
+    CHECK(bus.b.stringSendMessage("LATE", "b"));
+  });
+  bus.sim.run(1000 * ms);
+
+  CHECK(bus.a.stats()->collisions == 0);
+  CHECK(bus.b.stats()->collisions == 0);
+  CHECK(bus.sim.collidedBytes == 0);
+  CHECK(count("LONG=a frame that takes a good while to send") == 1);
+  CHECK(count("LATE=b") == 1);
+  CHECK(position("LONG=a frame that takes a good while to send") < position("LATE=b"));
+}
+
+//With the queue full the same priority is turned away, and a higher one pushes the last one out.
+static void eviction()
+{
+  Bus bus;
+  WBTV_tx_handle first = 0, second = 0, refused = 1, urgent = 0;
+
+  bus.sim.schedule(1 * ms, [&]()
+  {
+    first = bus.a.stringSendMessage("Q", "1");
+    second = bus.a.stringSendMessage("Q", "2");
+    CHECK(bus.a.queueSpace() == 0);
+    refused = bus.a.stringSendMessage("Q", "3");
+    urgent = bus.a.sendMessage((const unsigned char *)"U", 1, (const unsigned char *)"!", 1, WBTV_PRIORITY_URGENT);
+    CHECK(!bus.a.isSending(second));
+  });
+  bus.sim.run(1000 * ms);
+
+  CHECK(first && second && urgent);
+  CHECK(!refused);
+  CHECK(count("Q=1") == 1);
+  CHECK(count("Q=2") == 0);
+  CHECK(count("Q=3") == 0);
+  CHECK(count("U=!") == 1);
+  CHECK(heard.size() == 2);
+  CHECK(!bus.a.isSending(first) && !bus.a.isSending(urgent));
+}
+
+//A coalesced frame is a new frame: it takes its new priority and place in the queue, and starts over.
+static void coalesce()
+{
+  Bus bus;
+  WBTV_tx_handle stale = 0, fresh = 0;
+
+  CHECK(bus.a.stringSetChannelPriority("C", WBTV_PRIORITY_LOW, WBTV_COALESCE));
+  //b is already sending when a's frames are queued, so they are all still waiting when the second C comes along
+  bus.sim.schedule(1 * ms, [&bus]()
+  {
+    CHECK(bus.b.stringSendMessage("BUSY", "b is on the line for a while"));
+  });
+  bus.sim.schedule(5 * ms, [&]()
+  {
+    stale = bus.a.stringSendMessage("C", "old");
+    CHECK(bus.a.stringSendMessage("N", "normal"));
+    fresh = bus.a.sendMessage((const unsigned char *)"C", 1, (const unsigned char *)"new", 3, WBTV_PRIORITY_URGENT);
+    CHECK(bus.a.queueSpace() == WBTV_TX_QUEUE - 2);
+  });
+  bus.sim.run(1000 * ms);
+
+  CHECK(stale && fresh && (stale != fresh));
+  CHECK(count("C=old") == 0);
+  CHECK(count("C=new") == 1);
+  CHECK(count("N=normal") == 1);
+  CHECK((position("C=new") >= 0) && (position("C=new") < position("N=normal")));
+  CHECK(bus.a.stats()->retries == 0);
+
+  //Replacing a frame that collided and is waiting to try again isn't a retry of the new one
+  Bus again;
+  CHECK(again.a.stringSetChannelPriority("C", WBTV_PRIORITY_NORMAL, WBTV_COALESCE));
+  again.a.MIN_BACKOFF = again.a.MAX_BACKOFF = 500;
+  again.b.MIN_BACKOFF = again.b.MAX_BACKOFF = 500;
+  again.sim.schedule(1 * ms, [&again]()
+  {
+    CHECK(again.a.stringSendMessage("C", "old"));
+    CHECK(again.b.stringSendMessage("B", "from b"));
+    again.a.MIN_BACKOFF = again.a.MAX_BACKOFF = 30000;
+  });
+  again.sim.schedule(5 * ms, [&again]()
+  {
+    CHECK(again.a.stats()->collisions == 1);
+    CHECK(again.a.stringSendMessage("C", "new"));
+  });
+  again.sim.run(1000 * ms);
+
+  CHECK(count("C=old") == 0);
+  CHECK(count("C=new") == 1);
+  CHECK(count("B=from b") == 1);
+  CHECK(again.a.stats()->retries == 0);
+}
+
+int main()
+{
+  collision();
+  backoff();
+  eviction();
+  coalesce();
+
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all bus checks ok\n");
+  return 0;
+}
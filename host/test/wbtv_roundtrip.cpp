@@ -0,0 +1,268 @@
+/*
+ *Round trip checks for the ways a node can send a frame.
+ *
+ *Each case sends something from one node, hands everything it wrote to a second node with decodeBuffer(),
+ *and checks the second node got the same channel and data back. Run by ctest, and exits nonzero
+ *if anything didn't come back the way it went.
+ *
+ *Usage: wbtv_roundtrip
+ */
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "WBTVNode.h"
+#include "MemoryStream.h"
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static void check(bool ok, const char *what, const char *file, int line)
+{
+  if (!ok)
+  {
+    printf("%s:%d: failed: %s\n", file, line, what);
+    failures++;
+  }
+}
+
+//What the reciever got
+struct Frame
+{
+  std::string channel;
+  std::vector<std::string> segments;
+};
+
+static std::vector<Frame> frames;
+
+static void onSegments(unsigned char *channel, unsigned char channellen, const struct WBTV_segments *segments)
+{
+  Frame f;
+  unsigned char i;
+
+  f.channel.assign((char *)channel, channellen);
+  for (i = 0; i < segments->count; i++)
+  {
+    f.segments.push_back(std::string((char *)segments->segment(i), segments->length(i)));
+  }
+  frames.push_back(f);
+}
+
+//Two nodes, and whatever a has written goes to b
+struct Link
+{
+  WBTVMemoryStream sa, sb;
+  WBTVNode a, b;
+
+  Link() : a(&sa), b(&sb)
+  {
+    frames.clear();
+    b.setSegmentCallback(&onSegments);
+  }
+
+  void deliver()
+  {
+    a.serviceAll();
+    b.decodeBuffer(sa.tx().data(), sa.tx().size());
+    sa.clearTx();
+  }
+
+  unsigned long wireBytes()
+  {
+    a.serviceAll();
+    return sa.tx().size();
+  }
+};
+
+static std::string bytes(const unsigned char *data, unsigned int len)
+{
+  return std::string((const char *)data, len);
+}
+
+//Binary data with every control character in it, so escaping and XOR framing get a work out
+static void controlData(unsigned char *data, unsigned int len)
+{
+  unsigned int i;
+
+  for (i = 0; i < len; i++)
+  {
+    data[i] = (i & 1) ? "!~\n\\"[(i >> 1) & 3] : (unsigned char)(i * 37);
+  }
+}
+
+static void plain()
+{
+  Link link;
+  unsigned char data[WBTV_MAX_MESSAGE];
+
+  CHECK(link.a.stringSendMessage("LED", "1"));
+  link.deliver();
+  CHECK(frames.size() == 1);
+  CHECK(frames.size() && (frames[0].channel == "LED") && (frames[0].segments.size() == 1) && (frames[0].segments[0] == "1"));
+
+  //Escaped channel and data, as long as a node can take
+  controlData(data, sizeof(data));
+  frames.clear();
+  CHECK(link.a.sendMessage((const unsigned char *)"a~b", 3, data, WBTV_MAX_MESSAGE - 6));
+  link.deliver();
+  CHECK(frames.size() == 1);
+  CHECK(frames.size() && (frames[0].channel == "a~b") && (frames[0].segments[0] == bytes(data, WBTV_MAX_MESSAGE - 6)));
+
+  //One more byte than that doesn't even get queued
+  CHECK(!link.a.sendMessage((const unsigned char *)"a~b", 3, data, WBTV_MAX_MESSAGE - 5));
+}
+
+static void segmented()
+{
+  Link link;
+  const char *parts[3] = {"21.5", "", "C~!"};
+
+  CHECK(link.a.stringSendMessage("TEMP", parts, 3));
+  link.deliver();
+  CHECK(frames.size() == 1);
+  CHECK(frames.size() && (frames[0].channel == "TEMP") && (frames[0].segments.size() == 3));
+  CHECK(frames.size() && (frames[0].segments.size() == 3) && (frames[0].segments[0] == "21.5") &&
+        frames[0].segments[1].empty() && (frames[0].segments[2] == "C~!"));
+}
+
+static void gathered()
+{
+  Link link;
+  struct WBTV_piece pieces[3] = {{(const unsigned char *)"ab", 2}, {(const unsigned char *)"", 0}, {(const unsigned char *)"\n\\", 2}};
+
+  CHECK(link.a.sendMessage((const unsigned char *)"G", 1, pieces, 3));
+  link.deliver();
+  CHECK(frames.size() && (frames[0].channel == "G") && (frames[0].segments.size() == 1) && (frames[0].segments[0] == "ab\n\\"));
+}
+
+#ifdef WBTV_XOR_FRAMING
+static void xorFramed()
+{
+  Link link, escaped;
+  unsigned char data[40];
+  const unsigned char *segments[2] = {data, data + 10};
+  const unsigned char lengths[2] = {10, 30};
+
+  controlData(data, sizeof(data));
+  CHECK(link.a.stringSetChannelPriority("BIN", WBTV_PRIORITY_NORMAL, WBTV_XOR_FRAMED));
+  CHECK(link.a.sendMessage((const unsigned char *)"BIN", 3, data, sizeof(data)));
+  CHECK(escaped.a.sendMessage((const unsigned char *)"BIN", 3, data, sizeof(data)));
+  //It has to have actually been XOR framed, or this proves nothing
+  CHECK(link.sa.tx().size() > 3);
+  CHECK((link.sa.tx()[1] == WBTV_STX) && (link.sa.tx()[2] == WBTV_STX));
+  CHECK(link.wireBytes() < escaped.wireBytes());
+  link.deliver();
+  CHECK(frames.size() == 1);
+  CHECK(frames.size() && (frames[0].channel == "BIN") && (frames[0].segments[0] == bytes(data, sizeof(data))));
+
+  frames.clear();
+  CHECK(link.a.sendMessage((const unsigned char *)"BIN", 3, segments, lengths, 2));
+  link.deliver();
+  CHECK(frames.size() && (frames[0].segments.size() == 2) && (frames[0].segments[0] == bytes(data, 10)) &&
+        (frames[0].segments[1] == bytes(data + 10, 30)));
+}
+#endif
+
+#ifdef WBTV_CHANNEL_ALIASES
+static int aliasHits;
+
+static void onAliased(unsigned char *channel, unsigned char channellen, unsigned char *data, unsigned char datalen, void *userdata)
+{
+  if ((bytes(channel, channellen) == "SENS/ROOM1/TEMP") && (bytes(data, datalen) == "21.5"))
+  {
+    aliasHits++;
+  }
+}
+
+static void aliased()
+{
+  Link link, named;
+
+  aliasHits = 0;
+  CHECK(link.b.stringSubscribe("SENS/ROOM1/TEMP", &onAliased, 0));
+  CHECK(link.a.stringSetChannelAlias("SENS/ROOM1/TEMP", 7));
+  CHECK(link.a.announceAliases());
+  link.deliver();
+
+  CHECK(link.a.stringSendMessage("SENS/ROOM1/TEMP", "21.5"));
+  CHECK(named.a.stringSendMessage("SENS/ROOM1/TEMP", "21.5"));
+  //The alias has to have been used in place of the name
+  CHECK(link.wireBytes() < named.wireBytes());
+  link.deliver();
+  CHECK(aliasHits == 1);
+}
+#endif
+
+static std::string reassembled;
+
+static void onReassembled(unsigned char *channel, unsigned char channellen, unsigned char *data, unsigned int datalen, void *userdata)
+{
+  reassembled = bytes(channel, channellen) + "=" + bytes(data, datalen);
+}
+
+static void fragmented()
+{
+  Link link;
+  WBTVFragmenter fragmenter(&link.a);
+  unsigned char payload[500], buffer[600];
+  WBTVReassembler reassembler(buffer, sizeof(buffer), &onReassembled, 0);
+  unsigned int guard = 0;
+
+  controlData(payload, sizeof(payload));
+  reassembled.clear();
+  CHECK(reassembler.stringSubscribe(&link.b, "FW"));
+  CHECK(fragmenter.stringSend("FW", payload, sizeof(payload)));
+  while (fragmenter.isSending() && (guard++ < 1000))
+  {
+    fragmenter.service();
+    link.deliver();
+  }
+  CHECK(!fragmenter.isSending());
+  CHECK(reassembled == "FW=" + bytes(payload, sizeof(payload)));
+  CHECK(reassembler.dropped == 0);
+}
+
+static void layout()
+{
+  typedef WBTVLayout<int64_t, float, uint16_t, uint8_t> Reading;
+  Link link;
+
+  CHECK(link.a.stringPublish<Reading>("READ", (int64_t)-1700000000123ll, 21.5f, (uint16_t)0x7e21, (uint8_t)'\n'));
+  link.deliver();
+  CHECK(frames.size() == 1);
+  if (frames.size())
+  {
+    WBTVView<Reading> r((const unsigned char *)frames[0].segments[0].data(), frames[0].segments[0].size());
+    CHECK(frames[0].channel == "READ");
+    CHECK(frames[0].segments[0].size() == Reading::size);
+    CHECK(r.valid());
+    CHECK(r.get<0>() == -1700000000123ll);
+    CHECK(r.get<1>() == 21.5f);
+    CHECK(r.get<2>() == 0x7e21);
+    CHECK(r.get<3>() == '\n');
+  }
+}
+
+int main()
+{
+  plain();
+  segmented();
+  gathered();
+  #ifdef WBTV_XOR_FRAMING
+  xorFramed();
+  #endif
+  #ifdef WBTV_CHANNEL_ALIASES
+  aliased();
+  #endif
+  fragmented();
+  layout();
+
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all round trips ok\n");
+  return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ *Turns TRACE dumps into a timeline and a breakdown of how long each stage took.
+ *
+ *Input is the raw bytes off the bus or serial port, with TRACE messages in among anything else,
+ *for instance what `cat /dev/ttyUSB0 > dump` catches while a node is asked for its trace with an empty TRACE message.
+ *Only one node should be dumping at a time, the messages don't say which node they came from.
+ *
+ *Usage: wbtv_trace [--quiet] [capture file, default stdin]
+ *  --quiet  leave out the timeline and only print the breakdown
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include "WBTVNode.h"
+#include "MemoryStream.h"
+
+struct Event
+{
+  uint8_t id;
+  uint32_t time;
+  //Entries lost just before this one
+  uint8_t lost;
+};
+
+struct Stage
+{
+  const char *name;
+  uint8_t from;
+  uint8_t to;
+};
+
+//Every stage is the time from one event to the next matching one.
+static const Stage stages[] =
+{
+  {"sendMessage()", WBTV_EV_SEND, WBTV_EV_QUEUED},
+  {"backoff", WBTV_EV_BACKOFF, WBTV_EV_TX_START},
+  {"transmit", WBTV_EV_TX_START, WBTV_EV_TX_DONE},
+  {"lost attempt", WBTV_EV_TX_START, WBTV_EV_COLLIDE},
+  {"rx header", WBTV_EV_RX_START, WBTV_EV_RX_HEADER},
+  {"rx data", WBTV_EV_RX_HEADER, WBTV_EV_RX_END},
+  {"checksum", WBTV_EV_RX_END, WBTV_EV_DISPATCH},
+  {"bad checksum", WBTV_EV_RX_END, WBTV_EV_RX_BAD},
+  {"callback", WBTV_EV_DISPATCH, WBTV_EV_HANDLED},
+};
+#define STAGES (sizeof(stages) / sizeof(stages[0]))
+
+struct Totals
+{
+  unsigned long count;
+  uint32_t min, max;
+  double sum;
+};
+
+static std::vector<Event> events;
+
+static const char *eventName(uint8_t id)
+{
+  static char buf[16];
+  switch (id)
+  {
+  case WBTV_EV_SEND: return "SEND";
+  case WBTV_EV_QUEUED: return "QUEUED";
+  case WBTV_EV_BACKOFF: return "BACKOFF";
+  case WBTV_EV_TX_START: return "TX_START";
+  case WBTV_EV_COLLIDE: return "COLLIDE";
+  case WBTV_EV_TX_DONE: return "TX_DONE";
+  case WBTV_EV_RX_START: return "RX_START";
+  case WBTV_EV_RX_HEADER: return "RX_HEADER";
+  case WBTV_EV_RX_END: return "RX_END";
+  case WBTV_EV_DISPATCH: return "DISPATCH";
+  case WBTV_EV_HANDLED: return "HANDLED";
+  case WBTV_EV_RX_BAD: return "RX_BAD";
+  }
+  if (id >= WBTV_EV_USER)
+  {
+    snprintf(buf, sizeof(buf), "USER+%u", id - WBTV_EV_USER);
+  }
+  else
+  {
+    snprintf(buf, sizeof(buf), "?%u", id);
+  }
+  return buf;
+}
+
+static void onTrace(unsigned char *channel, unsigned char channellen, unsigned char *data, unsigned char datalen, void *userdata)
+{
+  unsigned char i;
+  Event ev;
+
+  //An empty one is the request, not a dump
+  if (!datalen)
+  {
+    return;
+  }
+  ev.lost = data[0];
+  for (i = 1; i + WBTV_TRACE_ENTRY <= datalen; i += WBTV_TRACE_ENTRY)
+  {
+    ev.id = data[i];
+    ev.time = data[i + 1] | ((uint32_t)data[i + 2] << 8) | ((uint32_t)data[i + 3] << 16) | ((uint32_t)data[i + 4] << 24);
+    events.push_back(ev);
+    ev.lost = 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = 0;
+  bool quiet = false;
+  FILE *f = stdin;
+  unsigned char buf[4096];
+  size_t n, i, s;
+  int a;
+
+  for (a = 1; a < argc; a++)
+  {
+    if (!strcmp(argv[a], "--quiet"))
+    {
+      quiet = true;
+    }
+    else
+    {
+      path = argv[a];
+    }
+  }
+  if (path && !(f = fopen(path, "rb")))
+  {
+    perror(path);
+    return 1;
+  }
+
+  //A full duplex node sees every byte in the capture and sorts out the frames for us.
+  WBTVMemoryStream port;
+  WBTVSizedNode<255> node(&port);
+  node.stringSubscribe("TRACE", &onTrace, 0);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+  {
+    node.decodeBuffer(buf, n);
+  }
+  if (f != stdin)
+  {
+    fclose(f);
+  }
+
+  if (events.empty())
+  {
+    fprintf(stderr, "No TRACE messages found\n");
+    return 1;
+  }
+
+  //Match each stage's end up with the latest start before it. A gap means nothing can be matched across it.
+  Totals totals[STAGES];
+  bool open[STAGES];
+  uint32_t since[STAGES];
+  memset(totals, 0, sizeof(totals));
+  memset(open, 0, sizeof(open));
+
+  if (!quiet)
+  {
+    printf("%12s %10s  %s\n", "micros", "+us", "event");
+  }
+  for (i = 0; i < events.size(); i++)
+  {
+    const Event &ev = events[i];
+    if (ev.lost)
+    {
+      memset(open, 0, sizeof(open));
+      if (!quiet)
+      {
+        printf("%12s %10s  (%u%s entries lost)\n", "", "", ev.lost, ev.lost == 255 ? " or more" : "");
+      }
+    }
+    if (!quiet)
+    {
+      printf("%12lu %10lu  %s\n", (unsigned long)ev.time, i && !ev.lost ? (unsigned long)(uint32_t)(ev.time - events[i - 1].time) : 0UL, eventName(ev.id));
+    }
+
+    for (s = 0; s < STAGES; s++)
+    {
+      if ((ev.id == stages[s].to) && open[s])
+      {
+        uint32_t d = ev.time - since[s];
+        if (!totals[s].count || d < totals[s].min)
+        {
+          totals[s].min = d;
+        }
+        if (d > totals[s].max)
+        {
+          totals[s].max = d;
+        }
+        totals[s].sum += d;
+        totals[s].count++;
+        open[s] = false;
+        //A start event can end one stage only, so a collision doesn't also count as a transmit.
+        for (size_t o = 0; o < STAGES; o++)
+        {
+          if (stages[o].from == stages[s].from)
+          {
+            open[o] = false;
+          }
+        }
+      }
+    }
+    for (s = 0; s < STAGES; s++)
+    {
+      if (ev.id == stages[s].from)
+      {
+        open[s] = true;
+        since[s] = ev.time;
+      }
+    }
+  }
+
+  printf("\n%-16s %8s %10s %10s %10s\n", "stage", "count", "min us", "mean us", "max us");
+  for (s = 0; s < STAGES; s++)
+  {
+    if (!totals[s].count)
+    {
+      continue;
+    }
+    printf("%-16s %8lu %10lu %10.1f %10lu\n", stages[s].name, totals[s].count, (unsigned long)totals[s].min,
+           totals[s].sum / totals[s].count, (unsigned long)totals[s].max);
+  }
+  return 0;
+}
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+Drives wbtvd over two pseudo-terminals, the way it would sit between two serial ports and a database.
+
+Checks that a frame written to a port lands in the message table, that a row inserted for one port goes out
+that port and not the other, and that when one port hangs up its row leaves the port table while the other
+port keeps working.
+
+Usage: test_wbtvd.py path/to/wbtvd
+Run by ctest. Exits nonzero and says why if anything doesn't happen within a few seconds.
+"""
+import os, pty, select, signal, sqlite3, subprocess, sys, tempfile, time
+
+TIMEOUT = 5
+
+def fletcher(data):
+    slow = fast = 0
+    for b in data:
+        slow = (slow + b) % 256
+        fast = (fast + slow) % 256
+    return bytes([slow, fast])
+
+def escape(data):
+    out = bytearray()
+    for b in data:
+        if b in b"!~\n\\":
+            out.append(ord("\\"))
+        out.append(b)
+    return bytes(out)
+
+def frame(channel, data):
+    return b"!" + escape(channel) + b"~" + escape(data) + escape(fletcher(channel + b"~" + data)) + b"\n"
+
+def frames(raw):
+    """Every good frame in raw as (channel, data). Frames that don't check out are left out."""
+    found, parts, esc = [], None, False
+    for b in raw:
+        if esc:
+            esc = False
+            if parts is not None:
+                parts[-1].append(b)
+        elif b == ord("\\"):
+            esc = True
+        elif b == ord("!"):
+            parts = [bytearray()]
+        elif parts is None:
+            continue
+        elif b == ord("~"):
+            parts.append(bytearray())
+        elif b == ord("\n"):
+            if len(parts) == 2 and len(parts[1]) >= 2:
+                channel, data, check = bytes(parts[0]), bytes(parts[1][:-2]), bytes(parts[1][-2:])
+                if fletcher(channel + b"~" + data) == check:
+                    found.append((channel, data))
+            parts = None
+        else:
+            parts[-1].append(b)
+    return found
+
+def fail(why, daemon=None):
+    print("FAILED: " + why)
+    if daemon:
+        daemon.kill()
+        print(daemon.stderr.read().decode(errors="replace"))
+    sys.exit(1)
+
+def waitFor(what, check, daemon):
+    end = time.time() + TIMEOUT
+    while time.time() < end:
+        result = check()
+        if result:
+            return result
+        time.sleep(0.02)
+    fail(what, daemon)
+
+def readFrames(master, seconds):
+    raw = b""
+    end = time.time() + seconds
+    while time.time() < end:
+        ready, _, _ = select.select([master], [], [], 0.02)
+        if ready:
+            raw += os.read(master, 4096)
+    return frames(raw)
+
+def main(tmp):
+    path = os.path.join(tmp, "wbtv.db")
+
+    masters, names = [], []
+    for i in range(2):
+        master, slave = pty.openpty()
+        masters.append(master)
+        names.append(os.ttyname(slave))
+        #wbtvd opens it by name, this copy would keep it from ever hanging up
+        os.close(slave)
+
+    daemon = subprocess.Popen([sys.argv[1], "-p", names[0], "-p", names[1], "-f", path, "--sync", "0", "--poll", "50"],
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    if daemon.stdout.readline().strip() != b"Listening":
+        fail("wbtvd didn't start", daemon)
+    db = sqlite3.connect(path, timeout=TIMEOUT)
+
+    def ports():
+        return sorted(r[0] for r in db.execute("SELECT name FROM port"))
+
+    if ports() != sorted(names):
+        fail("port table has %r, not both ptys" % ports(), daemon)
+
+    #Into the database
+    os.write(masters[0], frame(b"TEMP", b"21.5~!\n\\"))
+    row = waitFor("frame from the pty never reached the message table",
+                  lambda: db.execute("SELECT origin, destination, channel, data FROM message WHERE channel=?",
+                                     (b"TEMP",)).fetchone(), daemon)
+    if (row[0], row[1], bytes(row[3])) != (names[0], "localhost", b"21.5~!\n\\"):
+        fail("stored as %r" % (row,), daemon)
+
+    #Out of it, to just the one port
+    db.execute("INSERT INTO message(destination, channel, data) VALUES (?, ?, ?)", (names[1], b"LED", b"1"))
+    db.commit()
+    got = readFrames(masters[1], 1)
+    if got != [(b"LED", b"1")]:
+        fail("the addressed port got %r" % got, daemon)
+    got = readFrames(masters[0], 0.2)
+    if got:
+        fail("the other port got %r too" % got, daemon)
+
+    #One end goes away. Its row goes, and the other port carries on.
+    os.close(masters[0])
+    waitFor("the hung up port is still in the port table", lambda: ports() == [names[1]], daemon)
+    db.execute("INSERT INTO message(channel, data) VALUES (?, ?)", (b"ALL", b"2"))
+    db.commit()
+    got = readFrames(masters[1], 1)
+    if got != [(b"ALL", b"2")]:
+        fail("the port still up got %r after the other hung up" % got, daemon)
+    os.write(masters[1], frame(b"STILL", b"here"))
+    waitFor("frames stopped reaching the database after a port hung up",
+            lambda: db.execute("SELECT 1 FROM message WHERE channel=?", (b"STILL",)).fetchone(), daemon)
+
+    daemon.send_signal(signal.SIGTERM)
+    try:
+        daemon.wait(TIMEOUT)
+    except subprocess.TimeoutExpired:
+        fail("wbtvd didn't exit on SIGTERM", daemon)
+    errors = daemon.stderr.read().decode(errors="replace")
+    if daemon.returncode != 0 or "error" in errors.lower():
+        fail("wbtvd exited %d with:\n%s" % (daemon.returncode, errors))
+    if ports():
+        fail("port table still has %r after exit" % ports())
+    print("wbtvd ok")
+    return 0
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print(__doc__)
+        sys.exit(2)
+    with tempfile.TemporaryDirectory() as tmp:
+        sys.exit(main(tmp))
@@ -0,0 +1,802 @@
+/*
+ *WBTVD: bridges WBTV serial ports and a sqlite file. It does what python/wbtvd.py does, with the same tables,
+ *so anything reading or writing the database keeps working, but it decodes with WBTVNode itself and
+ *only wakes up when there is something to do.
+ *
+ *Every message that arrives on a port goes into the message table, with origin set to the port name and
+ *destination set to localhost. Insert a row with destination PORTS(the default), ALL or PORT to send it out
+ *every port, or with a port name for just that one:
+ *
+ *    INSERT INTO message(destination,channel,data) VALUES ("/dev/ttyACM0","LED","1")
+ *
+ *Each port is read as soon as epoll says there is data, everything that came in during one wakeup is
+ *inserted in a single transaction with a prepared statement, and new outgoing rows are found with a
+ *range scan on the message id, so the table is never scanned. Writes to the database by anyone else
+ *wake it up through inotify, with --poll as a fallback for filesystems where that doesn't work.
+ *The port table says which ports are served, with their traffic in bytes per second.
+ *
+ *With --ring every message that comes in is also written to a shared memory ring(see host/shm/WBTVShmRing.h),
+ *before it goes in the database, for programs that want to follow the bus without polling sqlite.
+ *With --capture everything is also kept in a capture directory(see host/capture/WBTVCapture.h), which
+ *unlike the database is never expired. --capture-raw keeps the bytes as they came off the port as well.
+ *
+ *Works on pseudo-terminals as well as real serial ports, which is handy for testing(see test_wbtvd.py).
+ *A port that hangs up is closed and its row removed from the port table, and wbtvd exits when none are left.
+ *
+ *Usage: wbtvd -p port[:speed] [-p port[:speed] ...] [-s 115200] [-f /dev/shm/wbtv.db] [-k 69]
+ *             [--sync 5] [--time-error 300] [--poll 20] [--ring /dev/shm/wbtv.ring] [--ring-size 1048576]
+ *             [--capture dir] [--capture-raw] [--capture-size 64] [-v]
+ *
+ *-s is the speed for ports that don't give their own. -k is how many seconds messages are kept.
+ *--sync is how often to send TIME on every port, 0 for never, and --time-error how far off in seconds the
+ *computer's clock could be. -v prints every message that comes in.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include "WBTVNode.h"
+#include "WBTVShmRing.h"
+#include "WBTVCapture.h"
+
+static const char *tabledefs =
+  "CREATE TABLE IF NOT EXISTS message\n"
+  "(\n"
+  "id INTEGER PRIMARY KEY AUTOINCREMENT,\n"
+  "time INTEGER DEFAULT(round( (julianday('now') - 2440587.5) *86400.0)),\n"
+  "time_fraction REAL DEFAULT 0.5,\n"
+  "origin TEXT DEFAULT \"localhost\",\n"
+  "destination TEXT DEFAULT \"PORTS\",\n"
+  "channel BLOB,\n"
+  "data BLOB\n"
+  ");\n"
+  "\n"
+  "CREATE TABLE IF NOT EXISTS port\n"
+  "(\n"
+  "id INTEGER PRIMARY KEY,\n"
+  "name TEXT,\n"
+  "speed integer,\n"
+  "traffic real DEFAULT 0,\n"
+  "last_online integer DEFAULT(round( (julianday('now') - 2440587.5) *86400.0))\n"
+  ");\n"
+  //Not in the python version. Expiring old messages would otherwise scan the whole table.
+  "CREATE INDEX IF NOT EXISTS message_time ON message(time);\n";
+
+//Frames older than this when we first see them aren't sent, they may only have been good at the time.
+#define STALE_SECONDS 5
+//Stop queueing for a port that isn't taking anything
+#define MAX_PENDING 65536
+
+/*
+ *The node's side of a port. Written bytes pile up until flushOut() hands them to the kernel in one write().
+ *Reading goes around the Stream, straight into decodeBuffer().
+ */
+class FdStream : public Stream
+{
+public:
+  FdStream() : fd(-1) {}
+  int available() { return 0; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  size_t write(uint8_t chr)
+  {
+    out.push_back(chr);
+    return 1;
+  }
+  //Whole frames come through here with WBTV_BULK_WRITE
+  size_t write(const uint8_t *buffer, size_t size)
+  {
+    out.insert(out.end(), buffer, buffer + size);
+    return size;
+  }
+
+  //Write as much as the port will take. False if the port is gone.
+  bool flushOut()
+  {
+    while (!out.empty())
+    {
+      ssize_t n = ::write(fd, out.data(), out.size());
+      if (n < 0)
+      {
+        return (errno == EAGAIN) || (errno == EINTR);
+      }
+      out.erase(out.begin(), out.begin() + n);
+    }
+    return true;
+  }
+
+  int fd;
+  std::vector<uint8_t> out;
+};
+
+struct Port
+{
+  //stream has to come first, the node keeps a pointer to it.
+  Port() : node(&stream), id(0), speed(0), bytes(0), traffic(0), writing(false), hungUp(false) {}
+  FdStream stream;
+  WBTVSizedNode<255> node;
+  std::string name;
+  //Which -p this was, counting from 0, which is how the ring refers to it
+  uint16_t id;
+  long speed;
+  //Bytes in and out since the traffic was last worked out, and the average in bytes per second
+  unsigned long bytes;
+  double traffic;
+  //Waiting for EPOLLOUT
+  bool writing;
+  //The other end went away. Nothing more is sent to it, and it's dropped once this wakeup's messages are stored.
+  bool hungUp;
+};
+
+struct Incoming
+{
+  Port *port;
+  std::string channel;
+  std::string data;
+  struct timespec at;
+};
+
+struct Options
+{
+  const char *db;
+  std::vector<std::string> ports;
+  long speed;
+  double keep;
+  double sync;
+  double timeError;
+  double poll;
+  const char *ring;
+  size_t ringSize;
+  const char *capture;
+  bool captureRaw;
+  double captureSize;
+  bool verbose;
+};
+
+static std::vector<Incoming> batch;
+//Which port decodeBuffer() is working on, and when its bytes came in
+static Port *decoding;
+static struct timespec decodingAt;
+static bool verbose;
+
+static void onMessage(unsigned char *channel, unsigned char channellen, unsigned char *data, unsigned char datalen)
+{
+  Incoming in;
+  in.port = decoding;
+  in.channel.assign((const char *)channel, channellen);
+  in.data.assign((const char *)data, datalen);
+  in.at = decodingAt;
+  batch.push_back(in);
+  if (verbose)
+  {
+    printf("%s: %.*s ~ %u bytes\n", decoding->name.c_str(), (int)channellen, (const char *)channel, datalen);
+  }
+}
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static speed_t baudConstant(long baud)
+{
+  switch (baud)
+  {
+  case 1200: return B1200;
+  case 2400: return B2400;
+  case 4800: return B4800;
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  case 460800: return B460800;
+  case 500000: return B500000;
+  case 921600: return B921600;
+  case 1000000: return B1000000;
+  }
+  return 0;
+}
+
+//Raw, non blocking, at the given speed. A pty takes the same settings, it just ignores the speed.
+static int openPort(const char *name, long baud)
+{
+  struct termios tio;
+  speed_t speed = baudConstant(baud);
+  int fd;
+
+  if (!speed)
+  {
+    fprintf(stderr, "%s: unsupported speed %ld\n", name, baud);
+    return -1;
+  }
+  fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+  {
+    perror(name);
+    return -1;
+  }
+  if (isatty(fd))
+  {
+    if (tcgetattr(fd, &tio) < 0)
+    {
+      perror(name);
+      close(fd);
+      return -1;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tio) < 0)
+    {
+      perror(name);
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/*
+ *The TIME payload python/wbtv.py sends: 64 bit seconds, 32 bit fraction, and the error as a
+ *mantissa times 2**exponent seconds, all little endian.
+ */
+static void sendTime(Port *port, double error)
+{
+  unsigned char payload[14];
+  double t;
+  long long seconds;
+  unsigned long fraction;
+  signed char exponent = -16;
+  unsigned int mantissa;
+  int i;
+
+  //Smallest exponent that gets the mantissa in a byte, rounding the error up
+  while ((exponent < 127) && (ceil(error / ldexp(1.0, exponent)) > 255))
+  {
+    exponent++;
+  }
+  mantissa = (unsigned int)ceil(error / ldexp(1.0, exponent));
+
+  //Half a millisecond for the trip through the USB adapter, as the python version does
+  t = now() + 0.00055;
+  seconds = (long long)t;
+  fraction = (unsigned long)((t - seconds) * 4294967296.0);
+  for (i = 0; i < 8; i++)
+  {
+    payload[i] = (seconds >> (8 * i)) & 0xff;
+  }
+  for (i = 0; i < 4; i++)
+  {
+    payload[8 + i] = (fraction >> (8 * i)) & 0xff;
+  }
+  payload[12] = (unsigned char)exponent;
+  payload[13] = mantissa;
+  port->node.sendMessage((const unsigned char *)"TIME", 4, payload, sizeof(payload));
+}
+
+class Database
+{
+public:
+  Database() : db(0), insert(0), outbound(0), expire(0), portUpdate(0), highest(0) {}
+
+  bool open(const char *path)
+  {
+    if (sqlite3_open(path, &db) != SQLITE_OK)
+    {
+      fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+      return false;
+    }
+    sqlite3_busy_timeout(db, 2000);
+    if (!exec(tabledefs))
+    {
+      return false;
+    }
+    if (!prepare("INSERT INTO message(time,time_fraction,origin,destination,channel,data) VALUES (?,?,?,'localhost',?,?)", &insert) ||
+        !prepare("SELECT id,destination,channel,data FROM message WHERE id>? AND time>? AND destination!='localhost' ORDER BY id", &outbound) ||
+        !prepare("DELETE FROM message WHERE time<?", &expire) ||
+        !prepare("UPDATE port SET traffic=?, last_online=? WHERE name=?", &portUpdate))
+    {
+      return false;
+    }
+
+    //Only rows written from now on go out, like the python version
+    sqlite3_stmt *st;
+    if (prepare("SELECT MAX(id) FROM message", &st))
+    {
+      if (sqlite3_step(st) == SQLITE_ROW)
+      {
+        highest = sqlite3_column_int64(st, 0);
+      }
+      sqlite3_finalize(st);
+    }
+    return true;
+  }
+
+  ~Database()
+  {
+    sqlite3_finalize(insert);
+    sqlite3_finalize(outbound);
+    sqlite3_finalize(expire);
+    sqlite3_finalize(portUpdate);
+    sqlite3_close(db);
+  }
+
+  bool exec(const char *sql)
+  {
+    char *err = 0;
+    if (sqlite3_exec(db, sql, 0, 0, &err) != SQLITE_OK)
+    {
+      fprintf(stderr, "sqlite: %s\n", err ? err : sqlite3_errmsg(db));
+      sqlite3_free(err);
+      return false;
+    }
+    return true;
+  }
+
+  bool prepare(const char *sql, sqlite3_stmt **st)
+  {
+    if (sqlite3_prepare_v2(db, sql, -1, st, 0) != SQLITE_OK)
+    {
+      fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(db));
+      return false;
+    }
+    return true;
+  }
+
+  void addPort(const Port *port)
+  {
+    sqlite3_stmt *st;
+    if (prepare("DELETE FROM port WHERE name=?", &st))
+    {
+      sqlite3_bind_text(st, 1, port->name.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_step(st);
+      sqlite3_finalize(st);
+    }
+    if (prepare("INSERT INTO port(name,speed) VALUES (?,?)", &st))
+    {
+      sqlite3_bind_text(st, 1, port->name.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(st, 2, port->speed);
+      sqlite3_step(st);
+      sqlite3_finalize(st);
+    }
+  }
+
+  void removePort(const Port *port)
+  {
+    sqlite3_stmt *st;
+    if (prepare("DELETE FROM port WHERE name=?", &st))
+    {
+      sqlite3_bind_text(st, 1, port->name.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_step(st);
+      sqlite3_finalize(st);
+    }
+  }
+
+  void store(const Incoming &in)
+  {
+    sqlite3_bind_int64(insert, 1, in.at.tv_sec);
+    sqlite3_bind_double(insert, 2, in.at.tv_nsec / 1e9);
+    sqlite3_bind_text(insert, 3, in.port->name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_blob(insert, 4, in.channel.data(), in.channel.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(insert, 5, in.data.data(), in.data.size(), SQLITE_STATIC);
+    if (sqlite3_step(insert) != SQLITE_DONE)
+    {
+      fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(db));
+    }
+    sqlite3_reset(insert);
+  }
+
+  //Send every row written since last time to the ports it is for.
+  void sendNew(std::vector<Port *> &ports, double started)
+  {
+    size_t i;
+    sqlite3_bind_int64(outbound, 1, highest);
+    sqlite3_bind_double(outbound, 2, fmax(started, now() - STALE_SECONDS) - 1);
+    while (sqlite3_step(outbound) == SQLITE_ROW)
+    {
+      const char *dest = (const char *)sqlite3_column_text(outbound, 1);
+      const unsigned char *channel = (const unsigned char *)sqlite3_column_blob(outbound, 2);
+      int channellen = sqlite3_column_bytes(outbound, 2);
+      const unsigned char *data = (const unsigned char *)sqlite3_column_blob(outbound, 3);
+      int datalen = sqlite3_column_bytes(outbound, 3);
+      bool all;
+
+      highest = sqlite3_column_int64(outbound, 0);
+      if (!dest)
+      {
+        continue;
+      }
+      all = !strcmp(dest, "PORTS") || !strcmp(dest, "ALL") || !strcmp(dest, "PORT");
+      if (WBTV_RX_SIZE(channellen, datalen, 0) > WBTV_MAX_MESSAGE)
+      {
+        fprintf(stderr, "message %lld is too long for a node to recieve, not sent\n", (long long)highest);
+        continue;
+      }
+      for (i = 0; i < ports.size(); i++)
+      {
+        if ((all || (ports[i]->name == dest)) && !ports[i]->hungUp && (ports[i]->stream.out.size() < MAX_PENDING))
+        {
+          ports[i]->node.sendMessage(channel, channellen, data, datalen);
+        }
+      }
+    }
+    sqlite3_reset(outbound);
+  }
+
+  void expireOld(double keep)
+  {
+    sqlite3_bind_double(expire, 1, now() - keep);
+    sqlite3_step(expire);
+    sqlite3_reset(expire);
+  }
+
+  void updatePort(const Port *port)
+  {
+    sqlite3_bind_double(portUpdate, 1, port->traffic);
+    sqlite3_bind_int64(portUpdate, 2, (sqlite3_int64)now());
+    sqlite3_bind_text(portUpdate, 3, port->name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_step(portUpdate);
+    sqlite3_reset(portUpdate);
+  }
+
+private:
+  sqlite3 *db;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *outbound;
+  sqlite3_stmt *expire;
+  sqlite3_stmt *portUpdate;
+  sqlite3_int64 highest;
+};
+
+static void setWriting(int ep, Port *port, bool writing)
+{
+  struct epoll_event ev;
+  if (port->writing == writing)
+  {
+    return;
+  }
+  port->writing = writing;
+  ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+  ev.data.ptr = port;
+  epoll_ctl(ep, EPOLL_CTL_MOD, port->stream.fd, &ev);
+}
+
+//Push out whatever the nodes wrote. Anything the port won't take yet goes when EPOLLOUT says so.
+static void flushPorts(int ep, std::vector<Port *> &ports)
+{
+  size_t i;
+  for (i = 0; i < ports.size(); i++)
+  {
+    size_t before = ports[i]->stream.out.size();
+    if (!before || ports[i]->hungUp)
+    {
+      continue;
+    }
+    if (!ports[i]->stream.flushOut())
+    {
+      perror(ports[i]->name.c_str());
+      ports[i]->stream.out.clear();
+    }
+    ports[i]->bytes += before - ports[i]->stream.out.size();
+    setWriting(ep, ports[i], !ports[i]->stream.out.empty());
+  }
+}
+
+int main(int argc, char **argv)
+{
+  Options o;
+  std::vector<Port *> ports;
+  Database db;
+  WBTVShmWriter ring;
+  WBTVCaptureWriter capture;
+  int i, ep, sigfd, inofd;
+  sigset_t mask;
+  struct epoll_event ev;
+  double started, nextSync, nextHousekeeping, lastHousekeeping;
+  bool running = true;
+
+  o.db = "/dev/shm/wbtv.db";
+  o.speed = 115200;
+  o.keep = 69;
+  o.sync = 5;
+  o.timeError = 300;
+  o.poll = 20;
+  o.ring = 0;
+  o.ringSize = 1 << 20;
+  o.capture = 0;
+  o.captureRaw = false;
+  o.captureSize = 64;
+  o.verbose = false;
+
+  for (i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *val = (i + 1 < argc) ? argv[i + 1] : "";
+    if (!strcmp(arg, "-v"))
+    {
+      o.verbose = true;
+      continue;
+    }
+    if (!strcmp(arg, "--capture-raw"))
+    {
+      o.captureRaw = true;
+      continue;
+    }
+    if (!strcmp(arg, "-p")) o.ports.push_back(val);
+    else if (!strcmp(arg, "-s")) o.speed = atol(val);
+    else if (!strcmp(arg, "-f")) o.db = val;
+    else if (!strcmp(arg, "-k")) o.keep = atof(val);
+    else if (!strcmp(arg, "--sync")) o.sync = atof(val);
+    else if (!strcmp(arg, "--time-error")) o.timeError = atof(val);
+    else if (!strcmp(arg, "--poll")) o.poll = atof(val);
+    else if (!strcmp(arg, "--ring")) o.ring = val;
+    else if (!strcmp(arg, "--ring-size")) o.ringSize = strtoul(val, 0, 0);
+    else if (!strcmp(arg, "--capture")) o.capture = val;
+    else if (!strcmp(arg, "--capture-size")) o.captureSize = atof(val);
+    else
+    {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return 1;
+    }
+    i++;
+  }
+  if (o.ports.empty() || (o.poll <= 0))
+  {
+    fprintf(stderr, "usage: wbtvd -p port[:speed] [-p port[:speed] ...] [-s speed] [-f file] [-k seconds]\n"
+                    "             [--sync seconds] [--time-error seconds] [--poll hz] [--ring file] [--ring-size bytes]\n"
+                    "             [--capture dir] [--capture-raw] [--capture-size megabytes] [-v]\n");
+    return 1;
+  }
+  verbose = o.verbose;
+
+  if (!db.open(o.db))
+  {
+    return 1;
+  }
+  if (o.ring && !ring.create(o.ring, o.ringSize))
+  {
+    return 1;
+  }
+  if (o.capture && !capture.open(o.capture, (uint64_t)(o.captureSize * 1048576)))
+  {
+    return 1;
+  }
+
+  ep = epoll_create1(0);
+  for (i = 0; i < (int)o.ports.size(); i++)
+  {
+    Port *port = new Port;
+    size_t colon = o.ports[i].rfind(':');
+    port->name = o.ports[i];
+    port->id = i;
+    port->speed = o.speed;
+    if (colon != std::string::npos)
+    {
+      port->name = o.ports[i].substr(0, colon);
+      port->speed = atol(o.ports[i].c_str() + colon + 1);
+    }
+    port->stream.fd = openPort(port->name.c_str(), port->speed);
+    if (port->stream.fd < 0)
+    {
+      return 1;
+    }
+    port->node.setBinaryCallback(&onMessage);
+    #ifdef WBTV_ADV_MODE
+    //TIME messages go in the table like everything else
+    port->node.PASS_TIME = 1;
+    #endif
+    ev.events = EPOLLIN;
+    ev.data.ptr = port;
+    epoll_ctl(ep, EPOLL_CTL_ADD, port->stream.fd, &ev);
+    db.addPort(port);
+    ring.setPortName(port->id, port->name.c_str());
+    if (o.capture)
+    {
+      capture.setPortName(port->id, port->name.c_str());
+    }
+    ports.push_back(port);
+  }
+
+  //Shut down through the loop so the port rows get cleaned up
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, 0);
+  sigfd = signalfd(-1, &mask, SFD_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &sigfd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sigfd, &ev);
+
+  //Anyone writing to the database wakes us up. Just the file itself and its -wal are watched, the directory is
+  //usually /dev/shm and busy with everybody else's files. A commit with a rollback journal ends by writing the
+  //database, and the -wal is there for as long as anyone has the database open in WAL mode, which we do by now.
+  {
+    std::string wal(o.db);
+    wal += "-wal";
+    inofd = inotify_init1(IN_NONBLOCK);
+    if ((inofd >= 0) && (inotify_add_watch(inofd, o.db, IN_MODIFY | IN_CLOSE_WRITE) >= 0))
+    {
+      inotify_add_watch(inofd, wal.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+      ev.events = EPOLLIN;
+      ev.data.ptr = &inofd;
+      epoll_ctl(ep, EPOLL_CTL_ADD, inofd, &ev);
+    }
+  }
+
+  printf("Listening\n");
+  fflush(stdout);
+  started = now();
+  nextSync = started;
+  lastHousekeeping = started;
+  nextHousekeeping = started + 1;
+
+  while (running)
+  {
+    struct epoll_event events[16];
+    int n, e, timeout;
+    double t;
+
+    t = now();
+    timeout = (int)(1000 / o.poll);
+    if (o.sync > 0 && (nextSync - t) * 1000 < timeout)
+    {
+      timeout = (int)fmax(0, (nextSync - t) * 1000);
+    }
+    n = epoll_wait(ep, events, 16, timeout);
+    if (n < 0 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      break;
+    }
+
+    for (e = 0; e < n; e++)
+    {
+      if (events[e].data.ptr == &sigfd)
+      {
+        running = false;
+        continue;
+      }
+      if (events[e].data.ptr == &inofd)
+      {
+        //The outgoing check below runs on every wakeup, these just need draining.
+        char buf[4096];
+        while (read(inofd, buf, sizeof(buf)) > 0)
+        {
+        }
+        continue;
+      }
+
+      Port *port = (Port *)events[e].data.ptr;
+      if (events[e].events & EPOLLOUT)
+      {
+        flushPorts(ep, ports);
+      }
+      if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      {
+        unsigned char buf[4096];
+        ssize_t got;
+        decoding = port;
+        while ((got = read(port->stream.fd, buf, sizeof(buf))) > 0)
+        {
+          clock_gettime(CLOCK_REALTIME, &decodingAt);
+          if (o.captureRaw)
+          {
+            capture.append(decodingAt.tv_sec * 1000000000ULL + decodingAt.tv_nsec, port->id, WBTV_CAPTURE_RAW, 0, 0, buf, got);
+          }
+          port->node.decodeBuffer(buf, got);
+          port->bytes += got;
+        }
+        //A tty in raw mode reads 0 when it's empty, so it's only gone if epoll says so too, or the read fails outright.
+        if (((got == 0) && (events[e].events & (EPOLLHUP | EPOLLERR))) || ((got < 0) && (errno != EAGAIN) && (errno != EINTR)))
+        {
+          //A pty with nothing on the other end keeps reporting HUP, so stop watching it. It can't be deleted
+          //yet, what it sent this time round is still in the batch.
+          fprintf(stderr, "%s: hung up\n", port->name.c_str());
+          epoll_ctl(ep, EPOLL_CTL_DEL, port->stream.fd, 0);
+          port->hungUp = true;
+        }
+      }
+    }
+
+    t = now();
+    //The ring first, it's much quicker for readers to get to than the database
+    for (size_t b = 0; b < batch.size(); b++)
+    {
+      const Incoming &in = batch[b];
+      uint64_t at = in.at.tv_sec * 1000000000ULL + in.at.tv_nsec;
+      ring.append(at, in.port->id, (const uint8_t *)in.channel.data(), in.channel.size(), (const uint8_t *)in.data.data(), in.data.size());
+      if (o.capture)
+      {
+        capture.append(at, in.port->id, WBTV_CAPTURE_DECODED, (const uint8_t *)in.channel.data(), in.channel.size(),
+                       (const uint8_t *)in.data.data(), in.data.size());
+      }
+    }
+    capture.flush();
+    if (!batch.empty())
+    {
+      ring.wake();
+    }
+
+    db.exec("BEGIN");
+    for (size_t b = 0; b < batch.size(); b++)
+    {
+      db.store(batch[b]);
+    }
+    batch.clear();
+
+    //Ports that hung up are gone for good, along with their row in the port table
+    for (size_t p = 0; p < ports.size();)
+    {
+      if (!ports[p]->hungUp)
+      {
+        p++;
+        continue;
+      }
+      db.removePort(ports[p]);
+      close(ports[p]->stream.fd);
+      delete ports[p];
+      ports.erase(ports.begin() + p);
+    }
+    if (ports.empty())
+    {
+      fprintf(stderr, "No ports left\n");
+      running = false;
+    }
+
+    if (o.sync > 0 && t >= nextSync)
+    {
+      for (size_t p = 0; p < ports.size(); p++)
+      {
+        sendTime(ports[p], o.timeError);
+      }
+      nextSync = t + o.sync;
+    }
+    db.sendNew(ports, started);
+
+    if (t >= nextHousekeeping)
+    {
+      db.expireOld(o.keep);
+      for (size_t p = 0; p < ports.size(); p++)
+      {
+        //Same average as python/wbtv.py
+        ports[p]->traffic = ports[p]->traffic * 0.95 + (ports[p]->bytes / (t - lastHousekeeping)) * 0.05;
+        ports[p]->bytes = 0;
+        db.updatePort(ports[p]);
+      }
+      lastHousekeeping = t;
+      nextHousekeeping = t + 1;
+    }
+    db.exec("COMMIT");
+    flushPorts(ep, ports);
+  }
+
+  capture.close();
+  db.exec("BEGIN");
+  for (size_t p = 0; p < ports.size(); p++)
+  {
+    db.removePort(ports[p]);
+    close(ports[p]->stream.fd);
+    delete ports[p];
+  }
+  db.exec("COMMIT");
+  return 0;
+}
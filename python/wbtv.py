@@ -92,6 +92,8 @@ class Parser():
         self.inheader = True     #If we are currently recieving header data
         self.header = bytearray(0)
         self.message = bytearray(0)
+        self.xor = 0             #How far into the !~~ and key of an XOR framed frame we are, 3 once we have the key
+        self.key = 0
     
     def _insbuf(self,byte):
         """Based on if we are in the header or the message, but a byte in the appropriate place"""
@@ -109,6 +111,9 @@ class Parser():
         #If the last byte was an escaped escape put this byte literally in, unset the flag and return
         if self.escape:
             self.escape = False
+            if self.xor == 1:
+                self.inheader = False
+                self.xor = 0
             self._insbuf(byte)
             return
 
@@ -119,6 +124,10 @@ class Parser():
             return
         #If the byte is an unescaped start of text marker, set the flag that says we are in the message not the header.
         if byte == ord("~"):
+            #Two ~ straight after the ! mean an XOR framed frame, with the key next. See WBTVEncode.h
+            if self.inheader and not self.header and self.xor < 2:
+                self.xor += 1
+                return
             self.inheader = False;
             return;
         #If the byte is a newline, that is the end of a message
@@ -143,8 +152,21 @@ class Parser():
             self.inheader = True
             self.message = bytearray(0)
             self.header = bytearray(0)
+            self.xor = 0
             return
 
+        #A ~ on its own in front is just an empty header. Otherwise the byte after the second is the key,
+        #and every byte after that is XORed with it and never escaped.
+        if self.xor == 1:
+            self.inheader = False
+            self.xor = 0
+        elif self.xor == 2:
+            self.key = byte
+            self.xor = 3
+            return
+        elif self.xor == 3:
+            byte ^= self.key
+
         #If we got this far, the byte was just a byte of data to be put in the header or message depending on the state.
         self._insbuf(byte)
 